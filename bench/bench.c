@@ -0,0 +1,1035 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * microbenchmarks for the event loop and its backends.
+ *
+ * every benchmark is run against every backend compiled into the
+ * library, and each result is printed on its own line as key=value
+ * pairs so runs can be compared by scripts. times are the median of
+ * several runs.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <evl.h>
+
+#define BENCH_RUNS	5
+#define BENCH_MAXRUNS	64
+
+struct bench {
+	const char	  *b_name;
+	void		 (*b_fn)(const char *);
+};
+
+static void	bench_pingpong(const char *);
+static void	bench_timers(const char *);
+static void	bench_dense(const char *);
+static void	bench_io(const char *);
+static void	bench_work(const char *);
+static void	bench_aio(const char *);
+static void	bench_listen(const char *);
+
+static const struct bench benches[] = {
+	{ "pingpong",	bench_pingpong },
+	{ "timers",	bench_timers },
+	{ "dense",	bench_dense },
+	{ "io",		bench_io },
+	{ "work",	bench_work },
+	{ "aio",	bench_aio },
+	{ "listen",	bench_listen },
+};
+
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+
+static int		 quick;
+static unsigned int	 runs = BENCH_RUNS;
+static uint64_t		 rng;
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-q] [-b backend] [-r runs] "
+	    "[benchmark ...]\n", __progname);
+	exit(1);
+}
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/* the same sequence every time so runs are comparable */
+static void
+rng_seed(void)
+{
+	rng = 0x9e3779b97f4a7c15ULL;
+}
+
+static uint32_t
+rng_uniform(uint32_t n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+
+	return ((uint32_t)(rng >> 32) % n);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static uint64_t
+median(uint64_t *v, unsigned int n)
+{
+	qsort(v, n, sizeof(*v), cmp_u64);
+	return (v[n / 2]);
+}
+
+static void
+result(const char *backend, const char *bench, const char *params,
+    uint64_t ops, uint64_t ns)
+{
+	printf("backend=%s bench=%s %s ops=%llu nsecs=%llu ns_per_op=%.1f\n",
+	    backend, bench, params, (unsigned long long)ops,
+	    (unsigned long long)ns, ops ? (double)ns / (double)ops : 0.0);
+	fflush(stdout);
+}
+
+static struct evl_base *
+base(const char *backend)
+{
+	struct evl_base *evlb;
+
+	evlb = evl_init_backend(backend);
+	if (evlb == NULL)
+		err(1, "evl_init_backend %s", backend);
+
+	return (evlb);
+}
+
+static int
+nofile(unsigned int nfds)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	if (rl.rlim_cur >= nfds)
+		return (0);
+
+	if (rl.rlim_max < nfds)
+		return (-1);
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * pipe ping-pong, after libevent's bench.c. npipes socketpairs are
+ * watched and nactive of them are written to. every byte that is read
+ * is passed on to the next pipe until nwrites bytes have been sent.
+ */
+
+struct pp_pipe {
+	struct pp_state	*p_state;
+	struct evl_io	*p_io;
+	int		 p_fds[2];
+	unsigned int	 p_idx;
+};
+
+struct pp_state {
+	struct evl_base	*pp_base;
+	struct pp_pipe	*pp_pipes;
+	unsigned int	 pp_npipes;
+	unsigned int	 pp_writes;
+	unsigned int	 pp_count;
+	unsigned int	 pp_total;
+};
+
+static void
+pp_write(struct pp_state *pp, unsigned int idx)
+{
+	if (write(pp->pp_pipes[idx].p_fds[1], "e", 1) != 1)
+		err(1, "pingpong write");
+}
+
+static void
+pp_read(int fd, int events, void *arg)
+{
+	struct pp_pipe *p = arg;
+	struct pp_state *pp = p->p_state;
+	char buf[64];
+	ssize_t rv;
+
+	rv = read(fd, buf, sizeof(buf));
+	if (rv == -1)
+		err(1, "pingpong read");
+
+	while (rv-- > 0) {
+		pp->pp_count++;
+		if (pp->pp_writes > 0) {
+			pp->pp_writes--;
+			pp_write(pp, (p->p_idx + 1) % pp->pp_npipes);
+		}
+	}
+
+	if (pp->pp_count == pp->pp_total)
+		evl_break(pp->pp_base);
+}
+
+static void
+pingpong(const char *backend, unsigned int npipes, unsigned int nactive)
+{
+	struct pp_state pp;
+	struct pp_pipe *p;
+	uint64_t t[BENCH_MAXRUNS], start;
+	unsigned int i, r, space;
+	char params[64];
+
+	if (nofile(npipes * 2 + 32) == -1) {
+		warnx("pingpong: not enough fds for %u pipes", npipes);
+		return;
+	}
+
+	pp.pp_base = base(backend);
+	pp.pp_npipes = npipes;
+	pp.pp_pipes = calloc(npipes, sizeof(*pp.pp_pipes));
+	if (pp.pp_pipes == NULL)
+		err(1, "pingpong pipes");
+
+	for (i = 0; i < npipes; i++) {
+		p = &pp.pp_pipes[i];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, p->p_fds) == -1)
+			err(1, "socketpair");
+		p->p_state = &pp;
+		p->p_idx = i;
+		p->p_io = evl_io_create(pp.pp_base, p->p_fds[0],
+		    EVL_READ | EVL_PERSIST, pp_read, p);
+		if (p->p_io == NULL)
+			err(1, "evl_io_create");
+		evl_io_add(p->p_io);
+	}
+
+	space = npipes / nactive;
+	for (r = 0; r < runs; r++) {
+		pp.pp_writes = npipes;
+		pp.pp_count = 0;
+		pp.pp_total = nactive + npipes;
+
+		start = nsecs();
+		for (i = 0; i < nactive; i++)
+			pp_write(&pp, i * space);
+		if (evl_dispatch(pp.pp_base) == -1)
+			err(1, "evl_dispatch");
+		t[r] = nsecs() - start;
+	}
+
+	snprintf(params, sizeof(params), "pipes=%u active=%u", npipes,
+	    nactive);
+	result(backend, "pingpong", params, pp.pp_total, median(t, runs));
+
+	for (i = 0; i < npipes; i++) {
+		p = &pp.pp_pipes[i];
+		evl_io_del(p->p_io);
+		evl_io_destroy(p->p_io);
+		close(p->p_fds[0]);
+		close(p->p_fds[1]);
+	}
+	free(pp.pp_pipes);
+	evl_destroy(pp.pp_base);
+}
+
+static void
+bench_pingpong(const char *backend)
+{
+	/* the simulator never sees real fds become ready */
+	if (strcmp(backend, "sim") == 0)
+		return;
+
+	pingpong(backend, 100, 1);
+	pingpong(backend, 1000, 1);
+	pingpong(backend, 1000, 100);
+	if (quick)
+		return;
+	pingpong(backend, 10000, 100);
+	pingpong(backend, 10000, 1000);
+}
+
+/*
+ * timeout churn. timeouts are added with random deadlines, then
+ * removed, rescheduled, or left to expire.
+ */
+
+struct tm_state {
+	struct evl_base	*tm_base;
+	unsigned int	 tm_fired;
+	unsigned int	 tm_n;
+};
+
+static void
+tm_fire(int nil, int events, void *arg)
+{
+	struct tm_state *tm = arg;
+
+	if (++tm->tm_fired == tm->tm_n)
+		evl_break(tm->tm_base);
+}
+
+static void
+tm_offset(struct timespec *ts, uint32_t range)
+{
+	uint32_t ns = rng_uniform(range);
+
+	ts->tv_sec = 1 + ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static void
+timers(const char *backend, unsigned int n)
+{
+	struct tm_state tm;
+	struct evl_tmo **tmos;
+	struct timespec ts;
+	uint64_t tadd[BENCH_MAXRUNS], tmod[BENCH_MAXRUNS];
+	uint64_t tdel[BENCH_MAXRUNS], texp[BENCH_MAXRUNS], start;
+	unsigned int i, r;
+	char params[64];
+
+	tm.tm_base = base(backend);
+	tm.tm_n = n;
+
+	tmos = calloc(n, sizeof(*tmos));
+	if (tmos == NULL)
+		err(1, "timers");
+	for (i = 0; i < n; i++) {
+		tmos[i] = evl_tmo_create(tm.tm_base, tm_fire, &tm);
+		if (tmos[i] == NULL)
+			err(1, "evl_tmo_create");
+	}
+
+	for (r = 0; r < runs; r++) {
+		rng_seed();
+
+		start = nsecs();
+		for (i = 0; i < n; i++) {
+			tm_offset(&ts, 100000000);
+			evl_tmo_add(tmos[i], &ts);
+		}
+		tadd[r] = nsecs() - start;
+
+		/* move random timeouts around like idle timers do */
+		start = nsecs();
+		for (i = 0; i < n; i++) {
+			tm_offset(&ts, 100000000);
+			evl_tmo_add(tmos[rng_uniform(n)], &ts);
+		}
+		tmod[r] = nsecs() - start;
+
+		start = nsecs();
+		for (i = 0; i < n; i++)
+			evl_tmo_del(tmos[i]);
+		tdel[r] = nsecs() - start;
+
+		/* deadlines within a microsecond have all passed by dispatch */
+		ts.tv_sec = 0;
+		for (i = 0; i < n; i++) {
+			ts.tv_nsec = rng_uniform(1000);
+			evl_tmo_add(tmos[i], &ts);
+		}
+		tm.tm_fired = 0;
+		start = nsecs();
+		if (evl_dispatch(tm.tm_base) == -1)
+			err(1, "evl_dispatch");
+		texp[r] = nsecs() - start;
+	}
+
+	snprintf(params, sizeof(params), "op=add timers=%u", n);
+	result(backend, "timers", params, n, median(tadd, runs));
+	snprintf(params, sizeof(params), "op=resched timers=%u", n);
+	result(backend, "timers", params, n, median(tmod, runs));
+	snprintf(params, sizeof(params), "op=del timers=%u", n);
+	result(backend, "timers", params, n, median(tdel, runs));
+	snprintf(params, sizeof(params), "op=expire timers=%u", n);
+	result(backend, "timers", params, n, median(texp, runs));
+
+	for (i = 0; i < n; i++)
+		evl_tmo_destroy(tmos[i]);
+	free(tmos);
+	evl_destroy(tm.tm_base);
+}
+
+static void
+bench_timers(const char *backend)
+{
+	timers(backend, 1000);
+	timers(backend, 10000);
+	timers(backend, 100000);
+	if (quick)
+		return;
+	timers(backend, 1000000);
+}
+
+/*
+ * the same timeout churn with dense events.
+ */
+
+static void
+dense(const char *backend, unsigned int n)
+{
+	struct tm_state tm;
+	uint64_t *hs;
+	struct timespec ts;
+	uint64_t tadd[BENCH_MAXRUNS], tmod[BENCH_MAXRUNS];
+	uint64_t tdel[BENCH_MAXRUNS], texp[BENCH_MAXRUNS], start;
+	unsigned int i, r;
+	char params[64];
+
+	tm.tm_base = base(backend);
+	tm.tm_n = n;
+
+	hs = calloc(n, sizeof(*hs));
+	if (hs == NULL)
+		err(1, "dense");
+	for (i = 0; i < n; i++) {
+		hs[i] = evl_dense_create(tm.tm_base, 0, tm_fire, &tm);
+		if (hs[i] == 0)
+			err(1, "evl_dense_create");
+	}
+
+	for (r = 0; r < runs; r++) {
+		rng_seed();
+
+		start = nsecs();
+		for (i = 0; i < n; i++) {
+			tm_offset(&ts, 100000000);
+			evl_dense_add(tm.tm_base, hs[i], &ts);
+		}
+		tadd[r] = nsecs() - start;
+
+		start = nsecs();
+		for (i = 0; i < n; i++) {
+			tm_offset(&ts, 100000000);
+			evl_dense_add(tm.tm_base, hs[rng_uniform(n)], &ts);
+		}
+		tmod[r] = nsecs() - start;
+
+		start = nsecs();
+		for (i = 0; i < n; i++)
+			evl_dense_del(tm.tm_base, hs[i]);
+		tdel[r] = nsecs() - start;
+
+		ts.tv_sec = 0;
+		for (i = 0; i < n; i++) {
+			ts.tv_nsec = rng_uniform(1000);
+			evl_dense_add(tm.tm_base, hs[i], &ts);
+		}
+		tm.tm_fired = 0;
+		start = nsecs();
+		if (evl_dispatch(tm.tm_base) == -1)
+			err(1, "evl_dispatch");
+		texp[r] = nsecs() - start;
+	}
+
+	snprintf(params, sizeof(params), "op=add timers=%u", n);
+	result(backend, "dense", params, n, median(tadd, runs));
+	snprintf(params, sizeof(params), "op=resched timers=%u", n);
+	result(backend, "dense", params, n, median(tmod, runs));
+	snprintf(params, sizeof(params), "op=del timers=%u", n);
+	result(backend, "dense", params, n, median(tdel, runs));
+	snprintf(params, sizeof(params), "op=expire timers=%u", n);
+	result(backend, "dense", params, n, median(texp, runs));
+
+	for (i = 0; i < n; i++)
+		evl_dense_destroy(tm.tm_base, hs[i]);
+	free(hs);
+	evl_destroy(tm.tm_base);
+}
+
+static void
+bench_dense(const char *backend)
+{
+	dense(backend, 1000);
+	dense(backend, 10000);
+	dense(backend, 100000);
+	if (quick)
+		return;
+	dense(backend, 1000000);
+}
+
+/*
+ * evl_io churn: create, add, del and destroy an io on the same fd.
+ */
+
+static void
+io_nop(int fd, int events, void *arg)
+{
+}
+
+static void
+bench_io(const char *backend)
+{
+	struct evl_base *evlb;
+	struct evl_io *evlio;
+	uint64_t t[BENCH_MAXRUNS], start;
+	unsigned int i, r, n = quick ? 10000 : 100000;
+	int fds[2];
+	char params[64];
+
+	evlb = base(backend);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		err(1, "socketpair");
+
+	for (r = 0; r < runs; r++) {
+		start = nsecs();
+		for (i = 0; i < n; i++) {
+			evlio = evl_io_create(evlb, fds[0], EVL_READ,
+			    io_nop, NULL);
+			if (evlio == NULL)
+				err(1, "evl_io_create");
+			evl_io_add(evlio);
+			evl_io_del(evlio);
+			evl_io_destroy(evlio);
+		}
+		t[r] = nsecs() - start;
+	}
+
+	snprintf(params, sizeof(params), "op=churn");
+	result(backend, "io", params, n, median(t, runs));
+
+	close(fds[0]);
+	close(fds[1]);
+	evl_destroy(evlb);
+}
+
+/*
+ * evl_work throughput: nwork items requeue themselves until a total
+ * number of callbacks have run.
+ */
+
+struct wk_state {
+	struct evl_base	*wk_base;
+	struct evl_work	**wk_work;
+	unsigned int	 wk_count;
+	unsigned int	 wk_total;
+};
+
+static void
+wk_run(int idx, int events, void *arg)
+{
+	struct wk_state *wk = arg;
+
+	if (++wk->wk_count == wk->wk_total) {
+		evl_break(wk->wk_base);
+		return;
+	}
+
+	evl_work_add(wk->wk_work[idx], 1);
+}
+
+static void
+work(const char *backend, unsigned int nwork)
+{
+	struct wk_state wk;
+	uint64_t t[BENCH_MAXRUNS], start;
+	unsigned int i, r;
+	char params[64];
+
+	wk.wk_base = base(backend);
+	wk.wk_total = quick ? 100000 : 1000000;
+	wk.wk_work = calloc(nwork, sizeof(*wk.wk_work));
+	if (wk.wk_work == NULL)
+		err(1, "work");
+
+	for (i = 0; i < nwork; i++) {
+		wk.wk_work[i] = evl_work_create(wk.wk_base, i, wk_run, &wk);
+		if (wk.wk_work[i] == NULL)
+			err(1, "evl_work_create");
+	}
+
+	for (r = 0; r < runs; r++) {
+		wk.wk_count = 0;
+
+		start = nsecs();
+		for (i = 0; i < nwork; i++)
+			evl_work_add(wk.wk_work[i], 1);
+		if (evl_dispatch(wk.wk_base) == -1)
+			err(1, "evl_dispatch");
+		t[r] = nsecs() - start;
+
+		/* some items are still queued when the loop breaks */
+		for (i = 0; i < nwork; i++)
+			evl_work_del(wk.wk_work[i]);
+	}
+
+	snprintf(params, sizeof(params), "work=%u", nwork);
+	result(backend, "work", params, wk.wk_total, median(t, runs));
+
+	for (i = 0; i < nwork; i++)
+		evl_work_destroy(wk.wk_work[i]);
+	free(wk.wk_work);
+	evl_destroy(wk.wk_base);
+}
+
+static void
+bench_work(const char *backend)
+{
+	work(backend, 1);
+	work(backend, 64);
+	work(backend, 1024);
+}
+
+/*
+ * completion throughput. a read is outstanding on every socketpair,
+ * then all of them are written to at once. more reads than the io_uring
+ * completion ring holds are in flight, so the completions overflow.
+ */
+
+struct ai_sock {
+	struct ai_state	*s_state;
+	struct evl_aio	*s_aio;
+	int		 s_fds[2];
+	char		 s_buf[1];
+};
+
+struct ai_state {
+	struct evl_base	*ai_base;
+	unsigned int	 ai_count;
+	unsigned int	 ai_total;
+};
+
+static void
+ai_done(int fd, int res, void *arg)
+{
+	struct ai_sock *s = arg;
+	struct ai_state *ai = s->s_state;
+
+	if (res != 1)
+		errx(1, "aio read: %d", res);
+
+	if (++ai->ai_count == ai->ai_total)
+		evl_break(ai->ai_base);
+}
+
+static void
+aio(const char *backend, unsigned int naio)
+{
+	struct ai_state ai;
+	struct ai_sock *socks, *s;
+	uint64_t t[BENCH_MAXRUNS], start;
+	unsigned int i, r;
+	char params[64];
+
+	if (nofile(naio * 2 + 32) == -1) {
+		warnx("aio: not enough fds for %u sockets", naio);
+		return;
+	}
+
+	ai.ai_base = base(backend);
+	ai.ai_total = naio;
+	socks = calloc(naio, sizeof(*socks));
+	if (socks == NULL)
+		err(1, "aio sockets");
+
+	for (i = 0; i < naio; i++) {
+		s = &socks[i];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+		    s->s_fds) == -1)
+			err(1, "socketpair");
+		s->s_state = &ai;
+		s->s_aio = evl_aio_create(ai.ai_base, s->s_fds[0],
+		    ai_done, s);
+		if (s->s_aio == NULL)
+			err(1, "evl_aio_create");
+	}
+
+	for (r = 0; r < runs; r++) {
+		ai.ai_count = 0;
+
+		for (i = 0; i < naio; i++) {
+			s = &socks[i];
+			if (evl_aio_read(s->s_aio, s->s_buf,
+			    sizeof(s->s_buf)) == -1)
+				err(1, "evl_aio_read");
+		}
+		/* get the reads to the kernel before anything is ready */
+		if (evl_loop(ai.ai_base, EVL_LOOP_NONBLOCK) == -1)
+			err(1, "evl_loop");
+
+		start = nsecs();
+		for (i = 0; i < naio; i++) {
+			if (write(socks[i].s_fds[1], "a", 1) != 1)
+				err(1, "aio write");
+		}
+		if (evl_dispatch(ai.ai_base) == -1)
+			err(1, "evl_dispatch");
+		t[r] = nsecs() - start;
+	}
+
+	snprintf(params, sizeof(params), "aio=%u", naio);
+	result(backend, "aio", params, ai.ai_total, median(t, runs));
+
+	for (i = 0; i < naio; i++) {
+		s = &socks[i];
+		evl_aio_destroy(s->s_aio);
+		close(s->s_fds[0]);
+		close(s->s_fds[1]);
+	}
+	free(socks);
+	evl_destroy(ai.ai_base);
+}
+
+static void
+bench_aio(const char *backend)
+{
+	/* the simulator never sees real fds become ready */
+	if (strcmp(backend, "sim") == 0)
+		return;
+
+	aio(backend, 100);
+	aio(backend, 1000);
+	if (quick)
+		return;
+	aio(backend, 10000);
+}
+
+/*
+ * accept throughput with an event loop per thread. in the shared mode
+ * every loop watches the same listening socket, in the bind mode each
+ * loop has its own socket from evl_listener_bind. wakeups counts the
+ * times the loops came back from the backend per connection.
+ */
+
+#define LS_WINDOW	128
+
+struct ls_state;
+
+struct ls_loop {
+	struct ls_state		*l_state;
+	pthread_t		 l_thread;
+	struct evl_base		*l_base;
+	struct evl_io		*l_io;		/* stops the loop */
+	int			 l_fds[2];
+	struct evl_stats	 l_stats;
+};
+
+struct ls_state {
+	const char		*ls_backend;
+	int			 ls_fd;		/* -1 for evl_listener_bind */
+	struct sockaddr_in	 ls_sin;
+	pthread_barrier_t	 ls_barrier;
+};
+
+static void
+ls_accept(int s, const struct sockaddr *sa, socklen_t salen, void *arg)
+{
+	close(s);
+}
+
+static void
+ls_stop(int fd, int events, void *arg)
+{
+	struct ls_loop *l = arg;
+
+	evl_break(l->l_base);
+}
+
+static void *
+ls_run(void *arg)
+{
+	struct ls_loop *l = arg;
+	struct ls_state *ls = l->l_state;
+	struct evl_listener *evll;
+
+	l->l_base = base(ls->ls_backend);
+	if (ls->ls_fd != -1) {
+		evll = evl_listener_create(l->l_base, ls->ls_fd, 0,
+		    ls_accept, ls);
+	} else {
+		evll = evl_listener_bind(l->l_base,
+		    (struct sockaddr *)&ls->ls_sin, sizeof(ls->ls_sin), 0,
+		    ls_accept, ls);
+	}
+	if (evll == NULL)
+		err(1, "listener");
+	l->l_io = evl_io_create(l->l_base, l->l_fds[0], EVL_READ, ls_stop, l);
+	if (l->l_io == NULL)
+		err(1, "evl_io_create");
+
+	evl_listener_add(evll);
+	evl_io_add(l->l_io);
+
+	pthread_barrier_wait(&ls->ls_barrier);
+	if (evl_dispatch(l->l_base) == -1)
+		err(1, "evl_dispatch");
+	evl_stats(l->l_base, &l->l_stats);
+
+	evl_io_destroy(l->l_io);
+	evl_listener_destroy(evll);
+	evl_destroy(l->l_base);
+
+	return (NULL);
+}
+
+static void
+ls_connect(struct ls_state *ls, unsigned int n)
+{
+	int fds[LS_WINDOW];
+	unsigned int i, j, w;
+	char c;
+
+	for (i = 0; i < n; i += w) {
+		w = n - i < LS_WINDOW ? n - i : LS_WINDOW;
+
+		for (j = 0; j < w; j++) {
+			fds[j] = socket(AF_INET, SOCK_STREAM, 0);
+			if (fds[j] == -1)
+				err(1, "socket");
+			if (connect(fds[j], (struct sockaddr *)&ls->ls_sin,
+			    sizeof(ls->ls_sin)) == -1)
+				err(1, "connect");
+		}
+
+		/* the loops close each connection as soon as it's accepted */
+		for (j = 0; j < w; j++) {
+			if (read(fds[j], &c, sizeof(c)) == -1)
+				err(1, "read");
+			close(fds[j]);
+		}
+	}
+}
+
+static void
+listen_loops(const char *backend, int shared, unsigned int nloops)
+{
+	struct ls_state ls;
+	struct ls_loop *loops, *l;
+	struct evl_base *evlb;
+	struct evl_listener *evll;
+	socklen_t slen;
+	uint64_t t[BENCH_MAXRUNS], start, wakeups = 0;
+	unsigned int i, r, n = quick ? 1000 : 10000;
+	char params[96];
+
+	if (nofile(nloops * 6 + LS_WINDOW * 2 + 32) == -1) {
+		warnx("listen: not enough fds for %u loops", nloops);
+		return;
+	}
+
+	ls.ls_backend = backend;
+	memset(&ls.ls_sin, 0, sizeof(ls.ls_sin));
+	ls.ls_sin.sin_family = AF_INET;
+	ls.ls_sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	slen = sizeof(ls.ls_sin);
+
+	if (shared) {
+		ls.ls_fd = socket(AF_INET,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ls.ls_fd == -1)
+			err(1, "socket");
+		if (bind(ls.ls_fd, (struct sockaddr *)&ls.ls_sin,
+		    sizeof(ls.ls_sin)) == -1)
+			err(1, "bind");
+		if (listen(ls.ls_fd, SOMAXCONN) == -1)
+			err(1, "listen");
+		if (getsockname(ls.ls_fd, (struct sockaddr *)&ls.ls_sin,
+		    &slen) == -1)
+			err(1, "getsockname");
+	} else {
+		/* pick a port for the loops to share */
+		ls.ls_fd = -1;
+		evlb = base(backend);
+		evll = evl_listener_bind(evlb, (struct sockaddr *)&ls.ls_sin,
+		    sizeof(ls.ls_sin), 0, ls_accept, &ls);
+		if (evll == NULL) {
+			warn("listen: evl_listener_bind");
+			evl_destroy(evlb);
+			return;
+		}
+		if (getsockname(evl_listener_fd(evll),
+		    (struct sockaddr *)&ls.ls_sin, &slen) == -1)
+			err(1, "getsockname");
+		evl_listener_destroy(evll);
+		evl_destroy(evlb);
+	}
+
+	loops = calloc(nloops, sizeof(*loops));
+	if (loops == NULL)
+		err(1, "listen loops");
+	if (pthread_barrier_init(&ls.ls_barrier, NULL, nloops + 1) != 0)
+		errx(1, "pthread_barrier_init");
+
+	for (i = 0; i < nloops; i++) {
+		l = &loops[i];
+		l->l_state = &ls;
+		if (pipe(l->l_fds) == -1)
+			err(1, "pipe");
+		if (pthread_create(&l->l_thread, NULL, ls_run, l) != 0)
+			errx(1, "pthread_create");
+	}
+	pthread_barrier_wait(&ls.ls_barrier);
+
+	for (r = 0; r < runs; r++) {
+		start = nsecs();
+		ls_connect(&ls, n);
+		t[r] = nsecs() - start;
+	}
+
+	for (i = 0; i < nloops; i++) {
+		l = &loops[i];
+		if (write(l->l_fds[1], "e", 1) != 1)
+			err(1, "listen stop");
+		if (pthread_join(l->l_thread, NULL) != 0)
+			errx(1, "pthread_join");
+		close(l->l_fds[0]);
+		close(l->l_fds[1]);
+
+		/* the last wait was for the stop */
+		wakeups += l->l_stats.evlst_waits - 1;
+	}
+
+	snprintf(params, sizeof(params), "mode=%s loops=%u wakeups=%.2f",
+	    shared ? "shared" : "bind", nloops,
+	    (double)wakeups / ((double)n * runs));
+	result(backend, "listen", params, n, median(t, runs));
+
+	pthread_barrier_destroy(&ls.ls_barrier);
+	free(loops);
+	if (shared)
+		close(ls.ls_fd);
+}
+
+static void
+bench_listen(const char *backend)
+{
+	unsigned int nloops;
+
+	/* the simulator never sees real fds become ready */
+	if (strcmp(backend, "sim") == 0)
+		return;
+
+	for (nloops = 8; nloops <= (quick ? 16 : 64); nloops *= 2) {
+		listen_loops(backend, 1, nloops);
+		listen_loops(backend, 0, nloops);
+	}
+}
+
+static int
+available(const char *backend)
+{
+	struct evl_base *evlb;
+
+	evlb = evl_init_backend(backend);
+	if (evlb == NULL)
+		return (0);
+
+	evl_destroy(evlb);
+	return (1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *only = NULL, *backend, *errstr;
+	unsigned int b, i;
+	int ch, a;
+
+	while ((ch = getopt(argc, argv, "b:qr:")) != -1) {
+		switch (ch) {
+		case 'b':
+			only = optarg;
+			break;
+		case 'q':
+			quick = 1;
+			break;
+		case 'r':
+			runs = strtonum(optarg, 1, BENCH_MAXRUNS, &errstr);
+			if (errstr != NULL)
+				errx(1, "runs %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	for (a = 0; a < argc; a++) {
+		for (i = 0; i < nitems(benches); i++) {
+			if (strcmp(argv[a], benches[i].b_name) == 0)
+				break;
+		}
+		if (i == nitems(benches))
+			errx(1, "unknown benchmark %s", argv[a]);
+	}
+
+	for (b = 0; (backend = evl_backend_name(b)) != NULL; b++) {
+		if (only != NULL && strcmp(only, backend) != 0)
+			continue;
+		if (!available(backend)) {
+			warnx("backend %s is not available", backend);
+			continue;
+		}
+
+		for (i = 0; i < nitems(benches); i++) {
+			if (argc > 0) {
+				for (a = 0; a < argc; a++) {
+					if (strcmp(argv[a],
+					    benches[i].b_name) == 0)
+						break;
+				}
+				if (a == argc)
+					continue;
+			}
+
+			(*benches[i].b_fn)(backend);
+		}
+	}
+
+	return (0);
+}
@@ -0,0 +1,373 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * the same benchmarks written against the C api and against the
+ * evl.hpp wrappers, to show the wrappers cost nothing per event.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <evl.hpp>
+
+#define BENCH_RUNS	9
+
+/*
+ * the wrappers have to stay move assignable when they hold a lambda
+ * that captures something, which the benchmarks below rely on for
+ * io and work. tmo isn't used, so have it built here.
+ */
+namespace {
+unsigned int tmo_count;
+auto tmo_fire = [c = &tmo_count]() { (*c)++; };
+}
+template class evl::tmo<decltype(tmo_fire)>;
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static uint64_t
+median(std::vector<uint64_t> v)
+{
+	std::sort(v.begin(), v.end());
+	return (v[v.size() / 2]);
+}
+
+static void
+result(const char *bench, const char *api, const char *params,
+    uint64_t ops, uint64_t ns)
+{
+	printf("bench=%s api=%s %s ops=%llu nsecs=%llu ns_per_op=%.1f\n",
+	    bench, api, params, (unsigned long long)ops,
+	    (unsigned long long)ns, ops ? (double)ns / (double)ops : 0.0);
+	fflush(stdout);
+}
+
+static int
+nofile(unsigned int nfds)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	if (rl.rlim_cur >= nfds)
+		return (0);
+
+	if (rl.rlim_max < nfds)
+		return (-1);
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * pipe ping-pong, as in ../bench.c. every byte that is read is passed
+ * on to the next pipe until npipes bytes have been sent.
+ */
+
+struct pp_state {
+	struct evl_base	*pp_base;
+	std::vector<int> pp_fds;	/* read and write end of each pipe */
+	unsigned int	 pp_npipes;
+	unsigned int	 pp_writes;
+	unsigned int	 pp_count;
+	unsigned int	 pp_total;
+
+	void
+	write(unsigned int idx)
+	{
+		if (::write(pp_fds[idx * 2 + 1], "e", 1) != 1)
+			err(1, "pingpong write");
+	}
+
+	void
+	read(int fd, unsigned int idx)
+	{
+		char buf[64];
+		ssize_t rv;
+
+		rv = ::read(fd, buf, sizeof(buf));
+		if (rv == -1)
+			err(1, "pingpong read");
+
+		while (rv-- > 0) {
+			pp_count++;
+			if (pp_writes > 0) {
+				pp_writes--;
+				write((idx + 1) % pp_npipes);
+			}
+		}
+
+		if (pp_count == pp_total)
+			evl_break(pp_base);
+	}
+};
+
+struct pp_pipe {
+	struct pp_state	*p_state;
+	unsigned int	 p_idx;
+};
+
+static void
+pp_read_c(int fd, int events, void *arg)
+{
+	struct pp_pipe *p = static_cast<struct pp_pipe *>(arg);
+
+	p->p_state->read(fd, p->p_idx);
+}
+
+static uint64_t
+pp_run(struct pp_state &pp, unsigned int nactive)
+{
+	unsigned int i, space = pp.pp_npipes / nactive;
+	uint64_t start;
+
+	pp.pp_writes = pp.pp_npipes;
+	pp.pp_count = 0;
+	pp.pp_total = nactive + pp.pp_npipes;
+
+	start = nsecs();
+	for (i = 0; i < nactive; i++)
+		pp.write(i * space);
+	if (evl_dispatch(pp.pp_base) == -1)
+		err(1, "evl_dispatch");
+
+	return (nsecs() - start);
+}
+
+static void
+pingpong(unsigned int npipes, unsigned int nactive)
+{
+	struct pp_state pp;
+	std::vector<uint64_t> tc, tcxx;
+	unsigned int i, r;
+	char params[64];
+
+	if (nofile(npipes * 2 + 32) == -1) {
+		warnx("pingpong: not enough fds for %u pipes", npipes);
+		return;
+	}
+
+	evl::base evlb;
+
+	pp.pp_base = evlb.get();
+	pp.pp_npipes = npipes;
+	pp.pp_fds.resize(npipes * 2);
+	for (i = 0; i < npipes; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pp.pp_fds[i * 2]) == -1)
+			err(1, "socketpair");
+	}
+
+	/* the C api, with a struct per pipe for the callback argument */
+	{
+		std::vector<struct pp_pipe> pipes(npipes);
+		std::vector<struct evl_io *> ios(npipes);
+
+		for (i = 0; i < npipes; i++) {
+			pipes[i] = { &pp, i };
+			ios[i] = evl_io_create(evlb.get(), pp.pp_fds[i * 2],
+			    EVL_READ | EVL_PERSIST, pp_read_c, &pipes[i]);
+			if (ios[i] == NULL)
+				err(1, "evl_io_create");
+			evl_io_add(ios[i]);
+		}
+
+		for (r = 0; r < BENCH_RUNS; r++)
+			tc.push_back(pp_run(pp, nactive));
+
+		for (i = 0; i < npipes; i++) {
+			evl_io_del(ios[i]);
+			evl_io_destroy(ios[i]);
+		}
+	}
+
+	/* the wrappers, with the pipe captured by a lambda */
+	{
+		auto cb = [&pp](unsigned int idx) {
+			return ([&pp, idx](int fd, int events) {
+				pp.read(fd, idx);
+			});
+		};
+		std::vector<evl::io<decltype(cb(0))>> ios;
+
+		ios.reserve(npipes);
+		for (i = 0; i < npipes; i++) {
+			ios.emplace_back(evlb, pp.pp_fds[i * 2],
+			    EVL_READ | EVL_PERSIST, cb(i));
+			ios.back().add();
+		}
+		/* move assign them around, the events follow them */
+		std::reverse(ios.begin(), ios.end());
+
+		for (r = 0; r < BENCH_RUNS; r++)
+			tcxx.push_back(pp_run(pp, nactive));
+	}
+
+	snprintf(params, sizeof(params), "pipes=%u active=%u", npipes,
+	    nactive);
+	result("pingpong", "c", params, pp.pp_total, median(tc));
+	result("pingpong", "cxx", params, pp.pp_total, median(tcxx));
+
+	for (int fd : pp.pp_fds)
+		close(fd);
+}
+
+/*
+ * evl_work throughput, as in ../bench.c. the callbacks requeue
+ * themselves until a total number of them have run.
+ */
+
+struct wk_state {
+	struct evl_base	*wk_base;
+	unsigned int	 wk_count;
+	unsigned int	 wk_total;
+};
+
+struct wk_item {
+	struct wk_state	*w_state;
+	struct evl_work	*w_work;
+};
+
+static void
+wk_run_c(int idx, int fires, void *arg)
+{
+	struct wk_item *w = static_cast<struct wk_item *>(arg);
+	struct wk_state *wk = w->w_state;
+
+	if (++wk->wk_count == wk->wk_total) {
+		evl_break(wk->wk_base);
+		return;
+	}
+
+	evl_work_add(w->w_work, 1);
+}
+
+static void
+work(unsigned int nwork)
+{
+	evl::base evlb;
+	struct wk_state wk = { evlb.get(), 0, 1000000 };
+	std::vector<uint64_t> tc, tcxx;
+	uint64_t start;
+	unsigned int i, r;
+	char params[64];
+
+	{
+		std::vector<struct wk_item> items(nwork);
+
+		for (i = 0; i < nwork; i++) {
+			items[i].w_state = &wk;
+			items[i].w_work = evl_work_create(evlb.get(), i,
+			    wk_run_c, &items[i]);
+			if (items[i].w_work == NULL)
+				err(1, "evl_work_create");
+		}
+
+		for (r = 0; r < BENCH_RUNS; r++) {
+			wk.wk_count = 0;
+			start = nsecs();
+			for (i = 0; i < nwork; i++)
+				evl_work_add(items[i].w_work, 1);
+			if (evl_dispatch(evlb.get()) == -1)
+				err(1, "evl_dispatch");
+			tc.push_back(nsecs() - start);
+
+			for (i = 0; i < nwork; i++)
+				evl_work_del(items[i].w_work);
+		}
+
+		for (i = 0; i < nwork; i++)
+			evl_work_destroy(items[i].w_work);
+	}
+
+	/* the wrappers, with the state captured by a lambda */
+	{
+		struct wk_state *st = &wk;
+		std::vector<struct evl_work *> ws(nwork);
+		struct evl_work **wp = ws.data();
+		auto run = [st, wp](int ident, int fires) {
+			if (++st->wk_count == st->wk_total) {
+				evl_break(st->wk_base);
+				return;
+			}
+
+			evl_work_add(wp[ident], 1);
+		};
+		std::vector<evl::work<decltype(run)>> works;
+
+		works.reserve(nwork);
+		for (i = 0; i < nwork; i++) {
+			works.emplace_back(evlb, i, run);
+			ws[i] = works[i].get();
+		}
+		/* move assign them around, the events follow them */
+		std::reverse(works.begin(), works.end());
+
+		for (r = 0; r < BENCH_RUNS; r++) {
+			wk.wk_count = 0;
+			start = nsecs();
+			for (auto &w : works)
+				w.add(1);
+			if (evlb.dispatch() == -1)
+				err(1, "evl_dispatch");
+			tcxx.push_back(nsecs() - start);
+
+			for (auto &w : works)
+				w.del();
+		}
+	}
+
+	snprintf(params, sizeof(params), "work=%u", nwork);
+	result("work", "c", params, wk.wk_total, median(tc));
+	result("work", "cxx", params, wk.wk_total, median(tcxx));
+}
+
+int
+main(int argc, char *argv[])
+{
+	pingpong(100, 1);
+	pingpong(1000, 100);
+	pingpong(10000, 1000);
+
+	work(1);
+	work(1024);
+
+	return (0);
+}
@@ -0,0 +1,186 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * libevent's pipe ping-pong benchmark, written against the libevent
+ * api so the same source can be built against libevent itself and
+ * against the libevl compat library for comparison.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <event.h>
+
+#ifndef EVBENCH_IMPL
+#define EVBENCH_IMPL	"libevent"
+#endif
+
+#define EVBENCH_RUNS	5
+
+static int		 num_pipes, num_active, num_writes;
+static int		*pipes;
+static struct event	*events;
+static int		 count, writes, fired;
+
+static void
+read_cb(int fd, short which, void *arg)
+{
+	int idx = (int)(intptr_t)arg, widx = idx + 1;
+	char ch;
+
+	if (read(fd, &ch, sizeof(ch)) == sizeof(ch))
+		count++;
+
+	if (writes) {
+		if (widx >= num_pipes)
+			widx -= num_pipes;
+		if (write(pipes[2 * widx + 1], "e", 1) != 1)
+			err(1, "write");
+		writes--;
+		fired++;
+	}
+}
+
+static uint64_t
+usecs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec);
+}
+
+static void
+run_once(uint64_t *tadd, uint64_t *trun)
+{
+	int i, space;
+	uint64_t start, mid;
+
+	start = usecs();
+	for (i = 0; i < num_pipes; i++) {
+		if (event_initialized(&events[i]))
+			event_del(&events[i]);
+		event_set(&events[i], pipes[2 * i], EV_READ | EV_PERSIST,
+		    read_cb, (void *)(intptr_t)i);
+		if (event_add(&events[i], NULL) == -1)
+			err(1, "event_add");
+	}
+	event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+
+	fired = 0;
+	space = num_pipes / num_active;
+	for (i = 0; i < num_active; i++, fired++) {
+		if (write(pipes[i * space * 2 + 1], "e", 1) != 1)
+			err(1, "write");
+	}
+
+	count = 0;
+	writes = num_writes;
+	mid = usecs();
+	do {
+		event_loop(EVLOOP_ONCE);
+	} while (count != fired);
+
+	*tadd = mid - start;
+	*trun = usecs() - mid;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+bench(int npipes, int nactive)
+{
+	uint64_t tadd[EVBENCH_RUNS], trun[EVBENCH_RUNS];
+	struct rlimit rl;
+	int i;
+
+	num_pipes = npipes;
+	num_active = nactive;
+	num_writes = npipes;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	if (rl.rlim_cur < (rlim_t)num_pipes * 2 + 50) {
+		rl.rlim_cur = (rlim_t)num_pipes * 2 + 50;
+		if (rl.rlim_cur > rl.rlim_max ||
+		    setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			warnx("not enough fds for %d pipes", num_pipes);
+			return;
+		}
+	}
+
+	events = calloc(num_pipes, sizeof(*events));
+	pipes = calloc(num_pipes * 2, sizeof(*pipes));
+	if (events == NULL || pipes == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < num_pipes; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pipes[i * 2]) == -1)
+			err(1, "socketpair");
+	}
+
+	for (i = 0; i < EVBENCH_RUNS; i++)
+		run_once(&tadd[i], &trun[i]);
+
+	qsort(tadd, EVBENCH_RUNS, sizeof(tadd[0]), cmp_u64);
+	qsort(trun, EVBENCH_RUNS, sizeof(trun[0]), cmp_u64);
+	printf("impl=%s bench=evpingpong pipes=%d active=%d writes=%d "
+	    "usecs_add=%llu usecs_run=%llu\n", EVBENCH_IMPL, num_pipes,
+	    num_active, num_writes,
+	    (unsigned long long)tadd[EVBENCH_RUNS / 2],
+	    (unsigned long long)trun[EVBENCH_RUNS / 2]);
+	fflush(stdout);
+
+	for (i = 0; i < num_pipes; i++) {
+		event_del(&events[i]);
+		close(pipes[i * 2]);
+		close(pipes[i * 2 + 1]);
+	}
+	free(events);
+	free(pipes);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (event_init() == NULL)
+		errx(1, "event_init");
+
+	bench(100, 1);
+	bench(1000, 1);
+	bench(1000, 100);
+	bench(10000, 100);
+	bench(10000, 1000);
+
+	return (0);
+}
@@ -0,0 +1,605 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include "event.h"
+
+#define SET(_v, _m)	((_v) |= (_m))
+#define CLR(_v, _m)	((_v) &= ~(_m))
+#define ISSET(_v, _m)	((_v) & (_m))
+
+/* private ev_flags */
+#define EVENT_IO		0x1000	/* ev_io has been initialised */
+#define EVENT_OWNED		0x2000	/* allocated by event_new */
+#define EVENT_ONCE		0x4000	/* freed after the callback runs */
+
+#define EVENT_PENDING		(EVLIST_INSERTED | EVLIST_TIMEOUT)
+
+struct event_base {
+	struct evl_base		*eb_evlb;
+	struct evl_tmo		*eb_exit;	/* event_base_loopexit */
+	unsigned int		 eb_nevents;	/* pending events */
+	int			 eb_break;	/* loop exit was requested */
+};
+
+static struct event_base *current_base;
+
+static void	event_io(int, int, void *);
+static void	event_tmo(int, int, void *);
+static void	event_sig(int, int, void *);
+static void	event_work(int, int, void *);
+static void	event_exit(int, int, void *);
+
+#define event_evl_io(_ev)	((struct evl_io *)(void *)(_ev)->ev_io.evu_storage)
+#define event_evl_tmo(_ev)	((struct evl_tmo *)(void *)(_ev)->ev_tmo.evu_storage)
+#define event_evl_work(_ev)	((struct evl_work *)(void *)(_ev)->ev_work.evu_storage)
+
+/*
+ * bases
+ */
+
+struct event_base *
+event_base_new(void)
+{
+	struct event_base *eb;
+
+	eb = malloc(sizeof(*eb));
+	if (eb == NULL)
+		return (NULL);
+
+	eb->eb_evlb = evl_init();
+	if (eb->eb_evlb == NULL)
+		goto free;
+
+	eb->eb_exit = evl_tmo_create(eb->eb_evlb, event_exit, eb);
+	if (eb->eb_exit == NULL)
+		goto destroy;
+
+	eb->eb_nevents = 0;
+	eb->eb_break = 0;
+
+	return (eb);
+
+destroy:
+	evl_destroy(eb->eb_evlb);
+free:
+	free(eb);
+	return (NULL);
+}
+
+struct event_base *
+event_init(void)
+{
+	struct event_base *eb;
+
+	eb = event_base_new();
+	if (eb != NULL)
+		current_base = eb;
+
+	return (eb);
+}
+
+void
+event_base_free(struct event_base *eb)
+{
+	if (eb == NULL)
+		return;
+
+	if (eb == current_base)
+		current_base = NULL;
+
+	evl_tmo_del(eb->eb_exit);
+	evl_tmo_destroy(eb->eb_exit);
+	evl_destroy(eb->eb_evlb);
+	free(eb);
+}
+
+int
+event_base_set(struct event_base *eb, struct event *ev)
+{
+	if (ISSET(ev->ev_flags, EVENT_PENDING | EVENT_IO)) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	ev->ev_base = eb;
+	evl_tmo_init(event_evl_tmo(ev), eb->eb_evlb, event_tmo, ev);
+	evl_work_init(event_evl_work(ev), eb->eb_evlb, ev->ev_fd,
+	    event_work, ev);
+
+	return (0);
+}
+
+const char *
+event_base_get_method(const struct event_base *eb)
+{
+	return (evl_base_backend(eb->eb_evlb));
+}
+
+struct evl_base *
+event_base_evl(struct event_base *eb)
+{
+	return (eb->eb_evlb);
+}
+
+/*
+ * loops
+ */
+
+int
+event_base_loop(struct event_base *eb, int flags)
+{
+	int evlflags = 0;
+
+	if (ISSET(flags, EVLOOP_ONCE))
+		SET(evlflags, EVL_LOOP_ONCE);
+	if (ISSET(flags, EVLOOP_NONBLOCK))
+		SET(evlflags, EVL_LOOP_NONBLOCK);
+
+	/* libevl would wait forever with nothing to wait for */
+	if (eb->eb_nevents == 0 && !ISSET(flags, EVLOOP_NONBLOCK))
+		return (1);
+
+	eb->eb_break = 0;
+	if (evl_loop(eb->eb_evlb, evlflags) == -1)
+		return (-1);
+
+	/* like libevent, say if the loop ended because it ran out */
+	return (eb->eb_nevents == 0 && !eb->eb_break ? 1 : 0);
+}
+
+int
+event_base_dispatch(struct event_base *eb)
+{
+	return (event_base_loop(eb, 0));
+}
+
+static void
+event_exit(int nil, int events, void *arg)
+{
+	struct event_base *eb = arg;
+
+	eb->eb_break = 1;
+	evl_break(eb->eb_evlb);
+}
+
+int
+event_base_loopexit(struct event_base *eb, const struct timeval *tv)
+{
+	struct timespec ts = { 0, 0 };
+
+	if (tv != NULL)
+		TIMEVAL_TO_TIMESPEC(tv, &ts);
+
+	if (evl_tmo_add(eb->eb_exit, &ts) == -1)
+		return (-1);
+
+	return (0);
+}
+
+int
+event_base_loopbreak(struct event_base *eb)
+{
+	eb->eb_break = 1;
+	evl_break(eb->eb_evlb);
+	return (0);
+}
+
+int
+event_dispatch(void)
+{
+	return (event_base_loop(current_base, 0));
+}
+
+int
+event_loop(int flags)
+{
+	return (event_base_loop(current_base, flags));
+}
+
+int
+event_loopexit(const struct timeval *tv)
+{
+	return (event_base_loopexit(current_base, tv));
+}
+
+int
+event_loopbreak(void)
+{
+	return (event_base_loopbreak(current_base));
+}
+
+/*
+ * events
+ */
+
+int
+event_assign(struct event *ev, struct event_base *eb, int fd, short events,
+    void (*cb)(int, short, void *), void *arg)
+{
+	ev->ev_sig = NULL;
+	ev->ev_base = eb;
+	ev->ev_callback = cb;
+	ev->ev_arg = arg;
+	timerclear(&ev->ev_timeout);
+	ev->ev_fd = fd;
+	ev->ev_events = events;
+	ev->ev_res = 0;
+	ev->ev_flags = EVLIST_INIT;
+
+	if (eb != NULL) {
+		evl_tmo_init(event_evl_tmo(ev), eb->eb_evlb, event_tmo, ev);
+		evl_work_init(event_evl_work(ev), eb->eb_evlb, fd,
+		    event_work, ev);
+	}
+
+	return (0);
+}
+
+void
+event_set(struct event *ev, int fd, short events,
+    void (*cb)(int, short, void *), void *arg)
+{
+	event_assign(ev, current_base, fd, events, cb, arg);
+}
+
+struct event *
+event_new(struct event_base *eb, int fd, short events,
+    void (*cb)(int, short, void *), void *arg)
+{
+	struct event *ev;
+
+	ev = malloc(sizeof(*ev));
+	if (ev == NULL)
+		return (NULL);
+
+	event_assign(ev, eb, fd, events, cb, arg);
+	SET(ev->ev_flags, EVENT_OWNED);
+
+	return (ev);
+}
+
+/*
+ * libevent lets callers free or reuse a struct event once it is no
+ * longer pending, so the backend state behind events in caller
+ * storage is released as soon as they stop being pending. events from
+ * event_new keep theirs until event_free.
+ */
+static void
+event_release(struct event *ev)
+{
+	if (ISSET(ev->ev_flags, EVENT_IO)) {
+		evl_io_fini(event_evl_io(ev));
+		CLR(ev->ev_flags, EVENT_IO);
+	}
+
+	if (ev->ev_sig != NULL) {
+		evl_sig_destroy(ev->ev_sig);
+		ev->ev_sig = NULL;
+	}
+}
+
+static void
+event_unlink(struct event *ev)
+{
+	struct event_base *eb = ev->ev_base;
+
+	if (ISSET(ev->ev_flags, EVLIST_INSERTED)) {
+		if (ev->ev_sig != NULL)
+			evl_sig_del(ev->ev_sig);
+		else
+			evl_io_del(event_evl_io(ev));
+	}
+	if (ISSET(ev->ev_flags, EVLIST_TIMEOUT))
+		evl_tmo_del(event_evl_tmo(ev));
+
+	if (ISSET(ev->ev_flags, EVENT_PENDING))
+		eb->eb_nevents--;
+	CLR(ev->ev_flags, EVENT_PENDING);
+
+	if (!ISSET(ev->ev_flags, EVENT_OWNED))
+		event_release(ev);
+}
+
+static int
+event_setup(struct event *ev)
+{
+	struct evl_base *evlb = ev->ev_base->eb_evlb;
+	int events = 0;
+
+	if (ISSET(ev->ev_events, EV_SIGNAL)) {
+		if (ev->ev_sig != NULL)
+			return (0);
+
+		ev->ev_sig = evl_sig_create(evlb, ev->ev_fd, event_sig, ev);
+		return (ev->ev_sig == NULL ? -1 : 0);
+	}
+
+	if (ISSET(ev->ev_flags, EVENT_IO))
+		return (0);
+
+	if (ISSET(ev->ev_events, EV_READ))
+		SET(events, EVL_READ);
+	if (ISSET(ev->ev_events, EV_WRITE))
+		SET(events, EVL_WRITE);
+	if (ISSET(ev->ev_events, EV_PERSIST))
+		SET(events, EVL_PERSIST);
+
+	if (evl_io_init(event_evl_io(ev), evlb, ev->ev_fd, events,
+	    event_io, ev) == -1)
+		return (-1);
+
+	SET(ev->ev_flags, EVENT_IO);
+	return (0);
+}
+
+int
+event_add(struct event *ev, const struct timeval *tv)
+{
+	struct event_base *eb = ev->ev_base;
+	struct timespec ts;
+	int pending = ISSET(ev->ev_flags, EVENT_PENDING);
+
+	if (eb == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (ISSET(ev->ev_events, EV_READ | EV_WRITE | EV_SIGNAL)) {
+		if (event_setup(ev) == -1)
+			return (-1);
+
+		if (ev->ev_sig != NULL)
+			evl_sig_add(ev->ev_sig);
+		else
+			evl_io_add(event_evl_io(ev));
+		SET(ev->ev_flags, EVLIST_INSERTED);
+	}
+
+	if (tv != NULL) {
+		TIMEVAL_TO_TIMESPEC(tv, &ts);
+		if (evl_tmo_add(event_evl_tmo(ev), &ts) == -1) {
+			if (!pending)
+				event_unlink(ev);
+			return (-1);
+		}
+
+		ev->ev_timeout = *tv;
+		SET(ev->ev_flags, EVLIST_TIMEOUT);
+	}
+
+	if (!pending && ISSET(ev->ev_flags, EVENT_PENDING))
+		eb->eb_nevents++;
+
+	return (0);
+}
+
+int
+event_del(struct event *ev)
+{
+	if (ev->ev_base == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	evl_work_del(event_evl_work(ev));
+	event_unlink(ev);
+
+	return (0);
+}
+
+void
+event_free(struct event *ev)
+{
+	if (ev == NULL)
+		return;
+
+	if (ev->ev_base != NULL) {
+		event_del(ev);
+		evl_work_fini(event_evl_work(ev));
+		evl_tmo_fini(event_evl_tmo(ev));
+	}
+	event_release(ev);
+	free(ev);
+}
+
+void
+event_active(struct event *ev, int res, short ncalls)
+{
+	int events = 0;
+
+	if (ISSET(res, EV_READ))
+		SET(events, EVL_READ);
+	if (ISSET(res, EV_WRITE))
+		SET(events, EVL_WRITE);
+	if (ISSET(res, EV_TIMEOUT))
+		SET(events, EVL_TIMEOUT);
+	if (ISSET(res, EV_SIGNAL))
+		SET(events, EVL_SIGNAL);
+
+	evl_work_add(event_evl_work(ev), events);
+}
+
+int
+event_pending(const struct event *ev, short events, struct timeval *tv)
+{
+	struct timespec ts;
+	struct timeval now, rem;
+	int flags = 0;
+
+	if (ISSET(ev->ev_flags, EVLIST_INSERTED))
+		SET(flags, ev->ev_events & (EV_READ | EV_WRITE | EV_SIGNAL));
+	if (ISSET(ev->ev_flags, EVLIST_TIMEOUT))
+		SET(flags, EV_TIMEOUT);
+	CLR(flags, ~events);
+
+	/* libevent reports the deadline as a time of day */
+	if (tv != NULL && ISSET(flags, EV_TIMEOUT) &&
+	    evl_tmo_pending((const struct evl_tmo *)(const void *)
+	    ev->ev_tmo.evu_storage, &ts) == 1) {
+		TIMESPEC_TO_TIMEVAL(&rem, &ts);
+		gettimeofday(&now, NULL);
+		timeradd(&now, &rem, tv);
+	}
+
+	return (flags);
+}
+
+/*
+ * callbacks
+ */
+
+static void
+event_fire(struct event *ev, short res)
+{
+	struct event_base *eb = ev->ev_base;
+	struct timespec ts;
+	int once = ISSET(ev->ev_flags, EVENT_ONCE);
+
+	if (!ISSET(ev->ev_events, EV_PERSIST)) {
+		/* either half firing ends the whole event */
+		evl_work_del(event_evl_work(ev));
+		event_unlink(ev);
+	} else if (ISSET(ev->ev_flags, EVLIST_TIMEOUT)) {
+		/* persistent events restart their timeout when they fire */
+		TIMEVAL_TO_TIMESPEC(&ev->ev_timeout, &ts);
+		evl_tmo_add(event_evl_tmo(ev), &ts);
+	}
+
+	/* the callback may free or reuse ev */
+	ev->ev_res = res;
+	(*ev->ev_callback)(ev->ev_fd, res, ev->ev_arg);
+
+	if (once)
+		event_free(ev);
+
+	/* libevent returns from the loop when nothing is left to do */
+	if (eb->eb_nevents == 0)
+		evl_break(eb->eb_evlb);
+}
+
+static void
+event_io(int fd, int events, void *arg)
+{
+	struct event *ev = arg;
+	short res = 0;
+
+	if (ISSET(events, EVL_READ))
+		SET(res, EV_READ);
+	if (ISSET(events, EVL_WRITE))
+		SET(res, EV_WRITE);
+
+	event_fire(ev, res);
+}
+
+static void
+event_tmo(int nil, int events, void *arg)
+{
+	event_fire(arg, EV_TIMEOUT);
+}
+
+static void
+event_sig(int signo, int events, void *arg)
+{
+	struct event *ev = arg;
+	unsigned int n;
+
+	/* libevent runs the callback once per delivery */
+	for (n = EVL_SIG_COUNT(events); n > 0; n--) {
+		if (!ISSET(ev->ev_flags, EVENT_PENDING))
+			break;
+		event_fire(ev, EV_SIGNAL);
+	}
+}
+
+static void
+event_work(int fd, int events, void *arg)
+{
+	struct event *ev = arg;
+	short res = 0;
+
+	if (ISSET(events, EVL_READ))
+		SET(res, EV_READ);
+	if (ISSET(events, EVL_WRITE))
+		SET(res, EV_WRITE);
+	if (ISSET(events, EVL_TIMEOUT))
+		SET(res, EV_TIMEOUT);
+	if (ISSET(events, EVL_SIGNAL))
+		SET(res, EV_SIGNAL);
+
+	event_fire(ev, res);
+}
+
+/*
+ * one shot events
+ */
+
+int
+event_base_once(struct event_base *eb, int fd, short events,
+    void (*cb)(int, short, void *), void *arg, const struct timeval *tv)
+{
+	struct event *ev;
+	struct timeval zero = { 0, 0 };
+
+	/* libevent only supports timeouts and fd events here */
+	if (ISSET(events, EV_SIGNAL | EV_PERSIST)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ev = event_new(eb, fd, events, cb, arg);
+	if (ev == NULL)
+		return (-1);
+
+	SET(ev->ev_flags, EVENT_ONCE);
+
+	if (!ISSET(events, EV_READ | EV_WRITE) && tv == NULL)
+		tv = &zero;
+
+	if (event_add(ev, tv) == -1) {
+		event_free(ev);
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+event_once(int fd, short events, void (*cb)(int, short, void *), void *arg,
+    const struct timeval *tv)
+{
+	return (event_base_once(current_base, fd, events, cb, arg, tv));
+}
+
+const char *
+event_get_version(void)
+{
+	return ("libevl");
+}
+
+const char *
+event_get_method(void)
+{
+	return (event_base_get_method(current_base));
+}
@@ -0,0 +1,158 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVL_EVENT_H_
+#define _LIB_EVL_EVENT_H_
+
+/*
+ * a libevent compatible api on top of libevl.
+ *
+ * struct event pairs an evl_io (or an evl_sig) with an evl_tmo, and
+ * follows libevent's rules for how they interact: an event without
+ * EV_PERSIST is deleted entirely when either half fires, and an event
+ * with EV_PERSIST and a timeout restarts the timeout every time it
+ * fires.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdint.h>
+
+#include <evl.h>
+
+#define EV_TIMEOUT		0x01
+#define EV_READ			0x02
+#define EV_WRITE		0x04
+#define EV_SIGNAL		0x08
+#define EV_PERSIST		0x10
+
+#define EVLIST_TIMEOUT		0x01
+#define EVLIST_INSERTED		0x02
+#define EVLIST_SIGNAL		0x04
+#define EVLIST_ACTIVE		0x08
+#define EVLIST_INTERNAL		0x10
+#define EVLIST_INIT		0x80
+
+#define EVLOOP_ONCE		0x01
+#define EVLOOP_NONBLOCK		0x02
+
+struct event_base;
+
+struct event {
+	union {
+		char		 evu_storage[EVL_IO_SIZE];
+		uint64_t	 evu_align;
+	}			 ev_io;
+	union {
+		char		 evu_storage[EVL_TMO_SIZE];
+		uint64_t	 evu_align;
+	}			 ev_tmo;
+	union {
+		char		 evu_storage[EVL_WORK_SIZE];
+		uint64_t	 evu_align;
+	}			 ev_work;
+	struct evl_sig		*ev_sig;
+
+	struct event_base	*ev_base;
+	void			(*ev_callback)(int, short, void *);
+	void			*ev_arg;
+	struct timeval		 ev_timeout;
+	int			 ev_fd;
+	short			 ev_events;
+	short			 ev_res;
+	int			 ev_flags;
+};
+
+#define EVENT_FD(_ev)		((int)(_ev)->ev_fd)
+#define EVENT_SIGNAL(_ev)	((int)(_ev)->ev_fd)
+
+#define event_initialized(_ev)	((_ev)->ev_flags & EVLIST_INIT)
+#define event_get_fd(_ev)	EVENT_FD(_ev)
+
+#define evtimer_set(_ev, _cb, _arg)	event_set((_ev), -1, 0, (_cb), (_arg))
+#define evtimer_assign(_ev, _b, _cb, _arg)				\
+	event_assign((_ev), (_b), -1, 0, (_cb), (_arg))
+#define evtimer_new(_b, _cb, _arg)	event_new((_b), -1, 0, (_cb), (_arg))
+#define evtimer_add(_ev, _tv)		event_add((_ev), (_tv))
+#define evtimer_del(_ev)		event_del(_ev)
+#define evtimer_pending(_ev, _tv)	event_pending((_ev), EV_TIMEOUT, (_tv))
+#define evtimer_initialized(_ev)	event_initialized(_ev)
+
+#define timeout_set(_ev, _cb, _arg)	evtimer_set((_ev), (_cb), (_arg))
+#define timeout_add(_ev, _tv)		evtimer_add((_ev), (_tv))
+#define timeout_del(_ev)		evtimer_del(_ev)
+#define timeout_pending(_ev, _tv)	evtimer_pending((_ev), (_tv))
+#define timeout_initialized(_ev)	evtimer_initialized(_ev)
+
+#define signal_set(_ev, _sig, _cb, _arg)				\
+	event_set((_ev), (_sig), EV_SIGNAL|EV_PERSIST, (_cb), (_arg))
+#define signal_add(_ev, _tv)		event_add((_ev), (_tv))
+#define signal_del(_ev)			event_del(_ev)
+#define signal_pending(_ev, _tv)	event_pending((_ev), EV_SIGNAL, (_tv))
+#define signal_initialized(_ev)		event_initialized(_ev)
+
+#define evsignal_set(_ev, _sig, _cb, _arg)				\
+	signal_set((_ev), (_sig), (_cb), (_arg))
+#define evsignal_assign(_ev, _b, _sig, _cb, _arg)			\
+	event_assign((_ev), (_b), (_sig), EV_SIGNAL|EV_PERSIST, (_cb), (_arg))
+#define evsignal_new(_b, _sig, _cb, _arg)				\
+	event_new((_b), (_sig), EV_SIGNAL|EV_PERSIST, (_cb), (_arg))
+#define evsignal_add(_ev, _tv)		signal_add((_ev), (_tv))
+#define evsignal_del(_ev)		signal_del(_ev)
+#define evsignal_pending(_ev, _tv)	signal_pending((_ev), (_tv))
+#define evsignal_initialized(_ev)	signal_initialized(_ev)
+
+struct event_base	*event_init(void);
+struct event_base	*event_base_new(void);
+void			 event_base_free(struct event_base *);
+int			 event_base_set(struct event_base *, struct event *);
+const char		*event_base_get_method(const struct event_base *);
+struct evl_base		*event_base_evl(struct event_base *);
+
+int			 event_dispatch(void);
+int			 event_loop(int);
+int			 event_loopexit(const struct timeval *);
+int			 event_loopbreak(void);
+int			 event_base_dispatch(struct event_base *);
+int			 event_base_loop(struct event_base *, int);
+int			 event_base_loopexit(struct event_base *,
+			     const struct timeval *);
+int			 event_base_loopbreak(struct event_base *);
+
+void			 event_set(struct event *, int, short,
+			     void (*)(int, short, void *), void *);
+int			 event_assign(struct event *, struct event_base *, int,
+			     short, void (*)(int, short, void *), void *);
+struct event		*event_new(struct event_base *, int, short,
+			     void (*)(int, short, void *), void *);
+void			 event_free(struct event *);
+int			 event_add(struct event *, const struct timeval *);
+int			 event_del(struct event *);
+void			 event_active(struct event *, int, short);
+int			 event_pending(const struct event *, short,
+			     struct timeval *);
+int			 event_once(int, short, void (*)(int, short, void *),
+			     void *, const struct timeval *);
+int			 event_base_once(struct event_base *, int, short,
+			     void (*)(int, short, void *), void *,
+			     const struct timeval *);
+
+const char		*event_get_version(void);
+const char		*event_get_method(void);
+
+#endif /* _LIB_EVL_EVENT_H_ */
@@ -0,0 +1,1187 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* accept4 */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+#ifdef EVL_HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#endif
+
+/*
+ * completion based operations.
+ *
+ * where io_uring is available the operations are handed to the
+ * kernel, and the eventfd it signals completions on is watched by an
+ * internal evl_io. otherwise an operation is tried straight away,
+ * and if the fd isn't ready the readiness backend is used to wait
+ * until it is. either way the result is delivered through the work
+ * list as the "fires" argument to the callback, so the caller never
+ * sees EAGAIN.
+ */
+
+enum evl_aio_op {
+	EVL_AIO_NONE,
+	EVL_AIO_READ,
+	EVL_AIO_WRITE,
+	EVL_AIO_ACCEPT,
+	EVL_AIO_CANCEL,		/* waiting for io_uring to let go */
+};
+
+struct evl_aio {
+	struct evl_work		 evla_work;	/* completion */
+	struct evl_io		 evla_rio;
+	struct evl_io		 evla_wio;
+	enum evl_aio_op		 evla_op;
+	void			*evla_buf;
+	size_t			 evla_len;
+	struct evl_aio_bufs	*evla_bufs;	/* pick a buffer on read */
+	void			*evla_rbuf;	/* buffer picked for read */
+#ifdef EVL_HAS_IO_URING
+	int			 evla_emulated;
+	void			*evla_pbuf;	/* picked before submitting */
+#endif
+};
+
+#ifdef EVL_HAS_IO_URING
+#define evl_aio_emulated(_evla)	((_evla)->evla_emulated)
+/* evl_reinit replaces the ring, so it's looked up every time */
+#define evl_aio_uring(_evla)					\
+	evl_base_uring(evl_work_base(&(_evla)->evla_work))
+#else
+#define evl_aio_emulated(_evla)	1
+#endif
+
+struct evl_aio_buf {
+	struct evl_aio_buf	*evlab_next;
+};
+
+struct evl_aio_bufs {
+	struct evl_aio_buf	*evlabs_free;
+	char			*evlabs_mem;
+	size_t			 evlabs_size;
+	unsigned int		 evlabs_nbufs;
+	unsigned int		 evlabs_nfree;
+#ifdef EVL_HAS_IO_URING
+	struct evl_uring	*evlabs_uring;	/* the kernel has the free bufs */
+	struct io_uring_buf_ring *evlabs_ring;
+	size_t			 evlabs_ringlen;
+	unsigned char		*evlabs_inring;
+	unsigned int		 evlabs_ringmask;
+	unsigned int		 evlabs_bgid;
+	int			 evlabs_fixed;	/* registered buffer too */
+#endif
+};
+
+static void	evl_aio_ready(int, int, void *);
+
+#ifdef EVL_HAS_IO_URING
+static int	evl_aio_uring_submit(struct evl_aio *);
+static void	evl_aio_done(struct evl_aio *, int, unsigned int);
+static void	evl_uring_cancel(struct evl_uring *, struct evl_aio *);
+static void	evl_aio_bufs_attach(struct evl_aio_bufs *,
+		    struct evl_uring *);
+static void	evl_aio_bufs_ring(struct evl_aio_bufs *, void *);
+static void	evl_aio_bufs_detach(struct evl_aio_bufs *, int);
+#endif
+
+struct evl_aio *
+evl_aio_create(struct evl_base *evlb, int fd,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_aio *evla;
+
+	evla = evl_malloc(sizeof(*evla));
+	if (evla == NULL)
+		return (NULL);
+
+#ifdef EVL_HAS_IO_URING
+	evla->evla_emulated = (evl_base_uring(evlb) == NULL);
+	evla->evla_pbuf = NULL;
+#endif
+	if (evl_aio_emulated(evla)) {
+		if (evl_io_init(&evla->evla_rio, evlb, fd, EVL_READ,
+		    evl_aio_ready, evla) == -1)
+			goto free;
+		if (evl_io_init(&evla->evla_wio, evlb, fd, EVL_WRITE,
+		    evl_aio_ready, evla) == -1)
+			goto rfini;
+	}
+
+	evl_work_init(&evla->evla_work, evlb, fd, fn, arg);
+	evla->evla_op = EVL_AIO_NONE;
+	evla->evla_buf = NULL;
+	evla->evla_len = 0;
+	evla->evla_bufs = NULL;
+	evla->evla_rbuf = NULL;
+
+	return (evla);
+
+rfini:
+	evl_io_fini(&evla->evla_rio);
+free:
+	evl_free(evla);
+	return (NULL);
+}
+
+static void
+evl_aio_stop(struct evl_aio *evla)
+{
+#ifdef EVL_HAS_IO_URING
+	if (!evl_aio_emulated(evla)) {
+		/* the kernel has to be done with the buffer first */
+		evl_uring_cancel(evl_aio_uring(evla), evla);
+		return;
+	}
+#endif
+
+	evl_io_del(&evla->evla_rio);
+	evl_io_del(&evla->evla_wio);
+}
+
+int
+evl_aio_cancel(struct evl_aio *evla)
+{
+	int rv = 0;
+
+	if (evla->evla_op != EVL_AIO_NONE) {
+		evl_aio_stop(evla);
+		evla->evla_op = EVL_AIO_NONE;
+		rv = 1;
+	}
+
+	/* io_uring may have completed it while it was being stopped */
+	if (evl_work_del(&evla->evla_work))
+		rv = 1;
+
+	if (evla->evla_rbuf != NULL) {
+		evl_aio_bufs_put(evla->evla_bufs, evla->evla_rbuf);
+		evla->evla_rbuf = NULL;
+	}
+
+	return (rv);
+}
+
+int
+evl_aio_pending(const struct evl_aio *evla)
+{
+	return (evla->evla_op != EVL_AIO_NONE ||
+	    evl_work_pending(&evla->evla_work));
+}
+
+void
+evl_aio_destroy(struct evl_aio *evla)
+{
+	if (evla == NULL)
+		return;
+
+	evl_aio_cancel(evla);
+	evl_work_fini(&evla->evla_work);
+	if (evl_aio_emulated(evla)) {
+		evl_io_fini(&evla->evla_wio);
+		evl_io_fini(&evla->evla_rio);
+	}
+	evl_free(evla);
+}
+
+static void
+evl_aio_complete(struct evl_aio *evla, int res)
+{
+	struct evl_work *evl = &evla->evla_work;
+
+	evla->evla_op = EVL_AIO_NONE;
+
+	evl->evl_fires = res;
+	evl_work_add(evl, 0);
+}
+
+static int
+evl_aio_try(struct evl_aio *evla)
+{
+	int fd = evl_io_fd(&evla->evla_rio);
+	ssize_t rv;
+	void *buf;
+
+	switch (evla->evla_op) {
+	case EVL_AIO_READ:
+		buf = evla->evla_buf;
+		if (buf == NULL) {
+			buf = evl_aio_bufs_get(evla->evla_bufs);
+			if (buf == NULL) {
+				errno = ENOBUFS;
+				rv = -1;
+				break;
+			}
+		}
+
+		rv = read(fd, buf, evla->evla_len);
+		if (evla->evla_buf == NULL) {
+			/* only hold on to a buffer if there's data in it */
+			if (rv > 0)
+				evla->evla_rbuf = buf;
+			else
+				evl_aio_bufs_put(evla->evla_bufs, buf);
+		}
+		break;
+	case EVL_AIO_WRITE:
+		rv = write(fd, evla->evla_buf, evla->evla_len);
+		break;
+	case EVL_AIO_ACCEPT:
+		rv = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		break;
+	default:
+		abort();
+	}
+
+	if (rv == -1) {
+		switch (errno) {
+		case EAGAIN:
+			/* let the backend say when to try again */
+			evl_io_add(evla->evla_op == EVL_AIO_WRITE ?
+			    &evla->evla_wio : &evla->evla_rio);
+			return (0);
+		case EINTR:
+		case ECONNABORTED:
+			return (-1);
+		}
+
+		evl_aio_complete(evla, -errno);
+		return (0);
+	}
+
+	evl_aio_complete(evla, rv);
+	return (0);
+}
+
+static void
+evl_aio_ready(int fd, int events, void *arg)
+{
+	struct evl_aio *evla = arg;
+
+	while (evl_aio_try(evla) == -1)
+		;
+}
+
+static int
+evl_aio_submit(struct evl_aio *evla, enum evl_aio_op op, void *buf,
+    size_t len, struct evl_aio_bufs *evlabs)
+{
+	if (evl_aio_pending(evla)) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+#ifdef EVL_HAS_IO_URING
+	/* the kernel is holding the group's buffers for another loop */
+	if (evlabs != NULL && evlabs->evlabs_uring != NULL &&
+	    (evl_aio_emulated(evla) ||
+	    evlabs->evlabs_uring != evl_aio_uring(evla))) {
+		errno = EINVAL;
+		return (-1);
+	}
+#endif
+
+	/* the result has to fit in the callback argument */
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	if (evla->evla_rbuf != NULL) {
+		evl_aio_bufs_put(evla->evla_bufs, evla->evla_rbuf);
+		evla->evla_rbuf = NULL;
+	}
+
+	evla->evla_op = op;
+	evla->evla_buf = buf;
+	evla->evla_len = len;
+	evla->evla_bufs = evlabs;
+
+#ifdef EVL_HAS_IO_URING
+	if (!evl_aio_emulated(evla))
+		return (evl_aio_uring_submit(evla));
+#endif
+
+	while (evl_aio_try(evla) == -1)
+		;
+
+	return (0);
+}
+
+int
+evl_aio_read(struct evl_aio *evla, void *buf, size_t len)
+{
+	return (evl_aio_submit(evla, EVL_AIO_READ, buf, len, NULL));
+}
+
+int
+evl_aio_read_bufs(struct evl_aio *evla, struct evl_aio_bufs *evlabs)
+{
+	return (evl_aio_submit(evla, EVL_AIO_READ, NULL,
+	    evlabs->evlabs_size, evlabs));
+}
+
+int
+evl_aio_write(struct evl_aio *evla, const void *buf, size_t len)
+{
+	return (evl_aio_submit(evla, EVL_AIO_WRITE, (void *)(uintptr_t)buf,
+	    len, NULL));
+}
+
+int
+evl_aio_accept(struct evl_aio *evla)
+{
+	return (evl_aio_submit(evla, EVL_AIO_ACCEPT, NULL, 0, NULL));
+}
+
+void *
+evl_aio_buf(struct evl_aio *evla)
+{
+	void *buf = evla->evla_rbuf;
+
+	/* the caller owns the buffer now */
+	evla->evla_rbuf = NULL;
+
+	return (buf);
+}
+
+/*
+ * provided buffers
+ */
+
+struct evl_aio_bufs *
+evl_aio_bufs_create(unsigned int nbufs, size_t size)
+{
+	struct evl_aio_bufs *evlabs;
+	struct evl_aio_buf *evlab;
+	unsigned int i;
+
+	if (nbufs == 0 || size < sizeof(*evlab)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	/* keep the buffers aligned */
+	size = (size + EVL_ALIGN - 1) & ~((size_t)EVL_ALIGN - 1);
+
+	evlabs = evl_malloc(sizeof(*evlabs));
+	if (evlabs == NULL)
+		return (NULL);
+
+	evlabs->evlabs_mem = evl_reallocarray(NULL, nbufs, size);
+	if (evlabs->evlabs_mem == NULL) {
+		evl_free(evlabs);
+		return (NULL);
+	}
+
+	evlabs->evlabs_size = size;
+	evlabs->evlabs_nbufs = nbufs;
+	evlabs->evlabs_free = NULL;
+	evlabs->evlabs_nfree = 0;
+#ifdef EVL_HAS_IO_URING
+	evlabs->evlabs_uring = NULL;
+	evlabs->evlabs_ring = NULL;
+	evlabs->evlabs_inring = NULL;
+	evlabs->evlabs_fixed = 0;
+#endif
+
+	for (i = 0; i < nbufs; i++) {
+		evlab = (struct evl_aio_buf *)(void *)
+		    (evlabs->evlabs_mem + i * size);
+		evl_aio_bufs_put(evlabs, evlab);
+	}
+
+	return (evlabs);
+}
+
+void *
+evl_aio_bufs_get(struct evl_aio_bufs *evlabs)
+{
+	struct evl_aio_buf *evlab;
+
+	evlab = evlabs->evlabs_free;
+	if (evlab == NULL)
+		return (NULL);
+
+	evlabs->evlabs_free = evlab->evlab_next;
+	evlabs->evlabs_nfree--;
+
+	return (evlab);
+}
+
+void
+evl_aio_bufs_put(struct evl_aio_bufs *evlabs, void *buf)
+{
+	struct evl_aio_buf *evlab = buf;
+
+	evlabs->evlabs_nfree++;
+#ifdef EVL_HAS_IO_URING
+	if (evlabs->evlabs_uring != NULL) {
+		/* straight back to the kernel */
+		evl_aio_bufs_ring(evlabs, buf);
+		return;
+	}
+#endif
+
+	evlab->evlab_next = evlabs->evlabs_free;
+	evlabs->evlabs_free = evlab;
+}
+
+size_t
+evl_aio_bufs_size(const struct evl_aio_bufs *evlabs)
+{
+	return (evlabs->evlabs_size);
+}
+
+void
+evl_aio_bufs_destroy(struct evl_aio_bufs *evlabs)
+{
+	if (evlabs == NULL)
+		return;
+
+	assert(evlabs->evlabs_nfree == evlabs->evlabs_nbufs);
+
+#ifdef EVL_HAS_IO_URING
+	if (evlabs->evlabs_uring != NULL)
+		evl_aio_bufs_detach(evlabs, 1);
+#endif
+
+	evl_free(evlabs->evlabs_mem);
+	evl_free(evlabs);
+}
+
+#ifdef EVL_HAS_IO_URING
+/*
+ * io_uring
+ *
+ * each base gets a ring the first time an evl_aio is created on it.
+ * submissions are queued on the ring and handed to the kernel in one
+ * go before the loop waits, like the evl_buf writes are. a buffer
+ * group used by evl_aio_read_bufs becomes a provided buffer ring so
+ * the kernel picks a buffer when data arrives, and it is registered
+ * as a fixed buffer so reads and writes with its buffers don't have
+ * to map the pages every time.
+ */
+
+#define EVL_URING_ENTRIES	256
+#define EVL_URING_NGROUPS	64	/* buffer group and fixed buf ids */
+#define EVL_URING_MAXBUFS	32768	/* largest provided buffer ring */
+
+struct evl_uring {
+	struct evl_base		*evlu_base;
+	int			 evlu_fd;
+	int			 evlu_efd;
+	struct evl_io		*evlu_eio;	/* completions */
+
+	void			*evlu_sqmem;
+	size_t			 evlu_sqmemlen;
+	void			*evlu_cqmem;	/* NULL if in sqmem */
+	size_t			 evlu_cqmemlen;
+	struct io_uring_sqe	*evlu_sqes;
+	size_t			 evlu_sqeslen;
+
+	unsigned int		*evlu_sqhead;
+	unsigned int		*evlu_sqtail;
+	unsigned int		*evlu_sqflags;
+	unsigned int		 evlu_sqmask;
+	unsigned int		 evlu_sqentries;
+	unsigned int		 evlu_sqlocal;	/* tail that's been filled */
+
+	unsigned int		*evlu_cqhead;
+	unsigned int		*evlu_cqtail;
+	unsigned int		 evlu_cqmask;
+	struct io_uring_cqe	*evlu_cqes;
+
+	unsigned int		 evlu_inflight;
+	int			 evlu_fixed;	/* sparse buffer table */
+	int			 evlu_pbuf;	/* provided buffer rings work */
+	unsigned int		 evlu_ngroups;
+	struct evl_aio_bufs	*evlu_groups[EVL_URING_NGROUPS];
+};
+
+static int	evl_uring_broken;	/* the kernel or policy says no */
+
+static void	evl_uring_ready(int, int, void *);
+
+static int
+evl_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+evl_uring_enter(int fd, unsigned int submit, unsigned int wait,
+    unsigned int flags)
+{
+	return (syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+	    NULL, 0));
+}
+
+static int
+evl_uring_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+	return (syscall(__NR_io_uring_register, fd, op, arg, n));
+}
+
+struct evl_uring *
+evl_uring_create(struct evl_base *evlb)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register rr;
+	struct evl_uring *evlu;
+	char *sq, *cq;
+	unsigned int i;
+	int fd;
+
+	/* the sim backend has no real fds to submit operations on */
+	if (evl_uring_broken || evl_base_ops(evlb) == &evl_ops_sim)
+		return (NULL);
+
+	memset(&p, 0, sizeof(p));
+	fd = evl_uring_setup(EVL_URING_ENTRIES, &p);
+	if (fd == -1) {
+		switch (errno) {
+		case ENOSYS:
+		case EPERM:
+		case EACCES:
+			/* it's not going to work next time either */
+			evl_uring_broken = 1;
+			break;
+		}
+		return (NULL);
+	}
+
+	/* reads and writes at the current file offset need 5.6 */
+	if (!ISSET(p.features, IORING_FEAT_RW_CUR_POS) ||
+	    !ISSET(p.features, IORING_FEAT_NODROP)) {
+		evl_uring_broken = 1;
+		close(fd);
+		return (NULL);
+	}
+
+	evlu = evl_malloc(sizeof(*evlu));
+	if (evlu == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	memset(evlu, 0, sizeof(*evlu));
+	evlu->evlu_base = evlb;
+	evlu->evlu_fd = fd;
+	evlu->evlu_efd = -1;
+
+	evlu->evlu_sqmemlen = p.sq_off.array +
+	    p.sq_entries * sizeof(unsigned int);
+	evlu->evlu_cqmemlen = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ISSET(p.features, IORING_FEAT_SINGLE_MMAP)) {
+		if (evlu->evlu_cqmemlen > evlu->evlu_sqmemlen)
+			evlu->evlu_sqmemlen = evlu->evlu_cqmemlen;
+		evlu->evlu_cqmemlen = 0;
+	}
+
+	sq = mmap(NULL, evlu->evlu_sqmemlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	evlu->evlu_sqmem = sq;
+
+	cq = sq;
+	if (evlu->evlu_cqmemlen > 0) {
+		cq = mmap(NULL, evlu->evlu_cqmemlen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+		evlu->evlu_cqmem = cq;
+	}
+
+	evlu->evlu_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	evlu->evlu_sqes = mmap(NULL, evlu->evlu_sqeslen,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	    IORING_OFF_SQES);
+	if (evlu->evlu_sqes == MAP_FAILED) {
+		evlu->evlu_sqes = NULL;
+		goto fail;
+	}
+
+	evlu->evlu_sqhead = (unsigned int *)(void *)(sq + p.sq_off.head);
+	evlu->evlu_sqtail = (unsigned int *)(void *)(sq + p.sq_off.tail);
+	evlu->evlu_sqflags = (unsigned int *)(void *)(sq + p.sq_off.flags);
+	evlu->evlu_sqmask = *(unsigned int *)(void *)
+	    (sq + p.sq_off.ring_mask);
+	evlu->evlu_sqentries = *(unsigned int *)(void *)
+	    (sq + p.sq_off.ring_entries);
+	evlu->evlu_sqlocal = *evlu->evlu_sqtail;
+
+	/* sqes are always used in ring order */
+	for (i = 0; i < evlu->evlu_sqentries; i++)
+		((unsigned int *)(void *)(sq + p.sq_off.array))[i] = i;
+
+	evlu->evlu_cqhead = (unsigned int *)(void *)(cq + p.cq_off.head);
+	evlu->evlu_cqtail = (unsigned int *)(void *)(cq + p.cq_off.tail);
+	evlu->evlu_cqmask = *(unsigned int *)(void *)
+	    (cq + p.cq_off.ring_mask);
+	evlu->evlu_cqes = (struct io_uring_cqe *)(void *)
+	    (cq + p.cq_off.cqes);
+
+	evlu->evlu_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (evlu->evlu_efd == -1)
+		goto fail;
+	if (evl_uring_register(fd, IORING_REGISTER_EVENTFD,
+	    &evlu->evlu_efd, 1) == -1)
+		goto fail;
+
+	evlu->evlu_eio = evl_io_create(evlb, evlu->evlu_efd,
+	    EVL_READ | EVL_PERSIST, evl_uring_ready, evlu);
+	if (evlu->evlu_eio == NULL)
+		goto fail;
+	evl_io_add(evlu->evlu_eio);
+
+	/*
+	 * a group's buffers are registered when the group is first
+	 * used. that can fail, eg, against RLIMIT_MEMLOCK, in which
+	 * case they're passed to the kernel like any other buffer.
+	 */
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = EVL_URING_NGROUPS;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	evlu->evlu_fixed = (evl_uring_register(fd, IORING_REGISTER_BUFFERS2,
+	    &rr, sizeof(rr)) == 0);
+	evlu->evlu_pbuf = 1;
+
+	return (evlu);
+
+fail:
+	evl_uring_destroy(evlu);
+	return (NULL);
+}
+
+void
+evl_uring_destroy(struct evl_uring *evlu)
+{
+	unsigned int i;
+
+	if (evlu == NULL)
+		return;
+
+	/* closing the ring lets the kernel forget about the groups */
+	for (i = 0; i < evlu->evlu_ngroups; i++) {
+		if (evlu->evlu_groups[i] != NULL)
+			evl_aio_bufs_detach(evlu->evlu_groups[i], 0);
+	}
+
+	if (evlu->evlu_eio != NULL) {
+		evl_io_del(evlu->evlu_eio);
+		evl_io_destroy(evlu->evlu_eio);
+	}
+	if (evlu->evlu_efd != -1)
+		close(evlu->evlu_efd);
+
+	if (evlu->evlu_sqes != NULL)
+		munmap(evlu->evlu_sqes, evlu->evlu_sqeslen);
+	if (evlu->evlu_cqmem != NULL)
+		munmap(evlu->evlu_cqmem, evlu->evlu_cqmemlen);
+	if (evlu->evlu_sqmem != NULL)
+		munmap(evlu->evlu_sqmem, evlu->evlu_sqmemlen);
+	close(evlu->evlu_fd);
+
+	evl_free(evlu);
+}
+
+unsigned int
+evl_uring_inflight(const struct evl_uring *evlu)
+{
+	if (evlu == NULL)
+		return (0);
+
+	return (evlu->evlu_inflight);
+}
+
+int
+evl_uring_pending(const struct evl_uring *evlu)
+{
+	if (evlu == NULL)
+		return (0);
+
+	return (evlu->evlu_sqlocal !=
+	    __atomic_load_n(evlu->evlu_sqhead, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * completions that don't fit in the ring are kept by the kernel until
+ * they're asked for with IORING_ENTER_GETEVENTS.
+ */
+static int
+evl_uring_overflow(const struct evl_uring *evlu)
+{
+	return (ISSET(__atomic_load_n(evlu->evlu_sqflags, __ATOMIC_ACQUIRE),
+	    IORING_SQ_CQ_OVERFLOW));
+}
+
+static void
+evl_uring_submit(struct evl_uring *evlu, unsigned int wait,
+    unsigned int flags)
+{
+	unsigned int n;
+
+	n = evlu->evlu_sqlocal -
+	    __atomic_load_n(evlu->evlu_sqhead, __ATOMIC_ACQUIRE);
+	if (n == 0 && flags == 0)
+		return;
+
+	/* the sqes have to be written before the kernel sees the tail */
+	__atomic_store_n(evlu->evlu_sqtail, evlu->evlu_sqlocal,
+	    __ATOMIC_RELEASE);
+
+	if (evl_uring_enter(evlu->evlu_fd, n, wait, flags) == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case EBUSY:
+			/* whatever didn't go in stays queued for next time */
+			break;
+		default:
+			/* the ring itself is broken */
+			abort();
+		}
+	}
+}
+
+void
+evl_uring_flush(struct evl_uring *evlu)
+{
+	if (evlu == NULL)
+		return;
+
+	/*
+	 * moving overflowed completions into the ring signals the
+	 * eventfd, so the loop wakes up to reap them.
+	 */
+	evl_uring_submit(evlu, 0,
+	    evl_uring_overflow(evlu) ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *
+evl_uring_sqe(struct evl_uring *evlu)
+{
+	struct io_uring_sqe *sqe;
+
+	if (evlu->evlu_sqlocal - __atomic_load_n(evlu->evlu_sqhead,
+	    __ATOMIC_ACQUIRE) == evlu->evlu_sqentries) {
+		/* make room by handing over what's queued already */
+		evl_uring_submit(evlu, 0, 0);
+		if (evlu->evlu_sqlocal - __atomic_load_n(evlu->evlu_sqhead,
+		    __ATOMIC_ACQUIRE) == evlu->evlu_sqentries) {
+			errno = EAGAIN;
+			return (NULL);
+		}
+	}
+
+	sqe = &evlu->evlu_sqes[evlu->evlu_sqlocal & evlu->evlu_sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	evlu->evlu_sqlocal++;
+
+	return (sqe);
+}
+
+static void
+evl_uring_reap(struct evl_uring *evlu)
+{
+	struct io_uring_cqe *cqe;
+	struct evl_aio *evla;
+	unsigned int head, tail, flags;
+	int res;
+
+	head = *evlu->evlu_cqhead;
+	for (;;) {
+		tail = __atomic_load_n(evlu->evlu_cqtail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (!evl_uring_overflow(evlu))
+				break;
+
+			/* there's room in the ring for more now */
+			evl_uring_submit(evlu, 0, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		cqe = &evlu->evlu_cqes[head & evlu->evlu_cqmask];
+		evla = (struct evl_aio *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		/* give the slot back before the completion submits more */
+		__atomic_store_n(evlu->evlu_cqhead, ++head, __ATOMIC_RELEASE);
+
+		/* cancel requests don't have anything waiting on them */
+		if (evla == NULL)
+			continue;
+
+		evlu->evlu_inflight--;
+		evl_aio_done(evla, res, flags);
+	}
+}
+
+static void
+evl_uring_ready(int fd, int events, void *arg)
+{
+	struct evl_uring *evlu = arg;
+	uint64_t n;
+
+	/* EAGAIN means nothing completed since the last reap */
+	if (read(fd, &n, sizeof(n)) == -1)
+		return;
+
+	evl_uring_reap(evlu);
+}
+
+/*
+ * cancelling waits for the kernel to complete the operation, one way
+ * or another, so the caller is free to reuse or free the buffer as
+ * soon as evl_aio_cancel returns.
+ */
+static void
+evl_uring_cancel(struct evl_uring *evlu, struct evl_aio *evla)
+{
+	struct io_uring_sqe *sqe = NULL;
+
+	evla->evla_op = EVL_AIO_CANCEL;
+	while (evla->evla_op != EVL_AIO_NONE) {
+		if (sqe == NULL) {
+			sqe = evl_uring_sqe(evlu);
+			if (sqe != NULL) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = (uintptr_t)evla;
+			}
+		}
+
+		evl_uring_submit(evlu, 1, IORING_ENTER_GETEVENTS);
+		evl_uring_reap(evlu);
+	}
+}
+
+static int
+evl_uring_fixed(const struct evl_uring *evlu, const void *buf, size_t len)
+{
+	const struct evl_aio_bufs *evlabs;
+	const char *p = buf;
+	unsigned int i;
+
+	if (!evlu->evlu_fixed)
+		return (-1);
+
+	for (i = 0; i < evlu->evlu_ngroups; i++) {
+		evlabs = evlu->evlu_groups[i];
+		if (evlabs == NULL || !evlabs->evlabs_fixed)
+			continue;
+
+		if (p >= evlabs->evlabs_mem && p + len <= evlabs->evlabs_mem +
+		    (size_t)evlabs->evlabs_nbufs * evlabs->evlabs_size)
+			return (i);
+	}
+
+	return (-1);
+}
+
+static int
+evl_aio_uring_submit(struct evl_aio *evla)
+{
+	struct evl_uring *evlu;
+	struct evl_aio_bufs *evlabs = evla->evla_bufs;
+	struct io_uring_sqe *sqe;
+	void *buf = evla->evla_buf;
+	int idx;
+
+	/* a new ring after evl_reinit may not be possible */
+	evlu = evl_aio_uring(evla);
+	if (evlu == NULL) {
+		evla->evla_op = EVL_AIO_NONE;
+		return (-1);
+	}
+
+	if (evlabs != NULL) {
+		if (evlabs->evlabs_uring == NULL)
+			evl_aio_bufs_attach(evlabs, evlu);
+		if (evlabs->evlabs_uring == NULL) {
+			/* the kernel can't pick one, so pick one now */
+			buf = evl_aio_bufs_get(evlabs);
+			if (buf == NULL) {
+				evl_aio_complete(evla, -ENOBUFS);
+				return (0);
+			}
+			evla->evla_pbuf = buf;
+		}
+	}
+
+	sqe = evl_uring_sqe(evlu);
+	if (sqe == NULL) {
+		if (evla->evla_pbuf != NULL) {
+			evl_aio_bufs_put(evlabs, evla->evla_pbuf);
+			evla->evla_pbuf = NULL;
+		}
+		evla->evla_op = EVL_AIO_NONE;
+		return (-1);
+	}
+
+	sqe->fd = evla->evla_work.evl_ident;
+	sqe->user_data = (uintptr_t)evla;
+
+	switch (evla->evla_op) {
+	case EVL_AIO_READ:
+	case EVL_AIO_WRITE:
+		sqe->opcode = evla->evla_op == EVL_AIO_READ ?
+		    IORING_OP_READ : IORING_OP_WRITE;
+		/* use and move the file offset like read(2) and write(2) */
+		sqe->off = (uint64_t)-1;
+		sqe->len = evla->evla_len;
+
+		if (buf == NULL) {
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = evlabs->evlabs_bgid;
+			break;
+		}
+
+		sqe->addr = (uintptr_t)buf;
+		idx = evl_uring_fixed(evlu, buf, evla->evla_len);
+		if (idx != -1) {
+			sqe->opcode = evla->evla_op == EVL_AIO_READ ?
+			    IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = idx;
+		}
+		break;
+	case EVL_AIO_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		break;
+	default:
+		abort();
+	}
+
+	evlu->evlu_inflight++;
+
+	return (0);
+}
+
+static void
+evl_aio_done(struct evl_aio *evla, int res, unsigned int flags)
+{
+	struct evl_aio_bufs *evlabs = evla->evla_bufs;
+	unsigned int bid;
+	void *buf;
+
+	buf = evla->evla_pbuf;
+	evla->evla_pbuf = NULL;
+	if (ISSET(flags, IORING_CQE_F_BUFFER)) {
+		/* the kernel picked it out of the group's ring */
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		evlabs->evlabs_inring[bid] = 0;
+		evlabs->evlabs_nfree--;
+		buf = evlabs->evlabs_mem + bid * evlabs->evlabs_size;
+	}
+
+	if (buf != NULL) {
+		/* only hold on to a buffer if there's data in it */
+		if (res > 0)
+			evla->evla_rbuf = buf;
+		else
+			evl_aio_bufs_put(evlabs, buf);
+	}
+
+	switch (res) {
+	case -EINTR:
+	case -ECONNABORTED:
+		/* the emulation tries these again, so do the same */
+		if (evla->evla_op != EVL_AIO_CANCEL &&
+		    evl_aio_uring_submit(evla) == 0)
+			return;
+		break;
+	}
+
+	evl_aio_complete(evla, res);
+}
+
+/*
+ * a group can only feed one ring, so evl_aio_submit refuses reads
+ * into it from other bases until the ring is gone.
+ */
+static void
+evl_aio_bufs_attach(struct evl_aio_bufs *evlabs, struct evl_uring *evlu)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+	struct evl_aio_buf *evlab;
+	unsigned int entries, bgid;
+	void *ring;
+	size_t len;
+
+	if (!evlu->evlu_pbuf || evlabs->evlabs_nbufs > EVL_URING_MAXBUFS ||
+	    evlabs->evlabs_size > UINT32_MAX)
+		return;
+
+	for (bgid = 0; bgid < EVL_URING_NGROUPS; bgid++) {
+		if (evlu->evlu_groups[bgid] == NULL)
+			break;
+	}
+	if (bgid == EVL_URING_NGROUPS)
+		return;
+
+	evlabs->evlabs_inring = evl_malloc(evlabs->evlabs_nbufs);
+	if (evlabs->evlabs_inring == NULL)
+		return;
+	memset(evlabs->evlabs_inring, 0, evlabs->evlabs_nbufs);
+
+	for (entries = 1; entries < evlabs->evlabs_nbufs; entries <<= 1)
+		;
+	len = entries * sizeof(struct io_uring_buf);
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		goto free;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (evl_uring_register(evlu->evlu_fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1) {
+		/* provided buffer rings arrived in 5.19 */
+		if (errno == EINVAL)
+			evlu->evlu_pbuf = 0;
+		goto unmap;
+	}
+
+	evlabs->evlabs_uring = evlu;
+	evlabs->evlabs_ring = ring;
+	evlabs->evlabs_ringlen = len;
+	evlabs->evlabs_ringmask = entries - 1;
+	evlabs->evlabs_bgid = bgid;
+	evlu->evlu_groups[bgid] = evlabs;
+	if (evlu->evlu_ngroups <= bgid)
+		evlu->evlu_ngroups = bgid + 1;
+
+	/* the kernel has all the free buffers from now on */
+	while ((evlab = evlabs->evlabs_free) != NULL) {
+		evlabs->evlabs_free = evlab->evlab_next;
+		evl_aio_bufs_ring(evlabs, evlab);
+	}
+
+	if (evlu->evlu_fixed) {
+		iov.iov_base = evlabs->evlabs_mem;
+		iov.iov_len = (size_t)evlabs->evlabs_nbufs *
+		    evlabs->evlabs_size;
+		memset(&up, 0, sizeof(up));
+		up.offset = bgid;
+		up.data = (uintptr_t)&iov;
+		up.nr = 1;
+		evlabs->evlabs_fixed = (evl_uring_register(evlu->evlu_fd,
+		    IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) == 1);
+	}
+
+	return;
+
+unmap:
+	munmap(ring, len);
+free:
+	evl_free(evlabs->evlabs_inring);
+	evlabs->evlabs_inring = NULL;
+}
+
+static void
+evl_aio_bufs_detach(struct evl_aio_bufs *evlabs, int unregister)
+{
+	struct evl_uring *evlu = evlabs->evlabs_uring;
+	struct io_uring_buf_reg reg;
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+	struct evl_aio_buf *evlab;
+	unsigned int i;
+
+	if (unregister) {
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = evlabs->evlabs_bgid;
+		evl_uring_register(evlu->evlu_fd,
+		    IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+		if (evlabs->evlabs_fixed) {
+			/* an empty iovec clears the slot */
+			memset(&iov, 0, sizeof(iov));
+			memset(&up, 0, sizeof(up));
+			up.offset = evlabs->evlabs_bgid;
+			up.data = (uintptr_t)&iov;
+			up.nr = 1;
+			evl_uring_register(evlu->evlu_fd,
+			    IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+		}
+	}
+	evlu->evlu_groups[evlabs->evlabs_bgid] = NULL;
+
+	/* whatever the kernel was holding on to is free again */
+	for (i = 0; i < evlabs->evlabs_nbufs; i++) {
+		if (!evlabs->evlabs_inring[i])
+			continue;
+
+		evlab = (struct evl_aio_buf *)(void *)
+		    (evlabs->evlabs_mem + i * evlabs->evlabs_size);
+		evlab->evlab_next = evlabs->evlabs_free;
+		evlabs->evlabs_free = evlab;
+	}
+
+	munmap(evlabs->evlabs_ring, evlabs->evlabs_ringlen);
+	evl_free(evlabs->evlabs_inring);
+
+	evlabs->evlabs_uring = NULL;
+	evlabs->evlabs_ring = NULL;
+	evlabs->evlabs_inring = NULL;
+	evlabs->evlabs_fixed = 0;
+}
+
+static void
+evl_aio_bufs_ring(struct evl_aio_bufs *evlabs, void *buf)
+{
+	struct io_uring_buf_ring *br = evlabs->evlabs_ring;
+	struct io_uring_buf *b;
+	unsigned short tail = br->tail;
+	unsigned int bid;
+
+	bid = ((char *)buf - evlabs->evlabs_mem) / evlabs->evlabs_size;
+	evlabs->evlabs_inring[bid] = 1;
+
+	b = &br->bufs[tail & evlabs->evlabs_ringmask];
+	b->addr = (uintptr_t)buf;
+	b->len = evlabs->evlabs_size;
+	b->bid = bid;
+
+	/* the entry has to be there before the kernel sees the tail move */
+	__atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+#endif /* EVL_HAS_IO_URING */
@@ -0,0 +1,679 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+
+/*
+ * chunks are recycled through a free list on each base so buffers
+ * don't go back to the allocator every time they're drained.
+ */
+
+#define EVL_CHUNK_SIZE		16384
+#define EVL_CHUNK_DATA		(EVL_CHUNK_SIZE - offsetof(struct evl_chunk, \
+				    evlc_data))
+#define EVL_CHUNK_MAXFREE	256
+
+struct evl_chunk {
+	TAILQ_ENTRY(evl_chunk)
+			  evlc_entry;
+	size_t		  evlc_off;	/* start of the data */
+	size_t		  evlc_len;	/* end of the data */
+	char		  evlc_data[];
+};
+
+#define EVL_RBUF_NIOV		4
+
+struct evl_rbuf {
+	struct evl_base	 *evlrb_base;
+	int		  evlrb_fd;
+	struct evl_chunk_list
+			  evlrb_chunks;
+	size_t		  evlrb_len;
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX			1024
+#endif
+#define EVL_WBUF_NIOV		IOV_MAX
+
+struct evl_wbuf {
+	struct evl_io	  evlwb_io;	/* EVL_WRITE on the same fd */
+	struct evl_flush  evlwb_flush;
+	struct evl_chunk_list
+			  evlwb_chunks;
+	size_t		  evlwb_len;
+	int		  evlwb_blocked; /* waiting for EVL_WRITE */
+	int		  evlwb_error;
+};
+
+static void	evl_wbuf_write(int, int, void *);
+static void	evl_wbuf_dirty(struct evl_flush *);
+
+void
+evl_bufs_init(struct evl_bufs *evlbs, struct evl_pools *evlpl)
+{
+	TAILQ_INIT(&evlbs->evlbs_free);
+	evlbs->evlbs_nfree = 0;
+	evlbs->evlbs_nchunks = 0;
+	TAILQ_INIT(&evlbs->evlbs_dirty);
+
+	evl_pool_init(&evlbs->evlbs_rbuf_pool, evlpl,
+	    "evl_rbuf", sizeof(struct evl_rbuf));
+	evl_pool_init(&evlbs->evlbs_wbuf_pool, evlpl,
+	    "evl_wbuf", sizeof(struct evl_wbuf));
+}
+
+void
+evl_bufs_fini(struct evl_bufs *evlbs)
+{
+	struct evl_chunk *evlc;
+
+	assert(TAILQ_EMPTY(&evlbs->evlbs_dirty));
+
+	while ((evlc = TAILQ_FIRST(&evlbs->evlbs_free)) != NULL) {
+		TAILQ_REMOVE(&evlbs->evlbs_free, evlc, evlc_entry);
+		evl_free(evlc);
+	}
+
+	evl_pool_fini(&evlbs->evlbs_wbuf_pool);
+	evl_pool_fini(&evlbs->evlbs_rbuf_pool);
+}
+
+struct evl_chunk *
+evl_chunk_get(struct evl_bufs *evlbs)
+{
+	struct evl_chunk *evlc;
+
+	evlc = TAILQ_FIRST(&evlbs->evlbs_free);
+	if (evlc != NULL) {
+		TAILQ_REMOVE(&evlbs->evlbs_free, evlc, evlc_entry);
+		evlbs->evlbs_nfree--;
+	} else {
+		evlc = evl_malloc(EVL_CHUNK_SIZE);
+		if (evlc == NULL)
+			return (NULL);
+
+		evlbs->evlbs_nchunks++;
+	}
+
+	evlc->evlc_off = 0;
+	evlc->evlc_len = 0;
+
+	return (evlc);
+}
+
+void
+evl_chunk_put(struct evl_bufs *evlbs, struct evl_chunk *evlc)
+{
+	if (evlbs->evlbs_nfree >= EVL_CHUNK_MAXFREE) {
+		evlbs->evlbs_nchunks--;
+		evl_free(evlc);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&evlbs->evlbs_free, evlc, evlc_entry);
+	evlbs->evlbs_nfree++;
+}
+
+static inline size_t
+evl_chunk_space(const struct evl_chunk *evlc)
+{
+	return (EVL_CHUNK_DATA - evlc->evlc_len);
+}
+
+static inline size_t
+evl_chunk_len(const struct evl_chunk *evlc)
+{
+	return (evlc->evlc_len - evlc->evlc_off);
+}
+
+static void
+evl_chunks_drain(struct evl_bufs *evlbs, struct evl_chunk_list *evlcl,
+    size_t len)
+{
+	struct evl_chunk *evlc;
+	size_t n;
+
+	while (len > 0) {
+		evlc = TAILQ_FIRST(evlcl);
+
+		n = evl_chunk_len(evlc);
+		if (n > len) {
+			evlc->evlc_off += len;
+			break;
+		}
+
+		len -= n;
+		TAILQ_REMOVE(evlcl, evlc, evlc_entry);
+		evl_chunk_put(evlbs, evlc);
+	}
+}
+
+/*
+ * read buffers
+ */
+
+struct evl_rbuf *
+evl_rbuf_create(struct evl_io *evlio)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_bufs *evlbs = evl_base_bufs(evlb);
+	struct evl_rbuf *evlrb;
+
+	evlrb = evl_pool_get(&evlbs->evlbs_rbuf_pool);
+	if (evlrb == NULL)
+		return (NULL);
+
+	evlrb->evlrb_base = evlb;
+	evlrb->evlrb_fd = evl_io_fd(evlio);
+	TAILQ_INIT(&evlrb->evlrb_chunks);
+	evlrb->evlrb_len = 0;
+
+	return (evlrb);
+}
+
+void
+evl_rbuf_destroy(struct evl_rbuf *evlrb)
+{
+	struct evl_bufs *evlbs;
+
+	if (evlrb == NULL)
+		return;
+
+	evlbs = evl_base_bufs(evlrb->evlrb_base);
+
+	evl_rbuf_drain(evlrb, evlrb->evlrb_len);
+	evl_pool_put(&evlbs->evlbs_rbuf_pool, evlrb);
+}
+
+size_t
+evl_rbuf_len(const struct evl_rbuf *evlrb)
+{
+	return (evlrb->evlrb_len);
+}
+
+ssize_t
+evl_rbuf_read(struct evl_rbuf *evlrb)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evlrb->evlrb_base);
+	struct evl_chunk *evlcs[EVL_RBUF_NIOV];
+	struct iovec iov[EVL_RBUF_NIOV];
+	struct evl_chunk *tail, *evlc;
+	size_t len, space = 0;
+	ssize_t rv;
+	int niov = 0, nchunks = 0, i;
+
+	/* fill the space at the end of the last chunk first */
+	tail = TAILQ_LAST(&evlrb->evlrb_chunks, evl_chunk_list);
+	if (tail != NULL)
+		space = evl_chunk_space(tail);
+	if (space > 0) {
+		iov[niov].iov_base = tail->evlc_data + tail->evlc_len;
+		iov[niov].iov_len = space;
+		niov++;
+	}
+
+	while (niov < EVL_RBUF_NIOV) {
+		evlc = evl_chunk_get(evlbs);
+		if (evlc == NULL) {
+			if (niov > 0)
+				break;
+			return (-1);
+		}
+
+		evlcs[nchunks++] = evlc;
+		iov[niov].iov_base = evlc->evlc_data;
+		iov[niov].iov_len = EVL_CHUNK_DATA;
+		niov++;
+	}
+
+	rv = readv(evlrb->evlrb_fd, iov, niov);
+	if (rv > 0) {
+		evlrb->evlrb_len += rv;
+		len = rv;
+
+		if (space > len)
+			space = len;
+		if (space > 0) {
+			tail->evlc_len += space;
+			len -= space;
+		}
+
+		for (i = 0; i < nchunks && len > 0; i++) {
+			evlc = evlcs[i];
+			evlc->evlc_len = len < EVL_CHUNK_DATA ?
+			    len : EVL_CHUNK_DATA;
+			len -= evlc->evlc_len;
+
+			TAILQ_INSERT_TAIL(&evlrb->evlrb_chunks, evlc,
+			    evlc_entry);
+			evlcs[i] = NULL;
+		}
+	}
+
+	/* give back the chunks the read didn't reach */
+	for (i = 0; i < nchunks; i++) {
+		if (evlcs[i] != NULL)
+			evl_chunk_put(evlbs, evlcs[i]);
+	}
+
+	return (rv);
+}
+
+int
+evl_rbuf_peek(const struct evl_rbuf *evlrb, struct iovec *iov, int iovcnt)
+{
+	struct evl_chunk *evlc;
+	int n = 0;
+
+	TAILQ_FOREACH(evlc, &evlrb->evlrb_chunks, evlc_entry) {
+		if (n >= iovcnt)
+			break;
+
+		iov[n].iov_base = evlc->evlc_data + evlc->evlc_off;
+		iov[n].iov_len = evl_chunk_len(evlc);
+		n++;
+	}
+
+	return (n);
+}
+
+void *
+evl_rbuf_pullup(struct evl_rbuf *evlrb, size_t len)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evlrb->evlrb_base);
+	struct evl_chunk *head, *evlc;
+	size_t n;
+
+	if (len > evlrb->evlrb_len || len > EVL_CHUNK_DATA) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	head = TAILQ_FIRST(&evlrb->evlrb_chunks);
+	if (head == NULL)
+		return (NULL);
+
+	if (evl_chunk_len(head) >= len) {
+		/* the common case is already contiguous */
+		return (head->evlc_data + head->evlc_off);
+	}
+
+	/* only copy when the data spans chunks */
+	if (EVL_CHUNK_DATA - head->evlc_off < len) {
+		n = evl_chunk_len(head);
+		memmove(head->evlc_data, head->evlc_data + head->evlc_off, n);
+		head->evlc_off = 0;
+		head->evlc_len = n;
+	}
+
+	while (evl_chunk_len(head) < len) {
+		evlc = TAILQ_NEXT(head, evlc_entry);
+
+		n = len - evl_chunk_len(head);
+		if (n > evl_chunk_len(evlc))
+			n = evl_chunk_len(evlc);
+
+		memcpy(head->evlc_data + head->evlc_len,
+		    evlc->evlc_data + evlc->evlc_off, n);
+		head->evlc_len += n;
+		evlc->evlc_off += n;
+
+		if (evl_chunk_len(evlc) == 0) {
+			TAILQ_REMOVE(&evlrb->evlrb_chunks, evlc, evlc_entry);
+			evl_chunk_put(evlbs, evlc);
+		}
+	}
+
+	return (head->evlc_data + head->evlc_off);
+}
+
+size_t
+evl_rbuf_copyout(const struct evl_rbuf *evlrb, void *buf, size_t len)
+{
+	const struct evl_chunk *evlc;
+	char *dst = buf;
+	size_t n, copied = 0;
+
+	TAILQ_FOREACH(evlc, &evlrb->evlrb_chunks, evlc_entry) {
+		if (copied == len)
+			break;
+
+		n = evl_chunk_len(evlc);
+		if (n > len - copied)
+			n = len - copied;
+
+		memcpy(dst + copied, evlc->evlc_data + evlc->evlc_off, n);
+		copied += n;
+	}
+
+	return (copied);
+}
+
+void
+evl_rbuf_drain(struct evl_rbuf *evlrb, size_t len)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evlrb->evlrb_base);
+
+	if (len > evlrb->evlrb_len)
+		len = evlrb->evlrb_len;
+
+	evlrb->evlrb_len -= len;
+
+	/* a partially drained last chunk is kept to read into */
+	evl_chunks_drain(evlbs, &evlrb->evlrb_chunks, len);
+}
+
+/*
+ * write buffers
+ *
+ * data appended to a wbuf is only queued. the loop flushes every
+ * dirty wbuf with writev before it sleeps in the backend, so many
+ * small appends in an iteration cost one syscall. EVL_WRITE is only
+ * armed on the fd when the socket buffer fills up.
+ */
+
+struct evl_wbuf *
+evl_wbuf_create(struct evl_io *evlio)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_bufs *evlbs = evl_base_bufs(evlb);
+	struct evl_wbuf *evlwb;
+
+	evlwb = evl_pool_get(&evlbs->evlbs_wbuf_pool);
+	if (evlwb == NULL)
+		return (NULL);
+
+	if (evl_io_init(&evlwb->evlwb_io, evlb, evl_io_fd(evlio),
+	    EVL_WRITE | EVL_PERSIST, evl_wbuf_write, evlwb) == -1) {
+		evl_pool_put(&evlbs->evlbs_wbuf_pool, evlwb);
+		return (NULL);
+	}
+
+	evl_flush_init(&evlwb->evlwb_flush, evl_wbuf_dirty);
+	TAILQ_INIT(&evlwb->evlwb_chunks);
+	evlwb->evlwb_len = 0;
+	evlwb->evlwb_blocked = 0;
+	evlwb->evlwb_error = 0;
+
+	return (evlwb);
+}
+
+void
+evl_wbuf_destroy(struct evl_wbuf *evlwb)
+{
+	struct evl_bufs *evlbs;
+
+	if (evlwb == NULL)
+		return;
+
+	evlbs = evl_base_bufs(evl_io_base(&evlwb->evlwb_io));
+
+	evl_flush_del(evlbs, &evlwb->evlwb_flush);
+	evl_io_del(&evlwb->evlwb_io);
+	evl_io_fini(&evlwb->evlwb_io);
+
+	evl_chunks_drain(evlbs, &evlwb->evlwb_chunks, evlwb->evlwb_len);
+	evl_pool_put(&evlbs->evlbs_wbuf_pool, evlwb);
+}
+
+size_t
+evl_wbuf_len(const struct evl_wbuf *evlwb)
+{
+	return (evlwb->evlwb_len);
+}
+
+int
+evl_wbuf_appendv(struct evl_wbuf *evlwb, const struct iovec *iov, int iovcnt)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evl_io_base(&evlwb->evlwb_io));
+	struct evl_chunk_list chunks = TAILQ_HEAD_INITIALIZER(chunks);
+	struct evl_chunk *tail, *evlc;
+	const char *src;
+	size_t len, n, space, total = 0;
+	int i;
+
+	if (evlwb->evlwb_error != 0) {
+		errno = evlwb->evlwb_error;
+		return (-1);
+	}
+
+	tail = TAILQ_LAST(&evlwb->evlwb_chunks, evl_chunk_list);
+	space = tail != NULL ? evl_chunk_space(tail) : 0;
+
+	/* get all the chunks up front so a failure leaves the wbuf alone */
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	for (len = total; len > space; len -= n) {
+		evlc = evl_chunk_get(evlbs);
+		if (evlc == NULL) {
+			while ((evlc = TAILQ_FIRST(&chunks)) != NULL) {
+				TAILQ_REMOVE(&chunks, evlc, evlc_entry);
+				evl_chunk_put(evlbs, evlc);
+			}
+			return (-1);
+		}
+
+		TAILQ_INSERT_TAIL(&chunks, evlc, evlc_entry);
+		n = EVL_CHUNK_DATA;
+		if (n > len - space)
+			n = len - space;
+	}
+
+	if (space == 0)
+		tail = TAILQ_FIRST(&chunks);
+	TAILQ_CONCAT(&evlwb->evlwb_chunks, &chunks, evlc_entry);
+
+	for (i = 0; i < iovcnt; i++) {
+		src = iov[i].iov_base;
+		len = iov[i].iov_len;
+
+		while (len > 0) {
+			if (evl_chunk_space(tail) == 0)
+				tail = TAILQ_NEXT(tail, evlc_entry);
+
+			n = evl_chunk_space(tail);
+			if (n > len)
+				n = len;
+
+			memcpy(tail->evlc_data + tail->evlc_len, src, n);
+			tail->evlc_len += n;
+			src += n;
+			len -= n;
+		}
+	}
+
+	evlwb->evlwb_len += total;
+
+	/* a blocked wbuf is written out by its EVL_WRITE handler */
+	if (total > 0 && !evlwb->evlwb_blocked)
+		evl_flush_add(evlbs, &evlwb->evlwb_flush);
+
+	return (0);
+}
+
+int
+evl_wbuf_append(struct evl_wbuf *evlwb, const void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)(uintptr_t)buf;
+	iov.iov_len = len;
+
+	return (evl_wbuf_appendv(evlwb, &iov, 1));
+}
+
+static int
+evl_wbuf_writev(struct evl_bufs *evlbs, struct evl_wbuf *evlwb)
+{
+	struct iovec iov[EVL_WBUF_NIOV];
+	struct evl_chunk *evlc;
+	ssize_t rv;
+	int niov;
+
+	while (evlwb->evlwb_len > 0) {
+		niov = 0;
+		TAILQ_FOREACH(evlc, &evlwb->evlwb_chunks, evlc_entry) {
+			if (niov >= EVL_WBUF_NIOV)
+				break;
+
+			iov[niov].iov_base = evlc->evlc_data + evlc->evlc_off;
+			iov[niov].iov_len = evl_chunk_len(evlc);
+			niov++;
+		}
+
+		rv = writev(evl_io_fd(&evlwb->evlwb_io), iov, niov);
+		if (rv == -1) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return (1);
+			default:
+				/* nothing queued can be written now */
+				evlwb->evlwb_error = errno;
+				evl_chunks_drain(evlbs, &evlwb->evlwb_chunks,
+				    evlwb->evlwb_len);
+				evlwb->evlwb_len = 0;
+				return (-1);
+			}
+		}
+
+		evl_chunks_drain(evlbs, &evlwb->evlwb_chunks, rv);
+		evlwb->evlwb_len -= rv;
+	}
+
+	return (0);
+}
+
+static int
+evl_wbuf_output(struct evl_bufs *evlbs, struct evl_wbuf *evlwb)
+{
+	int rv;
+
+	rv = evl_wbuf_writev(evlbs, evlwb);
+	if (rv == 1) {
+		/* the socket is full, let the loop say when it drains */
+		if (!evlwb->evlwb_blocked) {
+			evlwb->evlwb_blocked = 1;
+			evl_io_add(&evlwb->evlwb_io);
+		}
+		return (0);
+	}
+
+	if (evlwb->evlwb_blocked) {
+		evlwb->evlwb_blocked = 0;
+		evl_io_del(&evlwb->evlwb_io);
+	}
+
+	return (rv);
+}
+
+static void
+evl_wbuf_write(int fd, int events, void *arg)
+{
+	struct evl_wbuf *evlwb = arg;
+
+	(void)evl_wbuf_output(evl_base_bufs(evl_io_base(&evlwb->evlwb_io)),
+	    evlwb);
+}
+
+int
+evl_wbuf_flush(struct evl_wbuf *evlwb)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evl_io_base(&evlwb->evlwb_io));
+
+	if (evlwb->evlwb_error != 0) {
+		errno = evlwb->evlwb_error;
+		return (-1);
+	}
+
+	evl_flush_del(evlbs, &evlwb->evlwb_flush);
+	if (evl_wbuf_output(evlbs, evlwb) == -1) {
+		errno = evlwb->evlwb_error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+evl_wbuf_dirty(struct evl_flush *evlf)
+{
+	struct evl_wbuf *evlwb = (struct evl_wbuf *)((char *)evlf -
+	    offsetof(struct evl_wbuf, evlwb_flush));
+
+	/* errors are reported by the next append or flush */
+	(void)evl_wbuf_output(evl_base_bufs(evl_io_base(&evlwb->evlwb_io)),
+	    evlwb);
+}
+
+/*
+ * flush list
+ */
+
+void
+evl_flush_init(struct evl_flush *evlf, void (*fn)(struct evl_flush *))
+{
+	evlf->evlf_fn = fn;
+	evlf->evlf_onq = 0;
+}
+
+void
+evl_flush_add(struct evl_bufs *evlbs, struct evl_flush *evlf)
+{
+	if (evlf->evlf_onq)
+		return;
+
+	evlf->evlf_onq = 1;
+	TAILQ_INSERT_TAIL(&evlbs->evlbs_dirty, evlf, evlf_entry);
+}
+
+void
+evl_flush_del(struct evl_bufs *evlbs, struct evl_flush *evlf)
+{
+	if (!evlf->evlf_onq)
+		return;
+
+	TAILQ_REMOVE(&evlbs->evlbs_dirty, evlf, evlf_entry);
+	evlf->evlf_onq = 0;
+}
+
+void
+evl_bufs_flush(struct evl_bufs *evlbs)
+{
+	struct evl_flush *evlf;
+
+	while ((evlf = TAILQ_FIRST(&evlbs->evlbs_dirty)) != NULL) {
+		TAILQ_REMOVE(&evlbs->evlbs_dirty, evlf, evlf_entry);
+		evlf->evlf_onq = 0;
+
+		(*evlf->evlf_fn)(evlf);
+	}
+}
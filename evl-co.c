@@ -0,0 +1,487 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* accept4 */
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+/*
+ * coroutines.
+ *
+ * each coroutine runs on its own stack. the calls below try the
+ * operation straight away, and if it would block they wait for an
+ * evl_io or evl_tmo and switch back to evl_dispatch. the callback
+ * for that event switches back to the coroutine again.
+ *
+ * the switch only saves the registers the calling convention says
+ * must survive a function call, so it doesn't need a syscall like
+ * swapcontext does to save the signal mask.
+ */
+
+#define EVL_CO_STACKSIZE	(256 * 1024)
+#define EVL_CO_GUARD		4096
+#define EVL_CO_MAPLEN		(EVL_CO_STACKSIZE + EVL_CO_GUARD)
+#define EVL_CO_NFREE		64	/* stacks kept for reuse */
+
+#ifndef MAP_STACK
+#define MAP_STACK		0
+#endif
+
+/* the struct evl_co lives at the top of its stack */
+struct evl_co {
+	struct evl_work		 evlco_work;	/* starts the coroutine */
+	TAILQ_ENTRY(evl_co)	 evlco_entry;	/* on the free list */
+	void			*evlco_sp;
+	void			*evlco_caller_sp;
+	void			(*evlco_fn)(struct evl_co *, void *);
+	void			*evlco_arg;
+	int			 evlco_done;
+};
+
+#ifdef EVL_HAS_CO
+static void	evl_co_main(struct evl_co *) __attribute__((__noreturn__));
+
+void		evl_co_swap(void **, void *);
+void		evl_co_entry(void);
+
+#if defined(__x86_64__)
+__asm__ (
+"	.text\n"
+"	.globl	evl_co_swap\n"
+"	.hidden	evl_co_swap\n"
+"	.type	evl_co_swap,@function\n"
+"evl_co_swap:\n"
+"	pushq	%rbp\n"
+"	pushq	%rbx\n"
+"	pushq	%r12\n"
+"	pushq	%r13\n"
+"	pushq	%r14\n"
+"	pushq	%r15\n"
+"	subq	$8, %rsp\n"
+"	stmxcsr	(%rsp)\n"
+"	fnstcw	4(%rsp)\n"
+"	movq	%rsp, (%rdi)\n"
+"	movq	%rsi, %rsp\n"
+"	ldmxcsr	(%rsp)\n"
+"	fldcw	4(%rsp)\n"
+"	addq	$8, %rsp\n"
+"	popq	%r15\n"
+"	popq	%r14\n"
+"	popq	%r13\n"
+"	popq	%r12\n"
+"	popq	%rbx\n"
+"	popq	%rbp\n"
+"	ret\n"
+"	.size	evl_co_swap, .-evl_co_swap\n"
+"\n"
+"	.globl	evl_co_entry\n"
+"	.hidden	evl_co_entry\n"
+"	.type	evl_co_entry,@function\n"
+"evl_co_entry:\n"
+"	movq	%r12, %rdi\n"
+"	callq	*%r13\n"
+"	ud2\n"
+"	.size	evl_co_entry, .-evl_co_entry\n"
+);
+
+/* what evl_co_swap pops off a new stack */
+static void *
+evl_co_frame(struct evl_co *evlco, void *top)
+{
+	uint64_t *sp = top;
+
+	sp -= 8;
+	sp[0] = 0x037f00001f80ULL;	/* default fpu control and mxcsr */
+	sp[1] = 0;			/* r15 */
+	sp[2] = 0;			/* r14 */
+	sp[3] = (uint64_t)(uintptr_t)evl_co_main;	/* r13 */
+	sp[4] = (uint64_t)(uintptr_t)evlco;		/* r12 */
+	sp[5] = 0;			/* rbx */
+	sp[6] = 0;			/* rbp */
+	sp[7] = (uint64_t)(uintptr_t)evl_co_entry;	/* return address */
+
+	return (sp);
+}
+#elif defined(__aarch64__)
+__asm__ (
+"	.text\n"
+"	.globl	evl_co_swap\n"
+"	.hidden	evl_co_swap\n"
+"	.type	evl_co_swap,%function\n"
+"evl_co_swap:\n"
+"	sub	sp, sp, #160\n"
+"	stp	x19, x20, [sp, #0]\n"
+"	stp	x21, x22, [sp, #16]\n"
+"	stp	x23, x24, [sp, #32]\n"
+"	stp	x25, x26, [sp, #48]\n"
+"	stp	x27, x28, [sp, #64]\n"
+"	stp	x29, x30, [sp, #80]\n"
+"	stp	d8, d9, [sp, #96]\n"
+"	stp	d10, d11, [sp, #112]\n"
+"	stp	d12, d13, [sp, #128]\n"
+"	stp	d14, d15, [sp, #144]\n"
+"	mov	x9, sp\n"
+"	str	x9, [x0]\n"
+"	mov	sp, x1\n"
+"	ldp	x19, x20, [sp, #0]\n"
+"	ldp	x21, x22, [sp, #16]\n"
+"	ldp	x23, x24, [sp, #32]\n"
+"	ldp	x25, x26, [sp, #48]\n"
+"	ldp	x27, x28, [sp, #64]\n"
+"	ldp	x29, x30, [sp, #80]\n"
+"	ldp	d8, d9, [sp, #96]\n"
+"	ldp	d10, d11, [sp, #112]\n"
+"	ldp	d12, d13, [sp, #128]\n"
+"	ldp	d14, d15, [sp, #144]\n"
+"	add	sp, sp, #160\n"
+"	ret\n"
+"	.size	evl_co_swap, .-evl_co_swap\n"
+"\n"
+"	.globl	evl_co_entry\n"
+"	.hidden	evl_co_entry\n"
+"	.type	evl_co_entry,%function\n"
+"evl_co_entry:\n"
+"	mov	x0, x19\n"
+"	blr	x20\n"
+"	brk	#0\n"
+"	.size	evl_co_entry, .-evl_co_entry\n"
+);
+
+/* what evl_co_swap loads off a new stack */
+static void *
+evl_co_frame(struct evl_co *evlco, void *top)
+{
+	uint64_t *sp = top;
+	unsigned int i;
+
+	sp -= 20;
+	for (i = 0; i < 20; i++)
+		sp[i] = 0;
+	sp[0] = (uint64_t)(uintptr_t)evlco;		/* x19 */
+	sp[1] = (uint64_t)(uintptr_t)evl_co_main;	/* x20 */
+	sp[11] = (uint64_t)(uintptr_t)evl_co_entry;	/* x30 */
+
+	return (sp);
+}
+#endif
+
+#else /* EVL_HAS_CO */
+
+/* there's no evl_co_swap here, so evl_co_create fails */
+static void *
+evl_co_frame(struct evl_co *evlco, void *top)
+{
+	return (NULL);
+}
+
+#endif /* EVL_HAS_CO */
+
+struct evl_cos *
+evl_cos_create(void)
+{
+	struct evl_cos *evlcs;
+
+	evlcs = evl_malloc(sizeof(*evlcs));
+	if (evlcs == NULL)
+		return (NULL);
+
+	TAILQ_INIT(&evlcs->evlcs_free);
+	evlcs->evlcs_nfree = 0;
+	evlcs->evlcs_nstacks = 0;
+	evlcs->evlcs_running = NULL;
+
+	return (evlcs);
+}
+
+static void
+evl_co_unmap(struct evl_co *evlco)
+{
+	munmap((char *)(evlco + 1) - EVL_CO_MAPLEN, EVL_CO_MAPLEN);
+}
+
+void
+evl_cos_destroy(struct evl_cos *evlcs)
+{
+	struct evl_co *evlco;
+
+	if (evlcs == NULL)
+		return;
+
+	assert(evlcs->evlcs_nstacks == evlcs->evlcs_nfree);
+
+	while ((evlco = TAILQ_FIRST(&evlcs->evlcs_free)) != NULL) {
+		TAILQ_REMOVE(&evlcs->evlcs_free, evlco, evlco_entry);
+		evl_co_unmap(evlco);
+	}
+
+	evl_free(evlcs);
+}
+
+static struct evl_co *
+evl_co_get(struct evl_cos *evlcs)
+{
+	struct evl_co *evlco;
+	char *mem;
+
+	evlco = TAILQ_FIRST(&evlcs->evlcs_free);
+	if (evlco != NULL) {
+		TAILQ_REMOVE(&evlcs->evlcs_free, evlco, evlco_entry);
+		evlcs->evlcs_nfree--;
+		return (evlco);
+	}
+
+	/* openbsd insists that the stack pointer is in MAP_STACK memory */
+	mem = mmap(NULL, EVL_CO_MAPLEN, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON | MAP_STACK, -1, 0);
+	if (mem == MAP_FAILED)
+		return (NULL);
+
+	/* overflowing the stack faults instead of scribbling on memory */
+	if (mprotect(mem, EVL_CO_GUARD, PROT_NONE) == -1) {
+		munmap(mem, EVL_CO_MAPLEN);
+		return (NULL);
+	}
+
+	evlcs->evlcs_nstacks++;
+
+	return ((struct evl_co *)(void *)(mem + EVL_CO_MAPLEN) - 1);
+}
+
+static void
+evl_co_put(struct evl_cos *evlcs, struct evl_co *evlco)
+{
+	if (evlcs->evlcs_nfree >= EVL_CO_NFREE) {
+		evl_co_unmap(evlco);
+		evlcs->evlcs_nstacks--;
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&evlcs->evlcs_free, evlco, evlco_entry);
+	evlcs->evlcs_nfree++;
+}
+
+static void
+evl_co_resume(int nil, int events, void *arg)
+{
+	struct evl_co *evlco = arg;
+	struct evl_base *evlb = evl_work_base(&evlco->evlco_work);
+	struct evl_cos *evlcs = evl_base_cos(evlb);
+
+	assert(evlcs->evlcs_running == NULL);
+
+	evlcs->evlcs_running = evlco;
+#ifdef EVL_HAS_CO
+	evl_co_swap(&evlco->evlco_caller_sp, evlco->evlco_sp);
+#endif
+	evlcs->evlcs_running = NULL;
+
+	if (evlco->evlco_done) {
+		evl_work_fini(&evlco->evlco_work);
+		evl_co_put(evlcs, evlco);
+	}
+}
+
+static void
+evl_co_suspend(struct evl_co *evlco)
+{
+#ifdef EVL_HAS_CO
+	evl_co_swap(&evlco->evlco_sp, evlco->evlco_caller_sp);
+#endif
+}
+
+#ifdef EVL_HAS_CO
+static void
+evl_co_main(struct evl_co *evlco)
+{
+	(*evlco->evlco_fn)(evlco, evlco->evlco_arg);
+
+	/* evl_co_resume puts the stack away once it's off it */
+	evlco->evlco_done = 1;
+	evl_co_suspend(evlco);
+
+	abort();
+}
+#endif
+
+struct evl_co *
+evl_co_create(struct evl_base *evlb, void (*fn)(struct evl_co *, void *),
+    void *arg)
+{
+	struct evl_cos *evlcs;
+	struct evl_co *evlco;
+
+#ifndef EVL_HAS_CO
+	errno = EOPNOTSUPP;
+	return (NULL);
+#endif
+
+	evlcs = evl_base_cos(evlb);
+	if (evlcs == NULL)
+		return (NULL);
+
+	evlco = evl_co_get(evlcs);
+	if (evlco == NULL)
+		return (NULL);
+
+	evl_work_init(&evlco->evlco_work, evlb, 0, evl_co_resume, evlco);
+	/* the stack starts below the struct evl_co, aligned for calls */
+	evlco->evlco_sp = evl_co_frame(evlco,
+	    (void *)((uintptr_t)evlco & ~(uintptr_t)15));
+	evlco->evlco_caller_sp = NULL;
+	evlco->evlco_fn = fn;
+	evlco->evlco_arg = arg;
+	evlco->evlco_done = 0;
+
+	/* the coroutine starts running from evl_dispatch */
+	evl_work_add(&evlco->evlco_work, 0);
+
+	return (evlco);
+}
+
+struct evl_base *
+evl_co_base(const struct evl_co *evlco)
+{
+	return (evl_work_base(&evlco->evlco_work));
+}
+
+static int
+evl_co_wait(struct evl_co *evlco, int fd, int events)
+{
+	struct evl_base *evlb = evl_work_base(&evlco->evlco_work);
+	struct evl_io evlio;
+
+	assert(evl_base_cos(evlb)->evlcs_running == evlco);
+
+	/* the coroutine stack stays put while it waits */
+	if (evl_io_init(&evlio, evlb, fd, events, evl_co_resume, evlco) == -1)
+		return (-1);
+
+	evl_io_add(&evlio);
+	evl_co_suspend(evlco);
+	evl_io_fini(&evlio);
+
+	return (0);
+}
+
+ssize_t
+evl_co_read(struct evl_co *evlco, int fd, void *buf, size_t len)
+{
+	ssize_t rv;
+
+	for (;;) {
+		rv = read(fd, buf, len);
+		if (rv != -1)
+			return (rv);
+
+		switch (errno) {
+		case EINTR:
+			break;
+		case EAGAIN:
+			if (evl_co_wait(evlco, fd, EVL_READ) == -1)
+				return (-1);
+			break;
+		default:
+			return (-1);
+		}
+	}
+}
+
+ssize_t
+evl_co_write(struct evl_co *evlco, int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t off = 0;
+	ssize_t rv;
+
+	while (off < len) {
+		rv = write(fd, p + off, len - off);
+		if (rv != -1) {
+			off += rv;
+			continue;
+		}
+
+		switch (errno) {
+		case EINTR:
+			break;
+		case EAGAIN:
+			if (evl_co_wait(evlco, fd, EVL_WRITE) == -1)
+				return (-1);
+			break;
+		default:
+			return (-1);
+		}
+	}
+
+	return (off);
+}
+
+int
+evl_co_accept(struct evl_co *evlco, int fd, struct sockaddr *sa,
+    socklen_t *salen)
+{
+	int s;
+
+	for (;;) {
+		s = accept4(fd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (s != -1)
+			return (s);
+
+		switch (errno) {
+		case EINTR:
+		case ECONNABORTED:
+			break;
+		case EAGAIN:
+			if (evl_co_wait(evlco, fd, EVL_READ) == -1)
+				return (-1);
+			break;
+		default:
+			return (-1);
+		}
+	}
+}
+
+int
+evl_co_sleep(struct evl_co *evlco, const struct timespec *ts)
+{
+	struct evl_base *evlb = evl_work_base(&evlco->evlco_work);
+	struct evl_tmo evlt;
+	int rv = 0;
+
+	assert(evl_base_cos(evlb)->evlcs_running == evlco);
+
+	evl_tmo_init(&evlt, evlb, evl_co_resume, evlco);
+	if (evl_tmo_add(&evlt, ts) == -1)
+		rv = -1;
+	else
+		evl_co_suspend(evlco);
+	evl_tmo_fini(&evlt);
+
+	return (rv);
+}
@@ -20,6 +20,38 @@
 
 struct evl_ops;
 
+#if defined(__linux__)
+#define EVL_HAS_SIGNALFD
+#define EVL_HAS_PIDFD
+#define EVL_HAS_MMSG
+#define EVL_HAS_SPLICE
+#define EVL_HAS_SENDFILE
+#define EVL_HAS_REUSEPORT_LB
+#endif
+
+#if defined(__FreeBSD__)
+#define EVL_HAS_REUSEPORT_LB
+#endif
+
+#if defined(__linux__) && !defined(EVL_NO_IO_URING)
+#define EVL_HAS_IO_URING
+#endif
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+#define EVL_HAS_CO
+#endif
+
+/*
+ * only systemtap's sys/sdt.h puts probes in notes that need nothing
+ * at link time. FreeBSD's has DTRACE_PROBEn call __dtrace_* symbols
+ * that only a dtrace -G step provides.
+ */
+#if defined(__linux__) && !defined(EVL_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define EVL_HAS_SDT
+#endif
+#endif
+
 #if 1 || defined(EVL_HAS_KQUEUE)
 extern const struct evl_ops evl_ops_kq;
 #ifndef EVL_DEFAULT_OPS
@@ -28,6 +60,7 @@ extern const struct evl_ops evl_ops_kq;
 #endif
 
 extern const struct evl_ops evl_ops_poll;
+extern const struct evl_ops evl_ops_sim;
 #ifndef EVL_DEFAULT_OPS
 #define EVL_DEFAULT_OPS	(&evl_ops_poll)
 #endif
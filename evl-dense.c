@@ -0,0 +1,610 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+#include "evl-probe.h"
+
+/*
+ * dense events.
+ *
+ * rather than a structure per event, the base keeps the state of
+ * these events in arrays indexed by the slot in their handle. the
+ * fields that dispatch looks at are kept apart from the callbacks,
+ * so running timeouts and fires walks packed memory. a single evl_tmo
+ * and evl_work stand in for all of them on the loop.
+ */
+
+#define EVL_DENSE_PENDING	(1 << 0)	/* timeout is scheduled */
+#define EVL_DENSE_FIRED		(1 << 1)	/* callback is due */
+#define EVL_DENSE_QUEUED	(1 << 2)	/* on the run queue */
+
+struct evl_dense_cb {
+	void			(*evldc_fn)(int, int, void *);
+	void			*evldc_arg;
+	int			 evldc_ident;
+};
+
+struct evl_dense {
+	struct evl_base		*evld_base;
+	struct evl_slots	 evld_slots;
+
+	/* looked at by dispatch */
+	unsigned char		*evld_flags;
+	int			*evld_fires;
+	struct timespec		*evld_deadlines;
+	unsigned int		*evld_heapidx;
+	unsigned int		*evld_qnext;
+
+	/* only needed to run the callback */
+	struct evl_dense_cb	*evld_cbs;
+
+	/* slots with a timeout scheduled, soonest first */
+	unsigned int		*evld_heap;
+	unsigned int		 evld_nheap;
+
+	/* slots to run the callback for, in the order they fired */
+	unsigned int		 evld_qhead;
+	unsigned int		 evld_qtail;
+	unsigned int		 evld_nfired;
+	int			 evld_running;
+
+	struct evl_tmo		 evld_tmo;
+	struct evl_work		 evld_work;
+};
+
+static void	evl_dense_expire(int, int, void *);
+static void	evl_dense_run(int, int, void *);
+
+struct evl_dense *
+evl_dense_alloc(struct evl_base *evlb)
+{
+	struct evl_dense *evld;
+
+	evld = evl_malloc(sizeof(*evld));
+	if (evld == NULL)
+		return (NULL);
+
+	evld->evld_base = evlb;
+	evl_slots_init(&evld->evld_slots);
+	evld->evld_flags = NULL;
+	evld->evld_fires = NULL;
+	evld->evld_deadlines = NULL;
+	evld->evld_heapidx = NULL;
+	evld->evld_qnext = NULL;
+	evld->evld_cbs = NULL;
+	evld->evld_heap = NULL;
+	evld->evld_nheap = 0;
+	evld->evld_qhead = EVL_SLOT_NONE;
+	evld->evld_qtail = EVL_SLOT_NONE;
+	evld->evld_nfired = 0;
+	evld->evld_running = 0;
+
+	evl_tmo_init(&evld->evld_tmo, evlb, evl_dense_expire, evld);
+	evl_work_init(&evld->evld_work, evlb, 0, evl_dense_run, evld);
+
+	return (evld);
+}
+
+void
+evl_dense_free(struct evl_dense *evld)
+{
+	if (evld == NULL)
+		return;
+
+	evl_work_fini(&evld->evld_work);
+	evl_tmo_fini(&evld->evld_tmo);
+
+	evl_free(evld->evld_heap);
+	evl_free(evld->evld_cbs);
+	evl_free(evld->evld_qnext);
+	evl_free(evld->evld_heapidx);
+	evl_free(evld->evld_deadlines);
+	evl_free(evld->evld_fires);
+	evl_free(evld->evld_flags);
+	evl_slots_fini(&evld->evld_slots);
+	evl_free(evld);
+}
+
+static int
+evl_dense_grow(struct evl_dense *evld, unsigned int len)
+{
+	unsigned char *flags;
+	int *fires;
+	struct timespec *deadlines;
+	unsigned int *heapidx, *qnext, *heap;
+	struct evl_dense_cb *cbs;
+	unsigned int olen = evld->evld_slots.evlsl_len;
+
+	/* arrays that have grown already are fine to keep if one fails */
+	flags = evl_reallocarray(evld->evld_flags, len, sizeof(*flags));
+	if (flags == NULL)
+		return (-1);
+	memset(flags + olen, 0, len - olen);
+	evld->evld_flags = flags;
+
+	fires = evl_reallocarray(evld->evld_fires, len, sizeof(*fires));
+	if (fires == NULL)
+		return (-1);
+	evld->evld_fires = fires;
+
+	deadlines = evl_reallocarray(evld->evld_deadlines, len,
+	    sizeof(*deadlines));
+	if (deadlines == NULL)
+		return (-1);
+	evld->evld_deadlines = deadlines;
+
+	heapidx = evl_reallocarray(evld->evld_heapidx, len, sizeof(*heapidx));
+	if (heapidx == NULL)
+		return (-1);
+	evld->evld_heapidx = heapidx;
+
+	qnext = evl_reallocarray(evld->evld_qnext, len, sizeof(*qnext));
+	if (qnext == NULL)
+		return (-1);
+	evld->evld_qnext = qnext;
+
+	cbs = evl_reallocarray(evld->evld_cbs, len, sizeof(*cbs));
+	if (cbs == NULL)
+		return (-1);
+	evld->evld_cbs = cbs;
+
+	/* every slot can have a timeout scheduled at once */
+	heap = evl_reallocarray(evld->evld_heap, len, sizeof(*heap));
+	if (heap == NULL)
+		return (-1);
+	evld->evld_heap = heap;
+
+	return (evl_slots_grow(&evld->evld_slots, len));
+}
+
+static inline unsigned int
+evl_dense_lookup(struct evl_base *evlb, uint64_t h, struct evl_dense **evldp)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	evld = evl_base_dense(evlb);
+	if (evld == NULL)
+		return (EVL_SLOT_NONE);
+
+	idx = evl_slots_lookup(&evld->evld_slots, h);
+	if (idx == EVL_SLOT_NONE) {
+		errno = ESTALE;
+		return (EVL_SLOT_NONE);
+	}
+
+	*evldp = evld;
+	return (idx);
+}
+
+/*
+ * timeouts
+ */
+
+static inline int
+evl_dense_before(const struct evl_dense *evld, unsigned int a, unsigned int b)
+{
+	return (timespeccmp(&evld->evld_deadlines[a],
+	    &evld->evld_deadlines[b], <));
+}
+
+static inline void
+evl_dense_heap_set(struct evl_dense *evld, unsigned int pos, unsigned int idx)
+{
+	evld->evld_heap[pos] = idx;
+	evld->evld_heapidx[idx] = pos;
+}
+
+static void
+evl_dense_heap_up(struct evl_dense *evld, unsigned int pos)
+{
+	unsigned int idx = evld->evld_heap[pos];
+	unsigned int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!evl_dense_before(evld, idx, evld->evld_heap[parent]))
+			break;
+
+		evl_dense_heap_set(evld, pos, evld->evld_heap[parent]);
+		pos = parent;
+	}
+
+	evl_dense_heap_set(evld, pos, idx);
+}
+
+static void
+evl_dense_heap_down(struct evl_dense *evld, unsigned int pos)
+{
+	unsigned int idx = evld->evld_heap[pos];
+	unsigned int child;
+
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= evld->evld_nheap)
+			break;
+		if (child + 1 < evld->evld_nheap &&
+		    evl_dense_before(evld, evld->evld_heap[child + 1],
+		    evld->evld_heap[child]))
+			child++;
+		if (!evl_dense_before(evld, evld->evld_heap[child], idx))
+			break;
+
+		evl_dense_heap_set(evld, pos, evld->evld_heap[child]);
+		pos = child;
+	}
+
+	evl_dense_heap_set(evld, pos, idx);
+}
+
+static void
+evl_dense_heap_insert(struct evl_dense *evld, unsigned int idx)
+{
+	unsigned int pos = evld->evld_nheap++;
+
+	evl_dense_heap_set(evld, pos, idx);
+	evl_dense_heap_up(evld, pos);
+}
+
+static void
+evl_dense_heap_remove(struct evl_dense *evld, unsigned int idx)
+{
+	unsigned int pos = evld->evld_heapidx[idx];
+	unsigned int last;
+
+	last = evld->evld_heap[--evld->evld_nheap];
+	if (last == idx)
+		return;
+
+	evl_dense_heap_set(evld, pos, last);
+	evl_dense_heap_up(evld, pos);
+	evl_dense_heap_down(evld, evld->evld_heapidx[last]);
+}
+
+/* schedule the evl_tmo for the soonest of the timeouts */
+static void
+evl_dense_arm(struct evl_dense *evld, const struct timespec *now)
+{
+	struct timespec ts;
+
+	if (evld->evld_nheap == 0) {
+		evl_tmo_del(&evld->evld_tmo);
+		return;
+	}
+
+	ts = evld->evld_deadlines[evld->evld_heap[0]];
+	if (timespeccmp(&ts, now, <=)) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+	} else
+		timespecsub(&ts, now, &ts);
+
+	evl_tmo_add(&evld->evld_tmo, &ts);
+}
+
+/*
+ * running callbacks
+ */
+
+static int
+evl_dense_queue(struct evl_dense *evld, unsigned int idx, int fires)
+{
+	unsigned char *flags = &evld->evld_flags[idx];
+
+	SET(evld->evld_fires[idx], fires);
+
+	if (ISSET(*flags, EVL_DENSE_FIRED))
+		return (0);
+
+	SET(*flags, EVL_DENSE_FIRED);
+	evld->evld_nfired++;
+
+	/* a slot that was deleted while queued keeps its place */
+	if (!ISSET(*flags, EVL_DENSE_QUEUED)) {
+		SET(*flags, EVL_DENSE_QUEUED);
+		evld->evld_qnext[idx] = EVL_SLOT_NONE;
+		if (evld->evld_qtail == EVL_SLOT_NONE)
+			evld->evld_qhead = idx;
+		else
+			evld->evld_qnext[evld->evld_qtail] = idx;
+		evld->evld_qtail = idx;
+	}
+
+	if (!evld->evld_running)
+		evl_work_add(&evld->evld_work, 0);
+
+	return (1);
+}
+
+/* the slot keeps its place on the run queue, which skips it */
+static void
+evl_dense_unfire(struct evl_dense *evld, unsigned int idx)
+{
+	CLR(evld->evld_flags[idx], EVL_DENSE_FIRED);
+	if (--evld->evld_nfired == 0 && !evld->evld_running)
+		evl_work_del(&evld->evld_work);
+}
+
+static void
+evl_dense_expire(int nil, int events, void *arg)
+{
+	struct evl_dense *evld = arg;
+	struct evl_stats *st = evl_base_stats(evld->evld_base);
+	struct timespec now;
+	unsigned int idx;
+
+	if (evl_base_now(evld->evld_base, &now) == -1)
+		return;
+
+	while (evld->evld_nheap > 0) {
+		idx = evld->evld_heap[0];
+		if (timespeccmp(&evld->evld_deadlines[idx], &now, >))
+			break;
+
+		evl_dense_heap_remove(evld, idx);
+		CLR(evld->evld_flags[idx], EVL_DENSE_PENDING);
+		evl_dense_queue(evld, idx, EVL_TIMEOUT);
+		st->evlst_tmo_fires++;
+	}
+
+	evl_dense_arm(evld, &now);
+}
+
+static void
+evl_dense_run(int nil, int events, void *arg)
+{
+	struct evl_dense *evld = arg;
+	struct evl_base *evlb = evld->evld_base;
+	struct evl_stats *st = evl_base_stats(evlb);
+	const struct evl_dense_cb *cb;
+	void (*fn)(int, int, void *);
+	void *cbarg;
+	unsigned int idx;
+	int ident, fires;
+
+	evld->evld_running = 1;
+	while ((idx = evld->evld_qhead) != EVL_SLOT_NONE) {
+		evld->evld_qhead = evld->evld_qnext[idx];
+		if (evld->evld_qhead == EVL_SLOT_NONE)
+			evld->evld_qtail = EVL_SLOT_NONE;
+		CLR(evld->evld_flags[idx], EVL_DENSE_QUEUED);
+
+		if (!ISSET(evld->evld_flags[idx], EVL_DENSE_FIRED))
+			continue;
+		CLR(evld->evld_flags[idx], EVL_DENSE_FIRED);
+		evld->evld_nfired--;
+
+		fires = evld->evld_fires[idx];
+		evld->evld_fires[idx] = 0;
+
+		/* the callback may create events and move the arrays */
+		cb = &evld->evld_cbs[idx];
+		fn = cb->evldc_fn;
+		ident = cb->evldc_ident;
+		cbarg = cb->evldc_arg;
+
+		st->evlst_callbacks++;
+		EVL_PROBE4(callback__start, evlb, fn, ident, fires);
+		(*fn)(ident, fires, cbarg);
+		EVL_PROBE3(callback__done, evlb, fn, ident);
+
+		if (!evl_base_running(evlb))
+			break;
+	}
+	evld->evld_running = 0;
+
+	/* pick up where this left off after evl_break */
+	if (evld->evld_nfired > 0)
+		evl_work_add(&evld->evld_work, 0);
+}
+
+/*
+ * api
+ */
+
+uint64_t
+evl_dense_create(struct evl_base *evlb, int ident,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_dense *evld;
+	struct evl_dense_cb *cb;
+	unsigned int idx, len;
+
+	evld = evl_base_dense(evlb);
+	if (evld == NULL)
+		return (0);
+
+	len = evl_slots_need(&evld->evld_slots);
+	if (len == UINT_MAX)
+		return (0);
+	if (len != 0 && evl_dense_grow(evld, len) == -1)
+		return (0);
+
+	idx = evl_slots_get(&evld->evld_slots);
+
+	/* a reused slot may still be on the run queue */
+	evld->evld_flags[idx] &= EVL_DENSE_QUEUED;
+	evld->evld_fires[idx] = 0;
+
+	cb = &evld->evld_cbs[idx];
+	cb->evldc_fn = fn;
+	cb->evldc_arg = arg;
+	cb->evldc_ident = ident;
+
+	return (evl_slots_handle(&evld->evld_slots, idx));
+}
+
+int
+evl_dense_set(struct evl_base *evlb, uint64_t h,
+    void (*fn)(int, int, void *))
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	evld->evld_cbs[idx].evldc_fn = fn;
+
+	return (0);
+}
+
+int
+evl_dense_set_arg(struct evl_base *evlb, uint64_t h, void *arg)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	evld->evld_cbs[idx].evldc_arg = arg;
+
+	return (0);
+}
+
+int
+evl_dense_add(struct evl_base *evlb, uint64_t h,
+    const struct timespec *offset)
+{
+	struct evl_stats *st = evl_base_stats(evlb);
+	struct evl_dense *evld;
+	struct timespec now;
+	unsigned int idx;
+	int rv = 1;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	if (evl_base_now(evlb, &now) == -1)
+		return (-1);
+
+	/* like evl_tmo_add, a timeout that hasn't run yet is moved */
+	if (ISSET(evld->evld_fires[idx], EVL_TIMEOUT)) {
+		CLR(evld->evld_fires[idx], EVL_TIMEOUT);
+		if (evld->evld_fires[idx] == 0)
+			evl_dense_unfire(evld, idx);
+		rv = 0;
+	} else if (ISSET(evld->evld_flags[idx], EVL_DENSE_PENDING)) {
+		evl_dense_heap_remove(evld, idx);
+		rv = 0;
+	}
+
+	SET(evld->evld_flags[idx], EVL_DENSE_PENDING);
+	timespecadd(&now, offset, &evld->evld_deadlines[idx]);
+	evl_dense_heap_insert(evld, idx);
+	st->evlst_tmo_adds++;
+
+	if (evld->evld_heap[0] == idx)
+		evl_dense_arm(evld, &now);
+
+	return (rv);
+}
+
+int
+evl_dense_fire(struct evl_base *evlb, uint64_t h, int fires)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	return (evl_dense_queue(evld, idx, fires));
+}
+
+int
+evl_dense_pending(struct evl_base *evlb, uint64_t h)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	return (ISSET(evld->evld_flags[idx],
+	    EVL_DENSE_PENDING | EVL_DENSE_FIRED) ? 1 : 0);
+}
+
+static int
+evl_dense_remove(struct evl_dense *evld, unsigned int idx)
+{
+	struct evl_stats *st = evl_base_stats(evld->evld_base);
+	unsigned char *flags = &evld->evld_flags[idx];
+	int rv = 0;
+
+	if (ISSET(*flags, EVL_DENSE_FIRED)) {
+		evld->evld_fires[idx] = 0;
+		evl_dense_unfire(evld, idx);
+		rv = 1;
+	}
+
+	if (ISSET(*flags, EVL_DENSE_PENDING)) {
+		CLR(*flags, EVL_DENSE_PENDING);
+		evl_dense_heap_remove(evld, idx);
+		if (evld->evld_nheap == 0)
+			evl_tmo_del(&evld->evld_tmo);
+		st->evlst_tmo_dels++;
+		rv = 1;
+	}
+
+	return (rv);
+}
+
+int
+evl_dense_del(struct evl_base *evlb, uint64_t h)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	return (evl_dense_remove(evld, idx));
+}
+
+int
+evl_dense_destroy(struct evl_base *evlb, uint64_t h)
+{
+	struct evl_dense *evld;
+	unsigned int idx;
+
+	idx = evl_dense_lookup(evlb, h, &evld);
+	if (idx == EVL_SLOT_NONE)
+		return (-1);
+
+	evl_dense_remove(evld, idx);
+	evl_slots_put(&evld->evld_slots, idx);
+
+	return (0);
+}
@@ -0,0 +1,261 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+
+/*
+ * generation counted slots.
+ *
+ * a handle is a slot index in the low 32 bits and the generation of
+ * the slot in the high 32 bits. the generation is bumped when a slot
+ * is handed out and again when it is given back, so it is odd while
+ * the slot is in use and a handle from before the slot was freed no
+ * longer matches. free slots are reused oldest first, so a slot only
+ * comes around again after every other free slot has been used, and
+ * a stale handle would have to survive 2^31 reuses of its slot to
+ * match again.
+ */
+
+#define EVL_SLOTS_MINLEN	64
+#define EVL_SLOTS_MAXLEN	(UINT_MAX / 2)
+
+void
+evl_slots_init(struct evl_slots *evlsl)
+{
+	evlsl->evlsl_gens = NULL;
+	evlsl->evlsl_next = NULL;
+	evlsl->evlsl_len = 0;
+	evlsl->evlsl_nslots = 0;
+	evlsl->evlsl_head = EVL_SLOT_NONE;
+	evlsl->evlsl_tail = EVL_SLOT_NONE;
+}
+
+void
+evl_slots_fini(struct evl_slots *evlsl)
+{
+	evl_free(evlsl->evlsl_next);
+	evl_free(evlsl->evlsl_gens);
+}
+
+/*
+ * work out how long the arrays need to be for another slot, or 0 if
+ * one is already available without growing them.
+ */
+unsigned int
+evl_slots_need(const struct evl_slots *evlsl)
+{
+	unsigned int len;
+
+	if (evlsl->evlsl_head != EVL_SLOT_NONE ||
+	    evlsl->evlsl_nslots < evlsl->evlsl_len)
+		return (0);
+
+	if (evlsl->evlsl_len >= EVL_SLOTS_MAXLEN) {
+		errno = ENOMEM;
+		return (UINT_MAX);
+	}
+
+	len = evlsl->evlsl_len * 2;
+	if (len < EVL_SLOTS_MINLEN)
+		len = EVL_SLOTS_MINLEN;
+
+	return (len);
+}
+
+int
+evl_slots_grow(struct evl_slots *evlsl, unsigned int len)
+{
+	unsigned int *gens, *next;
+
+	gens = evl_reallocarray(evlsl->evlsl_gens, len, sizeof(*gens));
+	if (gens == NULL)
+		return (-1);
+	evlsl->evlsl_gens = gens;
+
+	next = evl_reallocarray(evlsl->evlsl_next, len, sizeof(*next));
+	if (next == NULL)
+		return (-1);
+	evlsl->evlsl_next = next;
+
+	evlsl->evlsl_len = len;
+
+	return (0);
+}
+
+unsigned int
+evl_slots_get(struct evl_slots *evlsl)
+{
+	unsigned int idx;
+
+	idx = evlsl->evlsl_head;
+	if (idx != EVL_SLOT_NONE) {
+		evlsl->evlsl_head = evlsl->evlsl_next[idx];
+		if (evlsl->evlsl_head == EVL_SLOT_NONE)
+			evlsl->evlsl_tail = EVL_SLOT_NONE;
+	} else {
+		assert(evlsl->evlsl_nslots < evlsl->evlsl_len);
+		idx = evlsl->evlsl_nslots++;
+		evlsl->evlsl_gens[idx] = 0;
+	}
+
+	evlsl->evlsl_gens[idx]++;
+
+	return (idx);
+}
+
+void
+evl_slots_put(struct evl_slots *evlsl, unsigned int idx)
+{
+	assert(evl_slots_used(evlsl, idx));
+
+	evlsl->evlsl_gens[idx]++;
+
+	evlsl->evlsl_next[idx] = EVL_SLOT_NONE;
+	if (evlsl->evlsl_tail == EVL_SLOT_NONE)
+		evlsl->evlsl_head = idx;
+	else
+		evlsl->evlsl_next[evlsl->evlsl_tail] = idx;
+	evlsl->evlsl_tail = idx;
+}
+
+uint64_t
+evl_slots_handle(const struct evl_slots *evlsl, unsigned int idx)
+{
+	return (((uint64_t)evlsl->evlsl_gens[idx] << 32) | idx);
+}
+
+unsigned int
+evl_slots_lookup(const struct evl_slots *evlsl, uint64_t h)
+{
+	unsigned int idx = h & 0xffffffff;
+
+	if (idx >= evlsl->evlsl_nslots ||
+	    evlsl->evlsl_gens[idx] != (h >> 32) ||
+	    !evl_slots_used(evlsl, idx))
+		return (EVL_SLOT_NONE);
+
+	return (idx);
+}
+
+/*
+ * handles for events that live in their own storage.
+ */
+
+struct evl_handle {
+	struct evl_work		*evlh_work;
+	unsigned int		 evlh_type;
+};
+
+struct evl_handles {
+	struct evl_slots	 evlhs_slots;
+	struct evl_handle	*evlhs_handles;
+};
+
+struct evl_handles *
+evl_handles_create(void)
+{
+	struct evl_handles *evlhs;
+
+	evlhs = evl_malloc(sizeof(*evlhs));
+	if (evlhs == NULL)
+		return (NULL);
+
+	evl_slots_init(&evlhs->evlhs_slots);
+	evlhs->evlhs_handles = NULL;
+
+	return (evlhs);
+}
+
+void
+evl_handles_destroy(struct evl_handles *evlhs)
+{
+	if (evlhs == NULL)
+		return;
+
+	evl_free(evlhs->evlhs_handles);
+	evl_slots_fini(&evlhs->evlhs_slots);
+	evl_free(evlhs);
+}
+
+uint64_t
+evl_handles_get(struct evl_handles *evlhs, struct evl_work *evl,
+    unsigned int type)
+{
+	struct evl_slots *evlsl = &evlhs->evlhs_slots;
+	struct evl_handle *evlh;
+	unsigned int idx, len;
+
+	/* the work struct keeps the slot, offset by one */
+	if (evl->evl_handle != 0)
+		return (evl_slots_handle(evlsl, evl->evl_handle - 1));
+
+	len = evl_slots_need(evlsl);
+	if (len == UINT_MAX)
+		return (0);
+	if (len != 0) {
+		evlh = evl_reallocarray(evlhs->evlhs_handles, len,
+		    sizeof(*evlh));
+		if (evlh == NULL)
+			return (0);
+		evlhs->evlhs_handles = evlh;
+
+		if (evl_slots_grow(evlsl, len) == -1)
+			return (0);
+	}
+
+	idx = evl_slots_get(evlsl);
+	evlh = &evlhs->evlhs_handles[idx];
+	evlh->evlh_work = evl;
+	evlh->evlh_type = type;
+
+	evl->evl_handle = idx + 1;
+
+	return (evl_slots_handle(evlsl, idx));
+}
+
+struct evl_work *
+evl_handles_lookup(const struct evl_handles *evlhs, uint64_t h,
+    unsigned int type)
+{
+	const struct evl_handle *evlh;
+	unsigned int idx;
+
+	idx = evl_slots_lookup(&evlhs->evlhs_slots, h);
+	if (idx == EVL_SLOT_NONE)
+		return (NULL);
+
+	evlh = &evlhs->evlhs_handles[idx];
+	if (evlh->evlh_type != type)
+		return (NULL);
+
+	return (evlh->evlh_work);
+}
+
+void
+evl_handles_put(struct evl_handles *evlhs, struct evl_work *evl)
+{
+	evl_slots_put(&evlhs->evlhs_slots, evl->evl_handle - 1);
+	evl->evl_handle = 0;
+}
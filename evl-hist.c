@@ -0,0 +1,146 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+
+static uint64_t
+evl_hist_lo(unsigned int idx)
+{
+	unsigned int e;
+
+	if (idx < EVL_HIST_SUB)
+		return (idx);
+
+	e = (idx >> EVL_HIST_SUBBITS) + EVL_HIST_SUBBITS - 1;
+	return ((uint64_t)(EVL_HIST_SUB | (idx & (EVL_HIST_SUB - 1))) <<
+	    (e - EVL_HIST_SUBBITS));
+}
+
+static uint64_t
+evl_hist_hi(unsigned int idx)
+{
+	unsigned int e;
+
+	if (idx < EVL_HIST_SUB)
+		return (idx);
+
+	e = (idx >> EVL_HIST_SUBBITS) + EVL_HIST_SUBBITS - 1;
+	return (evl_hist_lo(idx) + ((uint64_t)1 << (e - EVL_HIST_SUBBITS)) - 1);
+}
+
+struct evl_hist *
+evl_hist_alloc(void)
+{
+	struct evl_hist *evlh;
+
+	evlh = evl_malloc(sizeof(*evlh));
+	if (evlh == NULL)
+		return (NULL);
+
+	evl_hist_reset(evlh);
+
+	return (evlh);
+}
+
+void
+evl_hist_reset(struct evl_hist *evlh)
+{
+	memset(evlh, 0, sizeof(*evlh));
+	evlh->evlh_min = UINT64_MAX;
+}
+
+uint64_t
+evl_hist_count(const struct evl_hist *evlh)
+{
+	return (evlh->evlh_count);
+}
+
+uint64_t
+evl_hist_min(const struct evl_hist *evlh)
+{
+	return (evlh->evlh_count == 0 ? 0 : evlh->evlh_min);
+}
+
+uint64_t
+evl_hist_max(const struct evl_hist *evlh)
+{
+	return (evlh->evlh_max);
+}
+
+uint64_t
+evl_hist_mean(const struct evl_hist *evlh)
+{
+	if (evlh->evlh_count == 0)
+		return (0);
+
+	return (evlh->evlh_sum / evlh->evlh_count);
+}
+
+uint64_t
+evl_hist_quantile(const struct evl_hist *evlh, double q)
+{
+	uint64_t rank, n = 0;
+	unsigned int idx;
+
+	if (evlh->evlh_count == 0)
+		return (0);
+
+	if (q <= 0.0)
+		return (evlh->evlh_min);
+	if (q >= 1.0)
+		return (evlh->evlh_max);
+
+	/* round the rank up so small samples don't hide the tail */
+	rank = (uint64_t)(q * (double)evlh->evlh_count);
+	if ((double)rank < q * (double)evlh->evlh_count)
+		rank++;
+
+	for (idx = 0; idx < EVL_HIST_NBUCKETS; idx++) {
+		n += evlh->evlh_buckets[idx];
+		if (n >= rank) {
+			/* report the top of the bucket, but not past max */
+			if (evl_hist_hi(idx) > evlh->evlh_max)
+				return (evlh->evlh_max);
+			return (evl_hist_hi(idx));
+		}
+	}
+
+	return (evlh->evlh_max);
+}
+
+int
+evl_hist_bucket(const struct evl_hist *evlh, unsigned int idx,
+    struct evl_hist_bucket *b)
+{
+	if (idx >= EVL_HIST_NBUCKETS) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	b->evlhb_lo = evl_hist_lo(idx);
+	b->evlhb_hi = evl_hist_hi(idx);
+	b->evlhb_count = evlh->evlh_buckets[idx];
+
+	return (0);
+}
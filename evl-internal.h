@@ -17,7 +17,10 @@
 #ifndef _LIB_EVL_INTERNAL_H_
 #define _LIB_EVL_INTERNAL_H_
 
+#include <sys/types.h>
 #include <sys/queue.h>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 
 #include "evl.h"
@@ -27,29 +30,37 @@
 #define CLR(_v, _m)	((_v) &= ~(_m))
 #define ISSET(_v, _m)	((_v) & (_m))
 
+#define EVL_CTASSERT(_x)						\
+	extern char evl_ctassert[(_x) ? 1 : -1] __attribute__((__unused__))
+
 struct evl_ops {
-	void		*(*evlo_create)(void);
+	const char	  *evlo_name;
+
+	void		*(*evlo_create)(struct evl_base *);
 	void		 (*evlo_destroy)(void *);
 
 	int		 (*evlo_dispatch)(struct evl_base *,
 			       const struct timespec *);
+	/* fd that is readable when dispatch has something to do */
+	int		 (*evlo_fd)(struct evl_base *);
+	/* dispatch has to run even though the fd may not be readable */
+	int		 (*evlo_pending)(struct evl_base *);
 
 	int		 (*evlo_io_create)(struct evl_io *);
 	void		 (*evlo_io_add)(struct evl_io *);
 	void		 (*evlo_io_del)(struct evl_io *);
+	/* called with the new events before evl_event is updated */
+	void		 (*evlo_io_modify)(struct evl_io *, int);
 	void		 (*evlo_io_destroy)(struct evl_io *);
 
-#ifdef notyet
-	int		 (*evlo_sig_create(struct evl_sig *);
+	int		 (*evlo_sig_create)(struct evl_sig *);
 	void		 (*evlo_sig_add)(struct evl_sig *);
 	void		 (*evlo_sig_del)(struct evl_sig *);
 	void		 (*evlo_sig_destroy)(struct evl_sig *);
 
+	/* the backend watches for the exit from create until destroy */
 	int		 (*evlo_wait_create)(struct evl_wait *);
-	void		 (*evlo_wait_add)(struct evl_wait *);
-	void		 (*evlo_wait_del)(struct evl_wait *);
 	void		 (*evlo_wait_destroy)(struct evl_wait *);
-#endif
 };
 
 #define EVL_PENDING	(1 << 30)	/* event is waiting to fire */
@@ -66,12 +77,28 @@ struct evl_work {
 	int		  evl_ident;
 	int		  evl_event;
 	int		  evl_fires;
+	/*
+	 * handle slot + 1, or 0. this fills padding on LP64 but makes
+	 * the struct 36 bytes on ILP32, which EVL_WORK_SIZE allows for.
+	 */
+	unsigned int	  evl_handle;
 };
 #define evl_work_base(_evl)	((_evl)->evl_base)
 
+/*
+ * every evl_io on an fd shares an evl_fd, and the backend only sees
+ * the evl_io inside that. it is added with the events of all the
+ * added evl_ios on the fd and evl_io_fire hands events out to them.
+ */
+struct evl_fd;
+
 struct evl_io {
 	struct evl_work	  evl_io_work;
-	unsigned int	  evl_io_idx;
+	TAILQ_ENTRY(evl_io)
+			  evl_io_entry;	/* on the evl_fd, or the base */
+	struct evl_fd	 *evl_io_mux;
+	unsigned int	  evl_io_idx;	/* for the backend */
+	int		  evl_io_reg;	/* for the backend */
 };
 #define evl_io_base(_evlio)	evl_work_base(&(_evlio)->evl_io_work)
 
@@ -83,25 +110,228 @@ struct evl_tmo {
 };
 #define evl_tmo_base(_evlt)	evl_work_base(&(_evlt)->evl_tmo_work)
 
-#ifdef notyet
 struct evl_sig {
 	struct evl_work	  evl_sig_work;
-	void		(*evl_sig_handler)(int);
+	TAILQ_ENTRY(evl_sig)
+			  evl_sig_entry;
 };
 #define evl_sig_base(_evls)	evl_work_base(&(_evls)->evl_sig_work)
 
 struct evl_wait {
 	struct evl_work	  evl_wait_work;
+	void		 *evl_wait_backend;
+	int		  evl_wait_status;
+	int		  evl_wait_exited;
 };
 #define evl_wait_base(_evlw)	evl_work_base(&(_evlw)->evl_wait_work)
-#endif
+
+struct evl_pool {
+	TAILQ_ENTRY(evl_pool)
+			  evlpr_entry;
+	struct evl_pools *evlpr_pools;
+	const char	 *evlpr_name;
+	size_t		  evlpr_size;
+	void		 *evlpr_pages;
+	void		 *evlpr_items;
+	unsigned int	  evlpr_pgitems;
+	unsigned int	  evlpr_npages;
+	unsigned int	  evlpr_nitems;
+	unsigned int	  evlpr_nout;
+	unsigned int	  evlpr_hiwat;
+};
+
+struct evl_pools {
+	TAILQ_HEAD(, evl_pool)
+			  evlpl_list;
+	char		 *evlpl_arena;
+	size_t		  evlpl_arenalen;
+	size_t		  evlpl_arenaoff;
+};
+
+struct evl_chunk;
+TAILQ_HEAD(evl_chunk_list, evl_chunk);
+
+/* output that is written out once per loop iteration before sleeping */
+struct evl_flush {
+	TAILQ_ENTRY(evl_flush)
+			  evlf_entry;
+	void		(*evlf_fn)(struct evl_flush *);
+	int		  evlf_onq;
+};
+
+struct evl_bufs {
+	struct evl_chunk_list
+			  evlbs_free;
+	unsigned int	  evlbs_nfree;
+	unsigned int	  evlbs_nchunks;
+	TAILQ_HEAD(, evl_flush)
+			  evlbs_dirty;
+	struct evl_pool	  evlbs_rbuf_pool;
+	struct evl_pool	  evlbs_wbuf_pool;
+};
+
+/* generation counted slots for handles, see evl-handle.c */
+#define EVL_SLOT_NONE	UINT_MAX
+
+struct evl_slots {
+	unsigned int	 *evlsl_gens;
+	unsigned int	 *evlsl_next;	/* free list */
+	unsigned int	  evlsl_len;	/* length of the arrays */
+	unsigned int	  evlsl_nslots;	/* slots handed out so far */
+	unsigned int	  evlsl_head;	/* oldest free slot */
+	unsigned int	  evlsl_tail;
+};
+
+static inline int
+evl_slots_used(const struct evl_slots *evlsl, unsigned int idx)
+{
+	return (evlsl->evlsl_gens[idx] & 1);
+}
+
+#define EVL_HANDLE_WORK		1
+#define EVL_HANDLE_IO		2
+#define EVL_HANDLE_TMO		3
+
+struct evl_handles;
+struct evl_dense;
+struct evl_uring;
+
+struct evl_co;
+TAILQ_HEAD(evl_co_list, evl_co);
+
+/* coroutine stacks, kept around for reuse */
+struct evl_cos {
+	struct evl_co_list
+			  evlcs_free;
+	unsigned int	  evlcs_nfree;
+	unsigned int	  evlcs_nstacks;
+	struct evl_co	 *evlcs_running;
+};
+
+/*
+ * log-linear histogram. values below EVL_HIST_SUB get a bucket each,
+ * after that every power of two is split into EVL_HIST_SUB linear
+ * buckets, which keeps the error under 1/EVL_HIST_SUB of the value.
+ */
+#define EVL_HIST_SUBBITS	4
+#define EVL_HIST_SUB		(1U << EVL_HIST_SUBBITS)
+#define EVL_HIST_NBUCKETS	((64 - EVL_HIST_SUBBITS + 1) * EVL_HIST_SUB)
+
+#define EVL_NHISTS		3
+
+struct evl_hist {
+	uint64_t	  evlh_count;
+	uint64_t	  evlh_sum;
+	uint64_t	  evlh_min;
+	uint64_t	  evlh_max;
+	uint64_t	  evlh_buckets[EVL_HIST_NBUCKETS];
+};
+
+static inline unsigned int
+evl_hist_idx(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < EVL_HIST_SUB)
+		return (v);
+
+	e = 63 - __builtin_clzll(v);
+	return (((e - EVL_HIST_SUBBITS + 1) << EVL_HIST_SUBBITS) |
+	    ((v >> (e - EVL_HIST_SUBBITS)) & (EVL_HIST_SUB - 1)));
+}
+
+static inline void
+evl_hist_record(struct evl_hist *evlh, uint64_t v)
+{
+	evlh->evlh_buckets[evl_hist_idx(v)]++;
+	evlh->evlh_count++;
+	evlh->evlh_sum += v;
+	if (v < evlh->evlh_min)
+		evlh->evlh_min = v;
+	if (v > evlh->evlh_max)
+		evlh->evlh_max = v;
+}
+
+void		*evl_malloc(size_t);
+void		*evl_reallocarray(void *, size_t, size_t);
+void		 evl_free(void *);
+
+void		 evl_pools_init(struct evl_pools *);
+void		 evl_pools_fini(struct evl_pools *);
+int		 evl_pools_arena(struct evl_pools *, size_t);
+int		 evl_pools_stats(struct evl_pools *, unsigned int,
+		     struct evl_pool_stats *);
+
+void		 evl_pool_init(struct evl_pool *, struct evl_pools *,
+		     const char *, size_t);
+void		 evl_pool_fini(struct evl_pool *);
+void		*evl_pool_get(struct evl_pool *);
+void		 evl_pool_put(struct evl_pool *, void *);
+
+void		 evl_bufs_init(struct evl_bufs *, struct evl_pools *);
+void		 evl_bufs_fini(struct evl_bufs *);
+struct evl_chunk *
+		 evl_chunk_get(struct evl_bufs *);
+void		 evl_chunk_put(struct evl_bufs *, struct evl_chunk *);
+void		 evl_bufs_flush(struct evl_bufs *);
+
+void		 evl_slots_init(struct evl_slots *);
+void		 evl_slots_fini(struct evl_slots *);
+unsigned int	 evl_slots_need(const struct evl_slots *);
+int		 evl_slots_grow(struct evl_slots *, unsigned int);
+unsigned int	 evl_slots_get(struct evl_slots *);
+void		 evl_slots_put(struct evl_slots *, unsigned int);
+uint64_t	 evl_slots_handle(const struct evl_slots *, unsigned int);
+unsigned int	 evl_slots_lookup(const struct evl_slots *, uint64_t);
+
+struct evl_handles *
+		 evl_handles_create(void);
+void		 evl_handles_destroy(struct evl_handles *);
+uint64_t	 evl_handles_get(struct evl_handles *, struct evl_work *,
+		     unsigned int);
+struct evl_work	*evl_handles_lookup(const struct evl_handles *, uint64_t,
+		     unsigned int);
+void		 evl_handles_put(struct evl_handles *, struct evl_work *);
+
+struct evl_dense *
+		 evl_dense_alloc(struct evl_base *);
+void		 evl_dense_free(struct evl_dense *);
+
+struct evl_uring *
+		 evl_uring_create(struct evl_base *);
+void		 evl_uring_destroy(struct evl_uring *);
+void		 evl_uring_flush(struct evl_uring *);
+int		 evl_uring_pending(const struct evl_uring *);
+unsigned int	 evl_uring_inflight(const struct evl_uring *);
+
+struct evl_cos	*evl_cos_create(void);
+void		 evl_cos_destroy(struct evl_cos *);
+
+struct evl_hist	*evl_hist_alloc(void);
+
+void		 evl_flush_init(struct evl_flush *,
+		     void (*)(struct evl_flush *));
+void		 evl_flush_add(struct evl_bufs *, struct evl_flush *);
+void		 evl_flush_del(struct evl_bufs *, struct evl_flush *);
 
 void		*evl_backend(const struct evl_base *);
+const struct evl_ops *
+		 evl_base_ops(const struct evl_base *);
+struct evl_pools *
+		 evl_base_pools(struct evl_base *);
+struct evl_bufs	*evl_base_bufs(struct evl_base *);
+struct evl_cos	*evl_base_cos(struct evl_base *);
+struct evl_uring *
+		 evl_base_uring(struct evl_base *);
+struct evl_dense *
+		 evl_base_dense(struct evl_base *);
+int		 evl_base_now(struct evl_base *, struct timespec *);
+int		 evl_base_running(const struct evl_base *);
+struct evl_stats *
+		 evl_base_stats(struct evl_base *);
 
 void		 evl_io_fire(struct evl_io *, int);
-#ifdef notyet
-void		 evl_sig_fire(struct evl_sig *);
+void		 evl_sig_fire(struct evl_sig *, unsigned int);
 void		 evl_wait_fire(struct evl_wait *, int);
-#endif
 
 #endif /* _LIB_EVL_H */
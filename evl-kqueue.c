@@ -19,62 +19,105 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <errno.h>
 
 #include "evl-internal.h"
 
-static void	*evl_kq_init(void);
+static void	*evl_kq_init(struct evl_base *);
 static void	 evl_kq_destroy(void *);
 static int	 evl_kq_dispatch(struct evl_base *,
 		     const struct timespec *);
+static int	 evl_kq_fd(struct evl_base *);
+static int	 evl_kq_pending(struct evl_base *);
 
 static int	 evl_kq_io_create(struct evl_io *);
 static void	 evl_kq_io_add(struct evl_io *);
 static void	 evl_kq_io_del(struct evl_io *);
+static void	 evl_kq_io_modify(struct evl_io *, int);
 static void	 evl_kq_io_destroy(struct evl_io *);
 
+static int	 evl_kq_sig_create(struct evl_sig *);
+static void	 evl_kq_sig_add(struct evl_sig *);
+static void	 evl_kq_sig_del(struct evl_sig *);
+static void	 evl_kq_sig_destroy(struct evl_sig *);
+
+static int	 evl_kq_wait_create(struct evl_wait *);
+static void	 evl_kq_wait_destroy(struct evl_wait *);
+
 const struct evl_ops evl_ops_kq = {
+	"kqueue",
 	evl_kq_init,
 	evl_kq_destroy,
 	evl_kq_dispatch,
+	evl_kq_fd,
+	evl_kq_pending,
 	evl_kq_io_create,
 	evl_kq_io_add,
 	evl_kq_io_del,
+	evl_kq_io_modify,
 	evl_kq_io_destroy,
+	evl_kq_sig_create,
+	evl_kq_sig_add,
+	evl_kq_sig_del,
+	evl_kq_sig_destroy,
+	evl_kq_wait_create,
+	evl_kq_wait_destroy,
+};
+
+#define EVL_KQ_MINLEN	16
+
+struct evl_kq_sig {
+	struct evl_sig	*evlkqs_sig;
+	struct sigaction evlkqs_oact;
+	int		 evlkqs_flags;	/* change to apply at dispatch */
 };
 
 struct evl_kq {
 	int		 evlkq_fd;
+	pid_t		 evlkq_pid;	/* kqueues are not inherited */
 
 	struct kevent	*evlkq_kevents;
 	unsigned int	 evlkq_keventslen;
 	unsigned int	 evlkq_nevents;
 	unsigned int	 evlkq_nchanges;
+	unsigned int	 evlkq_ndeletes;	/* from destroyed ios */
+
+	struct evl_kq_sig
+			 evlkq_sigs[NSIG];
+	int		 evlkq_sigchanges;
 };
 
 static void *
-evl_kq_init(void)
+evl_kq_init(struct evl_base *evlb)
 {
 	struct evl_kq *evlkq;
 	int fd;
 
-	evlkq = malloc(sizeof(*evlkq));
+	evlkq = evl_malloc(sizeof(*evlkq));
 	if (evlkq == NULL)
 		return (NULL);
 
 	fd = kqueue();
 	if (fd == -1) {
-		free(evlkq);
+		evl_free(evlkq);
 		return (NULL);
 	}
 
 	evlkq->evlkq_fd = fd;
+	evlkq->evlkq_pid = getpid();
 	evlkq->evlkq_kevents = NULL;
 	evlkq->evlkq_keventslen = 0;
 	evlkq->evlkq_nevents = 0;
 	evlkq->evlkq_nchanges = 0;
+	evlkq->evlkq_ndeletes = 0;
+
+	memset(evlkq->evlkq_sigs, 0, sizeof(evlkq->evlkq_sigs));
+	evlkq->evlkq_sigchanges = 0;
 
 	return (evlkq);
 }
@@ -84,9 +127,11 @@ evl_kq_destroy(void *backend)
 {
 	struct evl_kq *evlkq = backend;
 
-	free(evlkq->evlkq_kevents);
-	close(evlkq->evlkq_fd);
-	free(evlkq);
+	evl_free(evlkq->evlkq_kevents);
+	/* after a fork the fd number may be in use by something else */
+	if (evlkq->evlkq_pid == getpid())
+		close(evlkq->evlkq_fd);
+	evl_free(evlkq);
 }
 
 static void
@@ -96,19 +141,15 @@ evl_kq_io_fire(const struct kevent *kev, int events)
 	struct evl_work *evl;
 
 	if (ISSET(kev->flags, EV_ERROR)) {
-		switch (kev->data) {
-		case 0:
-			/* handle EV_RECEIPT */
-			evlio = kev->udata;
+		/*
+		 * this is EV_RECEIPT, or the change failed, eg, with EBADF
+		 * after a close. either way the change has been used.
+		 * deletes from destroyed ios don't have an io.
+		 */
+		evlio = kev->udata;
+		if (evlio != NULL)
 			evlio->evl_io_idx = ~0; /* invalidate changes */
-			return;
-		case EBADF:
-			/* this can happen after a close */
-			return;
-		default:
-			/* oh well */
-			return;
-		}
+		return;
 	}
 
 	evlio = kev->udata;
@@ -123,15 +164,104 @@ evl_kq_io_fire(const struct kevent *kev, int events)
 	evl_io_fire(evlio, events);
 }
 
+static void
+evl_kq_sig_fire(struct evl_kq *evlkq, const struct kevent *kev)
+{
+	struct evl_sig *evls;
+
+	if (ISSET(kev->flags, EV_ERROR)) {
+		/* EV_RECEIPT or a signal that has since been deleted */
+		return;
+	}
+
+	evls = evlkq->evlkq_sigs[kev->ident].evlkqs_sig;
+	if (evls == NULL ||
+	    !ISSET(evls->evl_sig_work.evl_event, EVL_PENDING))
+		return;
+
+	evl_sig_fire(evls, kev->data);
+}
+
+static void
+evl_kq_wait_fire(const struct kevent *kev)
+{
+	struct evl_wait *evlw;
+	pid_t pid;
+	int status;
+
+	if (ISSET(kev->flags, EV_ERROR) || !ISSET(kev->fflags, NOTE_EXIT))
+		return;
+
+	evlw = kev->udata;
+	pid = kev->ident;
+
+	/* reap the child, or use the status from the kernel if we can't */
+	if (waitpid(pid, &status, WNOHANG) != pid)
+		status = kev->data;
+
+	evl_wait_fire(evlw, status);
+}
+
+/*
+ * signal changes are appended after the io changes just before they're
+ * given to the kernel, so the io change list can be reordered freely.
+ * the space for them was reserved when the evl_sig was created.
+ */
+static unsigned int
+evl_kq_sig_changes(struct evl_kq *evlkq, unsigned int nchanges)
+{
+	struct evl_kq_sig *evlkqs;
+	struct kevent *kev;
+	int signo;
+
+	if (!evlkq->evlkq_sigchanges)
+		return (nchanges);
+
+	for (signo = 1; signo < NSIG; signo++) {
+		evlkqs = &evlkq->evlkq_sigs[signo];
+		if (evlkqs->evlkqs_flags == 0)
+			continue;
+
+		kev = evlkq->evlkq_kevents + nchanges++;
+		EV_SET(kev, signo, EVFILT_SIGNAL,
+		    evlkqs->evlkqs_flags | EV_RECEIPT, 0, 0, NULL);
+	}
+
+	return (nchanges);
+}
+
+static void
+evl_kq_sig_commit(struct evl_kq *evlkq)
+{
+	struct evl_kq_sig *evlkqs;
+	int signo;
+
+	if (!evlkq->evlkq_sigchanges)
+		return;
+
+	for (signo = 1; signo < NSIG; signo++) {
+		evlkqs = &evlkq->evlkq_sigs[signo];
+		if (ISSET(evlkqs->evlkqs_flags, EV_DELETE))
+			evlkq->evlkq_nevents--;
+		evlkqs->evlkqs_flags = 0;
+	}
+
+	evlkq->evlkq_sigchanges = 0;
+}
+
 static int
 evl_kq_dispatch(struct evl_base *evlb, const struct timespec *ts)
 {
 	struct evl_kq *evlkq = evl_backend(evlb);
+	struct evl_stats *st = evl_base_stats(evlb);
 	struct kevent *kevs = evlkq->evlkq_kevents, *kev;
+	unsigned int nchanges;
 	int nevents;
 	int i;
 
-	nevents = kevent(evlkq->evlkq_fd, kevs, evlkq->evlkq_nchanges,
+	nchanges = evl_kq_sig_changes(evlkq, evlkq->evlkq_nchanges);
+
+	nevents = kevent(evlkq->evlkq_fd, kevs, nchanges,
 	    kevs, evlkq->evlkq_keventslen, ts);
 	if (nevents == -1) {
 		if (errno == EINTR)
@@ -141,6 +271,12 @@ evl_kq_dispatch(struct evl_base *evlb, const struct timespec *ts)
 	}
 
 	evlkq->evlkq_nchanges = 0;
+	evlkq->evlkq_nevents -= evlkq->evlkq_ndeletes;
+	evlkq->evlkq_ndeletes = 0;
+	evl_kq_sig_commit(evlkq);
+
+	st->evlst_updates += nchanges;
+	st->evlst_events += nevents;
 
 	for (i = 0; i < nevents; i++) {
 		kev = &kevs[i];
@@ -152,12 +288,35 @@ evl_kq_dispatch(struct evl_base *evlb, const struct timespec *ts)
 		case EVFILT_WRITE:
 			evl_kq_io_fire(kev, EVL_WRITE);
 			break;
+		case EVFILT_SIGNAL:
+			evl_kq_sig_fire(evlkq, kev);
+			break;
+		case EVFILT_PROC:
+			evl_kq_wait_fire(kev);
+			break;
 		}
 	}
 
 	return (0);
 }
 
+static int
+evl_kq_fd(struct evl_base *evlb)
+{
+	struct evl_kq *evlkq = evl_backend(evlb);
+
+	return (evlkq->evlkq_fd);
+}
+
+static int
+evl_kq_pending(struct evl_base *evlb)
+{
+	struct evl_kq *evlkq = evl_backend(evlb);
+
+	/* the kernel doesn't know about changes until they're applied */
+	return (evlkq->evlkq_nchanges > 0 || evlkq->evlkq_sigchanges);
+}
+
 static struct kevent *
 evl_kq_next_change(struct evl_kq *evlkq, unsigned int n)
 {
@@ -165,7 +324,13 @@ evl_kq_next_change(struct evl_kq *evlkq, unsigned int n)
 	unsigned int len = evlkq->evlkq_nevents + n + 1;
 
 	if (len >= evlkq->evlkq_keventslen) {
-		kev = reallocarray(evlkq->evlkq_kevents, len, sizeof(*kev));
+		/* grow geometrically to avoid a realloc per create */
+		if (len < evlkq->evlkq_keventslen * 2)
+			len = evlkq->evlkq_keventslen * 2;
+		if (len < EVL_KQ_MINLEN)
+			len = EVL_KQ_MINLEN;
+
+		kev = evl_reallocarray(evlkq->evlkq_kevents, len, sizeof(*kev));
 		if (kev == NULL)
 			return (NULL);
 
@@ -178,112 +343,205 @@ evl_kq_next_change(struct evl_kq *evlkq, unsigned int n)
 	return (kev + evlkq->evlkq_nchanges + n);
 }
 
-static int
-evl_kq_io_create(struct evl_io *evlio)
-{
-	struct evl_base *evlb = evl_io_base(evlio);
-	struct evl_kq *evlkq = evl_backend(evlb);
-	struct evl_work *evl = &evlio->evl_io_work;
-	struct kevent *kev;
-	unsigned int n;
-	int flags = EV_ADD | EV_DISABLE | EV_RECEIPT;
-	int fd;
-
-	fd = evl->evl_ident;
-	n = 0;
-
-	if (ISSET(evl->evl_event, EVL_READ)) {
-		kev = evl_kq_next_change(evlkq, n++);
-		if (kev == NULL)
-			return (-1);
-
-		EV_SET(kev, fd, EVFILT_READ, flags, NOTE_EOF, 0, evlio);
-	}
+/*
+ * an io only has filters registered for the events it has asked for,
+ * but evl_io_modify can add the other one later, so room for both is
+ * reserved when the io is created. the changes for an io are kept
+ * together at evl_io_idx until they're given to the kernel, and an
+ * entry with EV_ADD set is for a filter the kernel hasn't seen yet.
+ */
+#define EVL_KQ_IO_NEVENTS	2
 
-	if (ISSET(evl->evl_event, EVL_WRITE)) {
-		kev = evl_kq_next_change(evlkq, n++);
-		if (kev == NULL)
-			return (-1);
+static inline unsigned int
+evl_kq_nevents(const struct evl_io *evlio)
+{
+	return ((ISSET(evlio->evl_io_reg, EVL_READ) ? 1 : 0) +
+	    (ISSET(evlio->evl_io_reg, EVL_WRITE) ? 1 : 0));
+}
 
-		EV_SET(kev, fd, EVFILT_WRITE, flags, 0, 0, evlio);
-	}
+static inline int
+evl_kq_io_flags(int events)
+{
+	int flags = EV_ENABLE | EV_RECEIPT;
 
-	/* commit */
-	evlio->evl_io_idx = evlkq->evlkq_nchanges;
-	evlkq->evlkq_nchanges += n;
-	evlkq->evlkq_nevents += n;
+	if (ISSET(events, EVL_RW) != EVL_RW && !ISSET(events, EVL_PERSIST))
+		SET(flags, EV_DISPATCH);
 
-	return (0);
+	return (flags);
 }
 
+/*
+ * queue a change for each registered filter. filters for the events
+ * get flags, the rest are disabled.
+ */
 static void
-evl_kq_io(struct evl_io *evlio, int flags)
+evl_kq_io(struct evl_io *evlio, int events, int flags)
 {
 	struct evl_base *evlb = evl_io_base(evlio);
 	struct evl_kq *evlkq = evl_backend(evlb);
 	struct evl_work *evl = &evlio->evl_io_work;
 	struct kevent *kev;
 	unsigned int idx;
+	int rflags, wflags;
 	int fd;
 
+	rflags = ISSET(events, EVL_READ) ? flags : EV_DISABLE | EV_RECEIPT;
+	wflags = ISSET(events, EVL_WRITE) ? flags : EV_DISABLE | EV_RECEIPT;
+
 	idx = evlio->evl_io_idx;
 	if (idx == ~0U) {
 		/* new changes */
 		idx = evlkq->evlkq_nchanges;
+		evlio->evl_io_idx = idx;
 		fd = evl->evl_ident;
 
-		if (ISSET(evl->evl_event, EVL_READ)) {
+		if (ISSET(evlio->evl_io_reg, EVL_READ)) {
 			kev = evlkq->evlkq_kevents + idx++;
-			EV_SET(kev, fd, EVFILT_READ, flags, NOTE_EOF, 0, evlio);
+			EV_SET(kev, fd, EVFILT_READ, rflags, NOTE_EOF, 0, evlio);
 		}
 
-		if (ISSET(evl->evl_event, EVL_WRITE)) {
+		if (ISSET(evlio->evl_io_reg, EVL_WRITE)) {
 			kev = evlkq->evlkq_kevents + idx++;
-			EV_SET(kev, fd, EVFILT_WRITE, flags, 0, 0, evlio);
+			EV_SET(kev, fd, EVFILT_WRITE, wflags, 0, 0, evlio);
 		}
 
 		evlkq->evlkq_nchanges = idx;
 	} else {
 		/* tweak existing changes */
-		if (ISSET(evl->evl_event, EVL_READ)) {
+		if (ISSET(evlio->evl_io_reg, EVL_READ)) {
 			kev = evlkq->evlkq_kevents + idx++;
 			CLR(kev->flags, ~EV_ADD);
-			SET(kev->flags, flags);
+			SET(kev->flags, rflags);
 		}
 
-		if (ISSET(evl->evl_event, EVL_WRITE)) {
+		if (ISSET(evlio->evl_io_reg, EVL_WRITE)) {
 			kev = evlkq->evlkq_kevents + idx++;
 			CLR(kev->flags, ~EV_ADD);
-			SET(kev->flags, flags);
+			SET(kev->flags, wflags);
 		}
 	}
 }
 
+/* returns the events with filters that the kernel hasn't seen yet */
+static int
+evl_kq_io_unqueue(struct evl_kq *evlkq, struct evl_io *evlio)
+{
+	struct kevent *kev, *nkev;
+	struct evl_io *nevlio;
+	unsigned int nevents, n, idx;
+	int added = 0;
+
+	idx = evlio->evl_io_idx;
+	if (idx == ~0U)
+		return (0);
+
+	kev = evlkq->evlkq_kevents + idx;
+	nevents = evl_kq_nevents(evlio);
+
+	for (n = 0; n < nevents; n++) {
+		if (ISSET(kev[n].flags, EV_ADD)) {
+			SET(added, kev[n].filter == EVFILT_READ ?
+			    EVL_READ : EVL_WRITE);
+		}
+	}
+
+	/* move the changes after these down */
+	evlkq->evlkq_nchanges -= nevents;
+
+	nkev = kev + nevents;
+	while (idx < evlkq->evlkq_nchanges) {
+		nevlio = nkev->udata;
+		if (nevlio == NULL) {
+			/* a delete left behind by a destroyed io */
+			n = 1;
+		} else {
+			nevlio->evl_io_idx = idx;
+			n = evl_kq_nevents(nevlio);
+		}
+		idx += n;
+
+		while (n--)
+			*kev++ = *nkev++;
+	}
+
+	evlio->evl_io_idx = ~0;
+
+	return (added);
+}
+
+/* the kernel has to be told about these filters */
 static void
-evl_kq_io_add(struct evl_io *evlio)
+evl_kq_io_register(struct evl_kq *evlkq, struct evl_io *evlio, int events)
+{
+	struct kevent *kev;
+	unsigned int n, nevents;
+
+	kev = evlkq->evlkq_kevents + evlio->evl_io_idx;
+	nevents = evl_kq_nevents(evlio);
+
+	for (n = 0; n < nevents; n++) {
+		if (ISSET(events, kev[n].filter == EVFILT_READ ?
+		    EVL_READ : EVL_WRITE))
+			SET(kev[n].flags, EV_ADD);
+	}
+}
+
+static int
+evl_kq_io_create(struct evl_io *evlio)
 {
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_kq *evlkq = evl_backend(evlb);
 	struct evl_work *evl = &evlio->evl_io_work;
-	int flags = EV_ENABLE | EV_RECEIPT;
 
-	if (ISSET(evl->evl_event, EVL_RW) != EVL_RW &&
-	    !ISSET(evl->evl_event, EVL_PERSIST))
-		SET(flags, EV_DISPATCH);
+	if (evl_kq_next_change(evlkq, EVL_KQ_IO_NEVENTS - 1) == NULL)
+		return (-1);
+
+	/* commit */
+	evlio->evl_io_reg = ISSET(evl->evl_event, EVL_RW);
+	evlio->evl_io_idx = ~0;
+	evl_kq_io(evlio, 0, 0);
+	evl_kq_io_register(evlkq, evlio, evlio->evl_io_reg);
+	evlkq->evlkq_nevents += EVL_KQ_IO_NEVENTS;
 
-	evl_kq_io(evlio, flags);
+	return (0);
 }
 
 static void
-evl_kq_io_del(struct evl_io *evlio)
+evl_kq_io_add(struct evl_io *evlio)
 {
-	int flags = EV_DISABLE | EV_RECEIPT;
+	struct evl_work *evl = &evlio->evl_io_work;
 
-	evl_kq_io(evlio, flags);
+	evl_kq_io(evlio, evl->evl_event, evl_kq_io_flags(evl->evl_event));
 }
 
-static inline unsigned int
-evl_kq_nevents(const struct evl_io *evlio)
+static void
+evl_kq_io_del(struct evl_io *evlio)
+{
+	evl_kq_io(evlio, 0, 0);
+}
+
+static void
+evl_kq_io_modify(struct evl_io *evlio, int events)
 {
-	return (ISSET(evlio->evl_io_work.evl_event, EVL_RW) == EVL_RW ? 2 : 1);
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	struct evl_work *evl = &evlio->evl_io_work;
+	int reg, added;
+
+	reg = evlio->evl_io_reg | ISSET(events, EVL_RW);
+	if (reg != evlio->evl_io_reg) {
+		/* filters stay registered, so this only happens once */
+		added = evl_kq_io_unqueue(evlkq, evlio);
+		SET(added, reg & ~evlio->evl_io_reg);
+
+		evlio->evl_io_reg = reg;
+		evl_kq_io(evlio, ISSET(evl->evl_event, EVL_PENDING) ?
+		    events : 0, evl_kq_io_flags(events));
+		evl_kq_io_register(evlkq, evlio, added);
+	} else if (ISSET(evl->evl_event, EVL_PENDING))
+		evl_kq_io(evlio, events, evl_kq_io_flags(events));
+
+	/* deleted ios have all their filters disabled already */
 }
 
 static void
@@ -292,56 +550,178 @@ evl_kq_io_destroy(struct evl_io *evlio)
 	struct evl_base *evlb = evl_io_base(evlio);
 	struct evl_kq *evlkq = evl_backend(evlb);
 	struct evl_work *evl = &evlio->evl_io_work;
-	struct kevent *kev, *nkev;
-	unsigned int nevents, n, idx;
-	int fd;
+	struct kevent *kev;
+	unsigned int n;
+	int reg;
 
-	idx = evlio->evl_io_idx;
-	if (idx == ~0U) { /* new changes */
-		idx = evlkq->evlkq_nchanges;
-		fd = evl->evl_ident;
-		nevents = 0;
+	/* filters the kernel hasn't seen don't need to be deleted */
+	reg = evlio->evl_io_reg & ~evl_kq_io_unqueue(evlkq, evlio);
 
-		if (ISSET(evl->evl_event, EVL_READ)) {
-			kev = evlkq->evlkq_kevents + idx++;
-			EV_SET(kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-			nevents++;
-		}
+	n = 0;
+	if (ISSET(reg, EVL_READ)) {
+		kev = evlkq->evlkq_kevents + evlkq->evlkq_nchanges + n++;
+		EV_SET(kev, evl->evl_ident, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	}
+	if (ISSET(reg, EVL_WRITE)) {
+		kev = evlkq->evlkq_kevents + evlkq->evlkq_nchanges + n++;
+		EV_SET(kev, evl->evl_ident, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	}
+	evlkq->evlkq_nchanges += n;
 
-		if (ISSET(evl->evl_event, EVL_WRITE)) {
-			kev = evlkq->evlkq_kevents + idx++;
-			EV_SET(kev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-			nevents++;
-		}
+	/* the deletes keep their space until they've been applied */
+	evlkq->evlkq_ndeletes += n;
+	evlkq->evlkq_nevents -= EVL_KQ_IO_NEVENTS - n;
+}
 
-		evlkq->evlkq_nchanges = idx;
-	} else {
-		/* event is already queued for a change */
-		kev = evlkq->evlkq_kevents + idx;
-		nevents = evl_kq_nevents(evlio);
+static void
+evl_kq_sig_handler(int signo)
+{
+	/* kqueue counts the signal, this just stops the default action */
+}
 
-		if (ISSET(kev->flags, EV_ADD)) {
-			/* event was just added, so remove it from changes */
-			evlkq->evlkq_nchanges -= nevents;
+static int
+evl_kq_sig_create(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	struct evl_kq_sig *evlkqs;
+	struct kevent kev;
+	int signo = evls->evl_sig_work.evl_ident;
+	int reserve;
+
+	if (signo <= 0 || signo >= NSIG) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	evlkqs = &evlkq->evlkq_sigs[signo];
+	if (evlkqs->evlkqs_sig != NULL) {
+		errno = EBUSY;
+		return (-1);
+	}
 
-			nkev = kev + nevents;
-			while (idx < evlkq->evlkq_nchanges) {
-				evlio = nkev->udata;
-				evlio->evl_io_idx = idx;
+	/*
+	 * reserve space for the enable/disable/delete changes, unless
+	 * a previous evl_sig for this signal is still waiting for its
+	 * delete to be applied, in which case its space is reused.
+	 */
+	reserve = !ISSET(evlkqs->evlkqs_flags, EV_DELETE);
+	if (reserve && evl_kq_next_change(evlkq, 0) == NULL)
+		return (-1);
 
-				n = evl_kq_nevents(evlio);
-				idx += n;
+	/*
+	 * register the filter now so the kernel starts counting signals
+	 * straight away, and so errors are reported here rather than
+	 * when the event is added.
+	 */
+	EV_SET(&kev, signo, EVFILT_SIGNAL, EV_ADD | EV_DISABLE, 0, 0, NULL);
+	if (kevent(evlkq->evlkq_fd, &kev, 1, NULL, 0, NULL) == -1)
+		return (-1);
+	evl_base_stats(evlb)->evlst_updates++;
 
-				while (n--)
-					*kev++ = *nkev++;
-			}
+	/* commit */
+	evlkqs->evlkqs_sig = evls;
+	evlkqs->evlkqs_flags = 0;
+	if (reserve)
+		evlkq->evlkq_nevents++;
 
-		} else {
-			/* update in place */
-			for (n = 0; n < nevents; n++)
-				kev[n].flags = EV_DELETE;
-		}
+	return (0);
+}
+
+static void
+evl_kq_sig_change(struct evl_kq *evlkq, struct evl_kq_sig *evlkqs, int flags)
+{
+	evlkqs->evlkqs_flags = flags;
+	evlkq->evlkq_sigchanges = 1;
+}
+
+static void
+evl_kq_sig_add(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+	struct evl_kq_sig *evlkqs = &evlkq->evlkq_sigs[signo];
+	struct sigaction sa;
+
+	/*
+	 * SIGCHLD cannot be ignored without the children being reaped
+	 * by the kernel, so catch everything with a handler that does
+	 * nothing instead.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = evl_kq_sig_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signo, &sa, &evlkqs->evlkqs_oact);
+
+	evl_kq_sig_change(evlkq, evlkqs, EV_ADD | EV_ENABLE);
+}
+
+static void
+evl_kq_sig_del(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+	struct evl_kq_sig *evlkqs = &evlkq->evlkq_sigs[signo];
+
+	sigaction(signo, &evlkqs->evlkqs_oact, NULL);
+
+	evl_kq_sig_change(evlkq, evlkqs, EV_ADD | EV_DISABLE);
+}
+
+static void
+evl_kq_sig_destroy(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+	struct evl_kq_sig *evlkqs = &evlkq->evlkq_sigs[signo];
+
+	evlkqs->evlkqs_sig = NULL;
+
+	/* the reserved change space is released when this is applied */
+	evl_kq_sig_change(evlkq, evlkqs, EV_DELETE);
+}
+
+static int
+evl_kq_wait_create(struct evl_wait *evlw)
+{
+	struct evl_base *evlb = evl_wait_base(evlw);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	struct kevent kev;
+	pid_t pid = evlw->evl_wait_work.evl_ident;
+
+	/* make room for the exit in the event list */
+	if (evl_kq_next_change(evlkq, 0) == NULL)
+		return (-1);
+
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD | EV_ENABLE, NOTE_EXIT, 0, evlw);
+	if (kevent(evlkq->evlkq_fd, &kev, 1, NULL, 0, NULL) == -1)
+		return (-1);
+	evl_base_stats(evlb)->evlst_updates++;
+
+	/* commit */
+	evlkq->evlkq_nevents++;
+
+	return (0);
+}
+
+static void
+evl_kq_wait_destroy(struct evl_wait *evlw)
+{
+	struct evl_base *evlb = evl_wait_base(evlw);
+	struct evl_kq *evlkq = evl_backend(evlb);
+	struct kevent kev;
+	pid_t pid = evlw->evl_wait_work.evl_ident;
+
+	if (!evlw->evl_wait_exited) {
+		/* the knote goes away by itself when the process exits */
+		EV_SET(&kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+		kevent(evlkq->evlkq_fd, &kev, 1, NULL, 0, NULL);
+		evl_base_stats(evlb)->evlst_updates++;
 	}
 
-	evlkq->evlkq_nevents -= nevents;
+	evlkq->evlkq_nevents--;
 }
@@ -0,0 +1,269 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* accept4 */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+#define EVL_LISTENER_BUDGET	64	/* accepts per read event */
+#define EVL_LISTENER_BACKOFF	10	/* ms */
+#define EVL_LISTENER_BACKOFF_MAX	1000	/* ms */
+
+#ifdef EVL_HAS_REUSEPORT_LB
+#ifdef SO_REUSEPORT_LB
+#define EVL_SO_REUSEPORT	SO_REUSEPORT_LB
+#else
+#define EVL_SO_REUSEPORT	SO_REUSEPORT
+#endif
+#endif
+
+struct evl_listener {
+	struct evl_io		 evll_io;
+	struct evl_tmo		 evll_tmo;	/* backoff when out of fds */
+	void			(*evll_fn)(int, const struct sockaddr *,
+				     socklen_t, void *);
+	void			*evll_arg;
+	unsigned int		 evll_budget;
+	unsigned int		 evll_backoff;	/* ms */
+	int			 evll_flags;
+#define EVL_LISTENER_ADDED	(1 << 0)
+#define EVL_LISTENER_RUNNING	(1 << 1)	/* in the read handler */
+#define EVL_LISTENER_DYING	(1 << 2)	/* destroyed in the handler */
+#define EVL_LISTENER_OWNFD	(1 << 3)	/* from evl_listener_bind */
+};
+
+static void	evl_listener_accept(int, int, void *);
+static void	evl_listener_resume(int, int, void *);
+
+struct evl_listener *
+evl_listener_create(struct evl_base *evlb, int fd, unsigned int budget,
+    void (*fn)(int, const struct sockaddr *, socklen_t, void *), void *arg)
+{
+	struct evl_listener *evll;
+
+	evll = evl_malloc(sizeof(*evll));
+	if (evll == NULL)
+		return (NULL);
+
+	if (evl_io_init(&evll->evll_io, evlb, fd, EVL_READ | EVL_PERSIST,
+	    evl_listener_accept, evll) == -1) {
+		evl_free(evll);
+		return (NULL);
+	}
+
+	evl_tmo_init(&evll->evll_tmo, evlb, evl_listener_resume, evll);
+
+	evll->evll_fn = fn;
+	evll->evll_arg = arg;
+	evll->evll_budget = budget > 0 ? budget : EVL_LISTENER_BUDGET;
+	evll->evll_backoff = 0;
+	evll->evll_flags = 0;
+
+	return (evll);
+}
+
+/*
+ * every base listening on a shared socket is woken for every
+ * connection. instead each base gets its own socket bound to the
+ * address, and the kernel hands each connection to one of them.
+ */
+struct evl_listener *
+evl_listener_bind(struct evl_base *evlb, const struct sockaddr *sa,
+    socklen_t salen, unsigned int budget,
+    void (*fn)(int, const struct sockaddr *, socklen_t, void *), void *arg)
+{
+#ifdef EVL_SO_REUSEPORT
+	struct evl_listener *evll;
+	int on = 1;
+	int fd, serrno;
+
+	fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (fd == -1)
+		return (NULL);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, EVL_SO_REUSEPORT, &on,
+	    sizeof(on)) == -1)
+		goto close;
+	if (bind(fd, sa, salen) == -1 || listen(fd, SOMAXCONN) == -1)
+		goto close;
+
+	evll = evl_listener_create(evlb, fd, budget, fn, arg);
+	if (evll == NULL)
+		goto close;
+
+	SET(evll->evll_flags, EVL_LISTENER_OWNFD);
+
+	return (evll);
+
+close:
+	serrno = errno;
+	close(fd);
+	errno = serrno;
+	return (NULL);
+#else
+	/* the sockets would not share the connections out */
+	errno = EOPNOTSUPP;
+	return (NULL);
+#endif
+}
+
+int
+evl_listener_fd(const struct evl_listener *evll)
+{
+	return (evl_io_fd(&evll->evll_io));
+}
+
+int
+evl_listener_add(struct evl_listener *evll)
+{
+	if (ISSET(evll->evll_flags, EVL_LISTENER_ADDED))
+		return (0);
+
+	SET(evll->evll_flags, EVL_LISTENER_ADDED);
+	evl_io_add(&evll->evll_io);
+
+	return (1);
+}
+
+int
+evl_listener_del(struct evl_listener *evll)
+{
+	if (!ISSET(evll->evll_flags, EVL_LISTENER_ADDED))
+		return (0);
+
+	CLR(evll->evll_flags, EVL_LISTENER_ADDED);
+	evl_io_del(&evll->evll_io);
+	evl_tmo_del(&evll->evll_tmo);
+	evll->evll_backoff = 0;
+
+	return (1);
+}
+
+static void
+evl_listener_free(struct evl_listener *evll)
+{
+	int fd = evl_io_fd(&evll->evll_io);
+
+	evl_tmo_fini(&evll->evll_tmo);
+	evl_io_fini(&evll->evll_io);
+	if (ISSET(evll->evll_flags, EVL_LISTENER_OWNFD))
+		close(fd);
+	evl_free(evll);
+}
+
+void
+evl_listener_destroy(struct evl_listener *evll)
+{
+	if (evll == NULL)
+		return;
+
+	evl_listener_del(evll);
+
+	if (ISSET(evll->evll_flags, EVL_LISTENER_RUNNING)) {
+		SET(evll->evll_flags, EVL_LISTENER_DYING);
+		return;
+	}
+
+	evl_listener_free(evll);
+}
+
+static void
+evl_listener_backoff(struct evl_listener *evll)
+{
+	struct timespec ts;
+
+	/* stop listening until some descriptors have been closed */
+	evl_io_del(&evll->evll_io);
+
+	if (evll->evll_backoff == 0)
+		evll->evll_backoff = EVL_LISTENER_BACKOFF;
+	else if (evll->evll_backoff < EVL_LISTENER_BACKOFF_MAX) {
+		evll->evll_backoff *= 2;
+		if (evll->evll_backoff > EVL_LISTENER_BACKOFF_MAX)
+			evll->evll_backoff = EVL_LISTENER_BACKOFF_MAX;
+	}
+
+	ts.tv_sec = evll->evll_backoff / 1000;
+	ts.tv_nsec = (evll->evll_backoff % 1000) * 1000000;
+	evl_tmo_add(&evll->evll_tmo, &ts);
+}
+
+static void
+evl_listener_resume(int nil, int events, void *arg)
+{
+	struct evl_listener *evll = arg;
+
+	evl_io_add(&evll->evll_io);
+}
+
+static void
+evl_listener_accept(int fd, int events, void *arg)
+{
+	struct evl_listener *evll = arg;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	unsigned int budget;
+	int s;
+
+	SET(evll->evll_flags, EVL_LISTENER_RUNNING);
+	for (budget = evll->evll_budget; budget > 0; budget--) {
+		sslen = sizeof(ss);
+		s = accept4(fd, (struct sockaddr *)&ss, &sslen,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (s == -1) {
+			switch (errno) {
+			case EINTR:
+			case ECONNABORTED:
+				continue;
+			case EMFILE:
+			case ENFILE:
+			case ENOBUFS:
+			case ENOMEM:
+				evl_listener_backoff(evll);
+				break;
+			}
+			/* EAGAIN or an error to retry on the next event */
+			break;
+		}
+
+		evll->evll_backoff = 0;
+		(*evll->evll_fn)(s, (struct sockaddr *)&ss, sslen,
+		    evll->evll_arg);
+
+		if (!ISSET(evll->evll_flags, EVL_LISTENER_ADDED))
+			break;
+	}
+	CLR(evll->evll_flags, EVL_LISTENER_RUNNING);
+
+	if (ISSET(evll->evll_flags, EVL_LISTENER_DYING))
+		evl_listener_free(evll);
+}
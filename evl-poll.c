@@ -21,30 +21,68 @@
 #include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <assert.h>
 #include <errno.h>
 
 #include "evl-internal.h"
+#include "evl-config.h"
 
-static void	*evl_poll_init(void);
+#ifdef EVL_HAS_SIGNALFD
+#include <sys/signalfd.h>
+#include <pthread.h>
+#endif
+
+#ifdef EVL_HAS_PIDFD
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <string.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD		3
+#endif
+#endif
+
+static void	*evl_poll_init(struct evl_base *);
 static void	 evl_poll_destroy(void *);
 static int	 evl_poll_dispatch(struct evl_base *,
 		     const struct timespec *);
+static int	 evl_poll_fd(struct evl_base *);
+static int	 evl_poll_pending(struct evl_base *);
 static int	 evl_poll_io_create(struct evl_io *);
 static void	 evl_poll_io_add(struct evl_io *);
 static void	 evl_poll_io_del(struct evl_io *);
+static void	 evl_poll_io_modify(struct evl_io *, int);
 static void	 evl_poll_io_destroy(struct evl_io *);
+static int	 evl_poll_sig_create(struct evl_sig *);
+static void	 evl_poll_sig_add(struct evl_sig *);
+static void	 evl_poll_sig_del(struct evl_sig *);
+static void	 evl_poll_sig_destroy(struct evl_sig *);
+static int	 evl_poll_wait_create(struct evl_wait *);
+static void	 evl_poll_wait_destroy(struct evl_wait *);
 
 const struct evl_ops evl_ops_poll = {
+	"poll",
 	evl_poll_init,
 	evl_poll_destroy,
 	evl_poll_dispatch,
+	evl_poll_fd,
+	evl_poll_pending,
 	evl_poll_io_create,
 	evl_poll_io_add,
 	evl_poll_io_del,
+	evl_poll_io_modify,
 	evl_poll_io_destroy,
+	evl_poll_sig_create,
+	evl_poll_sig_add,
+	evl_poll_sig_del,
+	evl_poll_sig_destroy,
+	evl_poll_wait_create,
+	evl_poll_wait_destroy,
 };
 
+#define EVL_POLL_MINLEN	16
+
 struct evl_pollfd {
 	HEAP_ENTRY()	 evlpfd_entry;
 	struct evl_io	*evlpfd_io;
@@ -58,6 +96,7 @@ struct evl_poll {
 	struct evl_pollfd **
 			  evlp_evlpfds;
 	unsigned int	  evlp_len;	/* length of the arrays */
+	unsigned int	  evlp_nslots;	/* evl_pollfds in the arrays */
 	unsigned int	  evlp_npfds;	/* creates - destroys */
 	unsigned int	  evlp_nfds;	/* adds - dels */
 
@@ -65,6 +104,16 @@ struct evl_poll {
 			  evlp_live;
 	struct evl_pollfd_free
 			  evlp_free;
+
+	struct evl_pool	  evlp_pool;
+
+#ifdef EVL_HAS_SIGNALFD
+	int		  evlp_sigfd;
+	struct evl_io	 *evlp_sigio;
+	sigset_t	  evlp_sigmask;
+	sigset_t	  evlp_sigblocked;	/* by evl_sig_add */
+	struct evl_sig	 *evlp_sigs[NSIG];
+#endif
 };
 
 HEAP_PROTOTYPE(evl_pollfd_live, evl_pollfd);
@@ -116,23 +165,39 @@ HEAP_GENERATE(evl_pollfd_free, evl_pollfd, evlpfd_entry, evl_pollfd_min_cmp);
 	HEAP_INSERT(evl_pollfd_free, &(_evlp)->evlp_free, (_e))
 
 static void *
-evl_poll_init(void)
+evl_poll_init(struct evl_base *evlb)
 {
 	struct evl_poll *evlp;
+#ifdef EVL_HAS_SIGNALFD
+	unsigned int i;
+#endif
 
-	evlp = malloc(sizeof(*evlp));
+	evlp = evl_malloc(sizeof(*evlp));
 	if (evlp == NULL)
 		return (NULL);
 
 	evlp->evlp_pfds = NULL;
 	evlp->evlp_evlpfds = NULL;
 	evlp->evlp_len = 0;
+	evlp->evlp_nslots = 0;
 	evlp->evlp_npfds = 0;
 	evlp->evlp_nfds = 0;
 
 	evlp_live_init(evlp);
 	evlp_free_init(evlp);
 
+	evl_pool_init(&evlp->evlp_pool, evl_base_pools(evlb),
+	    "evl_pollfd", sizeof(struct evl_pollfd));
+
+#ifdef EVL_HAS_SIGNALFD
+	evlp->evlp_sigfd = -1;
+	evlp->evlp_sigio = NULL;
+	sigemptyset(&evlp->evlp_sigmask);
+	sigemptyset(&evlp->evlp_sigblocked);
+	for (i = 0; i < NSIG; i++)
+		evlp->evlp_sigs[i] = NULL;
+#endif
+
 	return (evlp);
 }
 
@@ -143,14 +208,23 @@ evl_poll_destroy(void *backend)
 	struct evl_pollfd *evlpfd;
 	unsigned int i;
 
-	for (i = 0; i < evlp->evlp_len; i++) {
+#ifdef EVL_HAS_SIGNALFD
+	if (evlp->evlp_sigio != NULL) {
+		evl_io_del(evlp->evlp_sigio);
+		evl_io_destroy(evlp->evlp_sigio);
+		close(evlp->evlp_sigfd);
+	}
+#endif
+
+	for (i = 0; i < evlp->evlp_nslots; i++) {
 		evlpfd = evlp->evlp_evlpfds[i];
-		free(evlpfd);
+		evl_pool_put(&evlp->evlp_pool, evlpfd);
 	}
+	evl_pool_fini(&evlp->evlp_pool);
 
-	free(evlp->evlp_evlpfds);
-	free(evlp->evlp_pfds);
-	free(evlp);
+	evl_free(evlp->evlp_evlpfds);
+	evl_free(evlp->evlp_pfds);
+	evl_free(evlp);
 }
 
 static void
@@ -197,6 +271,8 @@ evl_poll_dispatch(struct evl_base *evlb, const struct timespec *ts)
 		return (-1);
 	}
 
+	evl_base_stats(evlb)->evlst_events += n;
+
 	for (i = 0; i < nfds; i++) {
 		struct evl_pollfd *evlpfd;
 		struct pollfd *pfd;
@@ -226,6 +302,20 @@ evl_poll_dispatch(struct evl_base *evlb, const struct timespec *ts)
 	return (0);
 }
 
+static int
+evl_poll_fd(struct evl_base *evlb)
+{
+	/* the set of fds only exists in the arguments to ppoll */
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static int
+evl_poll_pending(struct evl_base *evlb)
+{
+	return (0);
+}
+
 static int
 evl_poll_io_create(struct evl_io *evlio)
 {
@@ -236,34 +326,40 @@ evl_poll_io_create(struct evl_io *evlio)
 	unsigned int idx;
 
 	idx = npfds++;
-	if (npfds > evlp->evlp_len) {
-		struct evl_pollfd **evlpfds;
-		struct pollfd *pfds;
-
-		evlpfd = malloc(sizeof(*evlpfd));
-		if (evlpfd == NULL)
-			return (-1);
-
-		evlpfds = reallocarray(evlp->evlp_evlpfds, npfds,
-		    sizeof(*evlpfds));
-		if (evlpfds == NULL) {
-			free(evlpfd);
-			return (-1);
+	if (npfds > evlp->evlp_nslots) {
+		if (npfds > evlp->evlp_len) {
+			struct evl_pollfd **evlpfds;
+			struct pollfd *pfds;
+			unsigned int len;
+
+			/* grow the arrays geometrically to avoid churn */
+			len = evlp->evlp_len * 2;
+			if (len < EVL_POLL_MINLEN)
+				len = EVL_POLL_MINLEN;
+
+			evlpfds = evl_reallocarray(evlp->evlp_evlpfds, len,
+			    sizeof(*evlpfds));
+			if (evlpfds == NULL)
+				return (-1);
+
+			evlp->evlp_evlpfds = evlpfds;
+
+			pfds = evl_reallocarray(evlp->evlp_pfds, len,
+			    sizeof(*pfds));
+			if (pfds == NULL)
+				return (-1);
+
+			evlp->evlp_pfds = pfds;
+			evlp->evlp_len = len;
 		}
 
-		evlp->evlp_evlpfds = evlpfds;
-
-		pfds = reallocarray(evlp->evlp_pfds, npfds, sizeof(*pfds));
-		if (pfds == NULL) {
-			free(evlpfd);
+		evlpfd = evl_pool_get(&evlp->evlp_pool);
+		if (evlpfd == NULL)
 			return (-1);
-		}
 
 		/* commit */
-		evlp->evlp_pfds = pfds;
-		evlp->evlp_len = npfds;
-
-		evlpfds[idx] = evlpfd;
+		evlp->evlp_evlpfds[idx] = evlpfd;
+		evlp->evlp_nslots = npfds;
 		evlpfd->evlpfd_idx = idx;
 
 		evlp_free_insert(evlp, evlpfd);
@@ -297,6 +393,8 @@ evl_poll_io_add(struct evl_io *evlio)
 
 	evlp_live_insert(evlp, evlpfd);
 	evlp->evlp_nfds++;
+
+	evl_base_stats(evlb)->evlst_updates++;
 }
 
 static void
@@ -310,6 +408,26 @@ evl_poll_io_del(struct evl_io *evlio)
 	evlpfd = evlp->evlp_evlpfds[evlio->evl_io_idx];
 	evlp_live_remove(evlp, evlpfd);
 	evlp_free_insert(evlp, evlpfd);
+
+	evl_base_stats(evlb)->evlst_updates++;
+}
+
+static void
+evl_poll_io_modify(struct evl_io *evlio, int events)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_poll *evlp = evl_backend(evlb);
+	struct pollfd *pfd;
+
+	if (!ISSET(evlio->evl_io_work.evl_event, EVL_PENDING))
+		return;
+
+	/* pack keeps the index up to date */
+	pfd = &evlp->evlp_pfds[evlio->evl_io_idx];
+	pfd->events = (ISSET(events, EVL_READ) ? POLLIN : 0) |
+	    (ISSET(events, EVL_WRITE) ? POLLOUT : 0);
+
+	evl_base_stats(evlb)->evlst_updates++;
 }
 
 static void
@@ -320,3 +438,250 @@ evl_poll_io_destroy(struct evl_io *evlio)
 
 	evlp->evlp_npfds--;
 }
+
+#ifdef EVL_HAS_SIGNALFD
+#define EVL_POLL_NSSI	32
+
+static void
+evl_poll_sig_read(int fd, int events, void *arg)
+{
+	struct evl_poll *evlp = arg;
+	struct signalfd_siginfo ssi[EVL_POLL_NSSI];
+	struct evl_sig *evls;
+	ssize_t rv;
+	size_t i, n;
+	unsigned int signo;
+
+	do {
+		rv = read(fd, ssi, sizeof(ssi));
+		if (rv == -1) {
+			/* EAGAIN means it's drained, nothing to do otherwise */
+			return;
+		}
+
+		n = rv / sizeof(ssi[0]);
+		for (i = 0; i < n; i++) {
+			signo = ssi[i].ssi_signo;
+			if (signo >= NSIG)
+				continue;
+
+			evls = evlp->evlp_sigs[signo];
+			if (evls != NULL && evl_sig_pending(evls))
+				evl_sig_fire(evls, 1);
+		}
+	} while (n == EVL_POLL_NSSI);
+}
+
+static int
+evl_poll_sig_create(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_poll *evlp = evl_backend(evlb);
+	struct evl_io *evlio;
+	sigset_t mask;
+	int signo = evls->evl_sig_work.evl_ident;
+	int fd;
+
+	if (signo <= 0 || signo >= NSIG) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (evlp->evlp_sigs[signo] != NULL) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (evlp->evlp_sigio == NULL) {
+		/* one signalfd serves every evl_sig on this base */
+		sigemptyset(&mask);
+		fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (fd == -1)
+			return (-1);
+
+		evlio = evl_io_create(evlb, fd, EVL_READ | EVL_PERSIST,
+		    evl_poll_sig_read, evlp);
+		if (evlio == NULL) {
+			close(fd);
+			return (-1);
+		}
+
+		evl_io_add(evlio);
+
+		evlp->evlp_sigfd = fd;
+		evlp->evlp_sigio = evlio;
+	}
+
+	evlp->evlp_sigs[signo] = evls;
+
+	return (0);
+}
+
+static void
+evl_poll_sig_mask(struct evl_poll *evlp)
+{
+	/*
+	 * the signalfd was made by evl_poll_sig_create, and changing
+	 * the mask on it doesn't allocate anything, so this can only
+	 * fail if the fd or mask are broken.
+	 */
+	if (signalfd(evlp->evlp_sigfd, &evlp->evlp_sigmask, 0) == -1)
+		abort();
+}
+
+static void
+evl_poll_sig_add(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_poll *evlp = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+	sigset_t mask, omask;
+
+	sigaddset(&evlp->evlp_sigmask, signo);
+	evl_poll_sig_mask(evlp);
+
+	/*
+	 * signalfd only sees signals that are blocked. remember if
+	 * this did the blocking so del doesn't undo the caller's mask.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, signo);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	if (!sigismember(&omask, signo))
+		sigaddset(&evlp->evlp_sigblocked, signo);
+}
+
+static void
+evl_poll_sig_del(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_poll *evlp = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+	sigset_t mask;
+
+	sigdelset(&evlp->evlp_sigmask, signo);
+	evl_poll_sig_mask(evlp);
+
+	if (sigismember(&evlp->evlp_sigblocked, signo)) {
+		sigdelset(&evlp->evlp_sigblocked, signo);
+
+		sigemptyset(&mask);
+		sigaddset(&mask, signo);
+		pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+	}
+}
+
+static void
+evl_poll_sig_destroy(struct evl_sig *evls)
+{
+	struct evl_base *evlb = evl_sig_base(evls);
+	struct evl_poll *evlp = evl_backend(evlb);
+	int signo = evls->evl_sig_work.evl_ident;
+
+	evlp->evlp_sigs[signo] = NULL;
+}
+#else /* EVL_HAS_SIGNALFD */
+static int
+evl_poll_sig_create(struct evl_sig *evls)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static void
+evl_poll_sig_add(struct evl_sig *evls)
+{
+}
+
+static void
+evl_poll_sig_del(struct evl_sig *evls)
+{
+}
+
+static void
+evl_poll_sig_destroy(struct evl_sig *evls)
+{
+}
+#endif /* EVL_HAS_SIGNALFD */
+
+#ifdef EVL_HAS_PIDFD
+static void
+evl_poll_wait_read(int fd, int events, void *arg)
+{
+	struct evl_wait *evlw = arg;
+	siginfo_t si;
+	int status = 0;
+
+	memset(&si, 0, sizeof(si));
+	if (waitid(P_PIDFD, fd, &si, WEXITED | WNOHANG) == 0) {
+		if (si.si_pid == 0) {
+			/* not dead yet */
+			return;
+		}
+
+		switch (si.si_code) {
+		case CLD_EXITED:
+			status = (si.si_status & 0xff) << 8;
+			break;
+		case CLD_KILLED:
+			status = si.si_status & 0x7f;
+			break;
+		case CLD_DUMPED:
+			status = (si.si_status & 0x7f) | 0x80;
+			break;
+		}
+	}
+	/* else it's not our child, but it has still exited */
+
+	evl_io_del(evlw->evl_wait_backend);
+	evl_wait_fire(evlw, status);
+}
+
+static int
+evl_poll_wait_create(struct evl_wait *evlw)
+{
+	struct evl_base *evlb = evl_wait_base(evlw);
+	struct evl_io *evlio;
+	pid_t pid = evlw->evl_wait_work.evl_ident;
+	int fd;
+
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd == -1)
+		return (-1);
+
+	evlio = evl_io_create(evlb, fd, EVL_READ | EVL_PERSIST,
+	    evl_poll_wait_read, evlw);
+	if (evlio == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	evl_io_add(evlio);
+	evlw->evl_wait_backend = evlio;
+
+	return (0);
+}
+
+static void
+evl_poll_wait_destroy(struct evl_wait *evlw)
+{
+	struct evl_io *evlio = evlw->evl_wait_backend;
+	int fd = evl_io_fd(evlio);
+
+	evl_io_del(evlio);
+	evl_io_destroy(evlio);
+	close(fd);
+}
+#else /* EVL_HAS_PIDFD */
+static int
+evl_poll_wait_create(struct evl_wait *evlw)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static void
+evl_poll_wait_destroy(struct evl_wait *evlw)
+{
+}
+#endif /* EVL_HAS_PIDFD */
@@ -0,0 +1,326 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+
+/*
+ * allocator hooks
+ */
+
+static void	*(*evl_malloc_fn)(size_t) = malloc;
+static void	*(*evl_realloc_fn)(void *, size_t) = realloc;
+static void	 (*evl_free_fn)(void *) = free;
+static int	  evl_allocated;
+
+int
+evl_set_allocator(void *(*mallocfn)(size_t),
+    void *(*reallocfn)(void *, size_t), void (*freefn)(void *))
+{
+	if (evl_allocated) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	evl_malloc_fn = mallocfn != NULL ? mallocfn : malloc;
+	evl_realloc_fn = reallocfn != NULL ? reallocfn : realloc;
+	evl_free_fn = freefn != NULL ? freefn : free;
+
+	return (0);
+}
+
+void *
+evl_malloc(size_t size)
+{
+	evl_allocated = 1;
+	return ((*evl_malloc_fn)(size));
+}
+
+/*
+ * This is sqrt(SIZE_MAX+1), as s1*s2 <= SIZE_MAX
+ * if both s1 < MUL_NO_OVERFLOW and s2 < MUL_NO_OVERFLOW
+ */
+#define MUL_NO_OVERFLOW	((size_t)1 << (sizeof(size_t) * 4))
+
+void *
+evl_reallocarray(void *optr, size_t nmemb, size_t size)
+{
+	if ((nmemb >= MUL_NO_OVERFLOW || size >= MUL_NO_OVERFLOW) &&
+	    nmemb > 0 && SIZE_MAX / nmemb < size) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	evl_allocated = 1;
+	return ((*evl_realloc_fn)(optr, size * nmemb));
+}
+
+void
+evl_free(void *ptr)
+{
+	(*evl_free_fn)(ptr);
+}
+
+/*
+ * per base pools of fixed size items
+ */
+
+#define EVL_POOL_PGSIZE		4096
+#define EVL_POOL_HUGEPGSHIFT	21		/* 2MB */
+#define EVL_POOL_HUGEPGSIZE	((size_t)1 << EVL_POOL_HUGEPGSHIFT)
+#define EVL_POOL_ALIGN		EVL_ALIGN
+
+struct evl_pool_page {
+	struct evl_pool_page	*pp_next;
+	int			 pp_arena;
+};
+
+struct evl_pool_item {
+	struct evl_pool_item	*pi_next;
+};
+
+#define EVL_POOL_ROUNDUP(_s)						\
+	(((_s) + EVL_POOL_ALIGN - 1) & ~((size_t)EVL_POOL_ALIGN - 1))
+
+void
+evl_pools_init(struct evl_pools *evlpl)
+{
+	TAILQ_INIT(&evlpl->evlpl_list);
+	evlpl->evlpl_arena = NULL;
+	evlpl->evlpl_arenalen = 0;
+	evlpl->evlpl_arenaoff = 0;
+}
+
+void
+evl_pools_fini(struct evl_pools *evlpl)
+{
+	assert(TAILQ_EMPTY(&evlpl->evlpl_list));
+
+	if (evlpl->evlpl_arena != NULL)
+		munmap(evlpl->evlpl_arena, evlpl->evlpl_arenalen);
+}
+
+static void *
+evl_pools_hugetlb(size_t *lenp)
+{
+#ifdef MAP_HUGETLB
+	void *arena;
+	size_t len;
+	int flags = MAP_PRIVATE | MAP_ANON | MAP_HUGETLB;
+
+	/*
+	 * hugetlb mappings can only be unmapped in whole huge pages,
+	 * so ask for pages of a known size and round up to them.
+	 */
+#ifdef MAP_HUGE_SHIFT
+	flags |= EVL_POOL_HUGEPGSHIFT << MAP_HUGE_SHIFT;
+#endif
+	len = (*lenp + EVL_POOL_HUGEPGSIZE - 1) & ~(EVL_POOL_HUGEPGSIZE - 1);
+
+	arena = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (arena != MAP_FAILED)
+		*lenp = len;
+
+	return (arena);
+#else
+	return (MAP_FAILED);
+#endif
+}
+
+int
+evl_pools_arena(struct evl_pools *evlpl, size_t len)
+{
+	void *arena;
+
+	if (evlpl->evlpl_arena != NULL) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	len = (len + EVL_POOL_PGSIZE - 1) & ~((size_t)EVL_POOL_PGSIZE - 1);
+	if (len == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	arena = evl_pools_hugetlb(&len);
+	if (arena == MAP_FAILED) {
+		/* fall back to regular pages */
+		arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (arena == MAP_FAILED)
+			return (-1);
+#ifdef MADV_HUGEPAGE
+		(void)madvise(arena, len, MADV_HUGEPAGE);
+#endif
+	}
+
+	evlpl->evlpl_arena = arena;
+	evlpl->evlpl_arenalen = len;
+	evlpl->evlpl_arenaoff = 0;
+
+	return (0);
+}
+
+void
+evl_pool_init(struct evl_pool *evlpr, struct evl_pools *evlpl,
+    const char *name, size_t size)
+{
+	size_t hdr = EVL_POOL_ROUNDUP(sizeof(struct evl_pool_page));
+
+	if (size < sizeof(struct evl_pool_item))
+		size = sizeof(struct evl_pool_item);
+	size = EVL_POOL_ROUNDUP(size);
+
+	assert(size <= EVL_POOL_PGSIZE - hdr);
+
+	evlpr->evlpr_pools = evlpl;
+	evlpr->evlpr_name = name;
+	evlpr->evlpr_size = size;
+	evlpr->evlpr_pgitems = (EVL_POOL_PGSIZE - hdr) / size;
+	evlpr->evlpr_pages = NULL;
+	evlpr->evlpr_items = NULL;
+	evlpr->evlpr_npages = 0;
+	evlpr->evlpr_nitems = 0;
+	evlpr->evlpr_nout = 0;
+	evlpr->evlpr_hiwat = 0;
+
+	TAILQ_INSERT_TAIL(&evlpl->evlpl_list, evlpr, evlpr_entry);
+}
+
+void
+evl_pool_fini(struct evl_pool *evlpr)
+{
+	struct evl_pool_page *evlpp;
+
+	assert(evlpr->evlpr_nout == 0);
+
+	while ((evlpp = evlpr->evlpr_pages) != NULL) {
+		evlpr->evlpr_pages = evlpp->pp_next;
+		if (!evlpp->pp_arena)
+			evl_free(evlpp);
+	}
+
+	TAILQ_REMOVE(&evlpr->evlpr_pools->evlpl_list, evlpr, evlpr_entry);
+}
+
+static struct evl_pool_page *
+evl_pool_page_alloc(struct evl_pools *evlpl)
+{
+	struct evl_pool_page *evlpp;
+
+	if (evlpl->evlpl_arenalen - evlpl->evlpl_arenaoff >= EVL_POOL_PGSIZE) {
+		evlpp = (struct evl_pool_page *)(void *)
+		    (evlpl->evlpl_arena + evlpl->evlpl_arenaoff);
+		evlpl->evlpl_arenaoff += EVL_POOL_PGSIZE;
+		evlpp->pp_arena = 1;
+
+		return (evlpp);
+	}
+
+	evlpp = evl_malloc(EVL_POOL_PGSIZE);
+	if (evlpp == NULL)
+		return (NULL);
+
+	evlpp->pp_arena = 0;
+
+	return (evlpp);
+}
+
+void *
+evl_pool_get(struct evl_pool *evlpr)
+{
+	struct evl_pool_page *evlpp;
+	struct evl_pool_item *evlpi;
+	char *addr;
+	unsigned int i;
+
+	evlpi = evlpr->evlpr_items;
+	if (evlpi == NULL) {
+		evlpp = evl_pool_page_alloc(evlpr->evlpr_pools);
+		if (evlpp == NULL)
+			return (NULL);
+
+		evlpp->pp_next = evlpr->evlpr_pages;
+		evlpr->evlpr_pages = evlpp;
+		evlpr->evlpr_npages++;
+
+		addr = (char *)evlpp + EVL_POOL_ROUNDUP(sizeof(*evlpp));
+		for (i = 0; i < evlpr->evlpr_pgitems; i++) {
+			evlpi = (struct evl_pool_item *)(void *)addr;
+			evlpi->pi_next = evlpr->evlpr_items;
+			evlpr->evlpr_items = evlpi;
+
+			addr += evlpr->evlpr_size;
+		}
+		evlpr->evlpr_nitems += evlpr->evlpr_pgitems;
+
+		evlpi = evlpr->evlpr_items;
+	}
+
+	evlpr->evlpr_items = evlpi->pi_next;
+	if (++evlpr->evlpr_nout > evlpr->evlpr_hiwat)
+		evlpr->evlpr_hiwat = evlpr->evlpr_nout;
+
+	return (evlpi);
+}
+
+void
+evl_pool_put(struct evl_pool *evlpr, void *v)
+{
+	struct evl_pool_item *evlpi = v;
+
+	assert(evlpr->evlpr_nout > 0);
+
+	evlpi->pi_next = evlpr->evlpr_items;
+	evlpr->evlpr_items = evlpi;
+	evlpr->evlpr_nout--;
+}
+
+int
+evl_pools_stats(struct evl_pools *evlpl, unsigned int idx,
+    struct evl_pool_stats *st)
+{
+	struct evl_pool *evlpr;
+
+	TAILQ_FOREACH(evlpr, &evlpl->evlpl_list, evlpr_entry) {
+		if (idx-- == 0)
+			break;
+	}
+
+	if (evlpr == NULL) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	st->evlps_name = evlpr->evlpr_name;
+	st->evlps_size = evlpr->evlpr_size;
+	st->evlps_pages = evlpr->evlpr_npages;
+	st->evlps_items = evlpr->evlpr_nitems;
+	st->evlps_inuse = evlpr->evlpr_nout;
+	st->evlps_hiwat = evlpr->evlpr_hiwat;
+
+	return (0);
+}
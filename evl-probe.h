@@ -0,0 +1,60 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVL_PROBE_H_
+#define _LIB_EVL_PROBE_H_
+
+/*
+ * static tracepoints for perf, bpftrace and systemtap, eg:
+ *
+ *	bpftrace -e 'usdt:./libevl.so:evl:callback__start { ... }'
+ *
+ * each probe is a nop in the code and a note in the binary until a
+ * tracer attaches to it. the probes in the "evl" provider are:
+ *
+ *	dispatch__enter(base, timeout)	backend is about to wait
+ *	dispatch__return(base, rv)	backend has returned
+ *	io__add(base, fd, event)
+ *	io__del(base, fd)
+ *	io__fire(base, fd, events)	backend reported an fd ready
+ *	tmo__fire(base, tmo)		timeout expired
+ *	callback__start(base, fn, ident, fires)
+ *	callback__done(base, fn, ident)
+ *
+ * build with EVL_NO_SDT defined to leave them out entirely.
+ */
+
+#if defined(EVL_HAS_SDT)
+#include <sys/sdt.h>
+
+#define EVL_PROBE1(_n, _a)						\
+	DTRACE_PROBE1(evl, _n, _a)
+#define EVL_PROBE2(_n, _a, _b)						\
+	DTRACE_PROBE2(evl, _n, _a, _b)
+#define EVL_PROBE3(_n, _a, _b, _c)					\
+	DTRACE_PROBE3(evl, _n, _a, _b, _c)
+#define EVL_PROBE4(_n, _a, _b, _c, _d)					\
+	DTRACE_PROBE4(evl, _n, _a, _b, _c, _d)
+#else
+#define EVL_PROBE1(_n, _a)		do { } while (0)
+#define EVL_PROBE2(_n, _a, _b)		do { } while (0)
+#define EVL_PROBE3(_n, _a, _b, _c)	do { } while (0)
+#define EVL_PROBE4(_n, _a, _b, _c, _d)	do { } while (0)
+#endif
+
+#endif /* _LIB_EVL_PROBE_H_ */
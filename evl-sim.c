@@ -0,0 +1,437 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * a simulated backend for testing code that uses the event loop.
+ *
+ * nothing here touches the kernel. readiness and signals are injected
+ * by the caller, and time only moves when the caller advances it or
+ * when the loop has nothing to do but wait for a timeout, in which
+ * case the clock jumps straight to the deadline. when there is nothing
+ * ready and no timeouts to wait for the loop stops.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+static void	*evl_sim_init(struct evl_base *);
+static void	 evl_sim_destroy(void *);
+static int	 evl_sim_dispatch(struct evl_base *,
+		     const struct timespec *);
+static int	 evl_sim_fd(struct evl_base *);
+static int	 evl_sim_pending(struct evl_base *);
+static int	 evl_sim_io_create(struct evl_io *);
+static void	 evl_sim_io_add(struct evl_io *);
+static void	 evl_sim_io_del(struct evl_io *);
+static void	 evl_sim_io_modify(struct evl_io *, int);
+static void	 evl_sim_io_destroy(struct evl_io *);
+static int	 evl_sim_sig_create(struct evl_sig *);
+static void	 evl_sim_sig_add(struct evl_sig *);
+static void	 evl_sim_sig_del(struct evl_sig *);
+static void	 evl_sim_sig_destroy(struct evl_sig *);
+static int	 evl_sim_wait_create(struct evl_wait *);
+static void	 evl_sim_wait_destroy(struct evl_wait *);
+
+const struct evl_ops evl_ops_sim = {
+	"sim",
+	evl_sim_init,
+	evl_sim_destroy,
+	evl_sim_dispatch,
+	evl_sim_fd,
+	evl_sim_pending,
+	evl_sim_io_create,
+	evl_sim_io_add,
+	evl_sim_io_del,
+	evl_sim_io_modify,
+	evl_sim_io_destroy,
+	evl_sim_sig_create,
+	evl_sim_sig_add,
+	evl_sim_sig_del,
+	evl_sim_sig_destroy,
+	evl_sim_wait_create,
+	evl_sim_wait_destroy,
+};
+
+#define EVL_SIM_MINLEN	16
+#define EVL_SIM_NOSLOT	UINT_MAX
+
+struct evl_sim_io {
+	struct evl_io	*evlsi_io;	/* NULL if the slot is free */
+	unsigned int	 evlsi_next;	/* next free slot */
+	int		 evlsi_ready;	/* injected, not yet delivered */
+	int		 evlsi_added;
+};
+
+struct evl_sim {
+	struct timespec	  evls_now;
+
+	struct evl_sim_io *evls_ios;
+	unsigned int	  evls_len;	/* length of the array */
+	unsigned int	  evls_nslots;	/* slots that have been used */
+	unsigned int	  evls_free;	/* first free slot */
+	unsigned int	  evls_nready;	/* slots with readiness */
+
+	struct evl_sig	 *evls_sigs[NSIG];
+	unsigned int	  evls_sigcount[NSIG];
+	unsigned int	  evls_nsigs;	/* signals with deliveries */
+};
+
+static int
+evl_sim_clock(void *arg, struct timespec *ts)
+{
+	struct evl_sim *evls = arg;
+
+	*ts = evls->evls_now;
+	return (0);
+}
+
+static void *
+evl_sim_init(struct evl_base *evlb)
+{
+	struct evl_sim *evls;
+	unsigned int i;
+
+	evls = evl_malloc(sizeof(*evls));
+	if (evls == NULL)
+		return (NULL);
+
+	evls->evls_now.tv_sec = 0;
+	evls->evls_now.tv_nsec = 0;
+
+	evls->evls_ios = NULL;
+	evls->evls_len = 0;
+	evls->evls_nslots = 0;
+	evls->evls_free = EVL_SIM_NOSLOT;
+	evls->evls_nready = 0;
+
+	for (i = 0; i < NSIG; i++) {
+		evls->evls_sigs[i] = NULL;
+		evls->evls_sigcount[i] = 0;
+	}
+	evls->evls_nsigs = 0;
+
+	evl_set_clock(evlb, evl_sim_clock, evls);
+
+	return (evls);
+}
+
+static void
+evl_sim_destroy(void *backend)
+{
+	struct evl_sim *evls = backend;
+
+	evl_free(evls->evls_ios);
+	evl_free(evls);
+}
+
+static struct evl_sim *
+evl_sim(struct evl_base *evlb)
+{
+	if (evl_base_ops(evlb) != &evl_ops_sim) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (evl_backend(evlb));
+}
+
+static int
+evl_sim_dispatch(struct evl_base *evlb, const struct timespec *ts)
+{
+	struct evl_sim *evls = evl_backend(evlb);
+	struct evl_sim_io *evlsi;
+	struct evl_io *evlio;
+	unsigned int i, n = 0;
+	int events;
+
+	for (i = 0; evls->evls_nready > 0 && i < evls->evls_nslots; i++) {
+		evlsi = &evls->evls_ios[i];
+		evlio = evlsi->evlsi_io;
+		if (evlio == NULL || !evlsi->evlsi_added)
+			continue;
+
+		events = evlsi->evlsi_ready & evlio->evl_io_work.evl_event;
+		if (events == 0)
+			continue;
+
+		CLR(evlsi->evlsi_ready, events);
+		if (evlsi->evlsi_ready == 0)
+			evls->evls_nready--;
+
+		evl_io_fire(evlio, events | EVL_PERSIST);
+		n++;
+	}
+
+	for (i = 1; evls->evls_nsigs > 0 && i < NSIG; i++) {
+		if (evls->evls_sigcount[i] == 0 || evls->evls_sigs[i] == NULL ||
+		    !ISSET(evls->evls_sigs[i]->evl_sig_work.evl_event,
+		    EVL_PENDING))
+			continue;
+
+		evl_sig_fire(evls->evls_sigs[i], evls->evls_sigcount[i]);
+		evls->evls_sigcount[i] = 0;
+		evls->evls_nsigs--;
+		n++;
+	}
+
+	evl_base_stats(evlb)->evlst_events += n;
+
+	if (n > 0)
+		return (0);
+
+	/* nothing will ever happen */
+	if (ts == NULL) {
+		evl_break(evlb);
+		return (0);
+	}
+
+	/* skip straight to the next timeout */
+	timespecadd(&evls->evls_now, ts, &evls->evls_now);
+
+	return (0);
+}
+
+static int
+evl_sim_fd(struct evl_base *evlb)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static int
+evl_sim_pending(struct evl_base *evlb)
+{
+	struct evl_sim *evls = evl_backend(evlb);
+
+	/* injected events are delivered by the next dispatch */
+	return (evls->evls_nready > 0 || evls->evls_nsigs > 0);
+}
+
+static int
+evl_sim_io_create(struct evl_io *evlio)
+{
+	struct evl_sim *evls = evl_backend(evl_io_base(evlio));
+	struct evl_sim_io *evlsi;
+	unsigned int idx, len;
+
+	idx = evls->evls_free;
+	if (idx != EVL_SIM_NOSLOT)
+		evls->evls_free = evls->evls_ios[idx].evlsi_next;
+	else {
+		if (evls->evls_nslots == evls->evls_len) {
+			len = evls->evls_len * 2;
+			if (len < EVL_SIM_MINLEN)
+				len = EVL_SIM_MINLEN;
+
+			evlsi = evl_reallocarray(evls->evls_ios, len,
+			    sizeof(*evlsi));
+			if (evlsi == NULL)
+				return (-1);
+
+			evls->evls_ios = evlsi;
+			evls->evls_len = len;
+		}
+
+		idx = evls->evls_nslots++;
+	}
+
+	evlsi = &evls->evls_ios[idx];
+	evlsi->evlsi_io = evlio;
+	evlsi->evlsi_ready = 0;
+	evlsi->evlsi_added = 0;
+	evlio->evl_io_idx = idx;
+
+	return (0);
+}
+
+static void
+evl_sim_io_add(struct evl_io *evlio)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_sim *evls = evl_backend(evlb);
+
+	evls->evls_ios[evlio->evl_io_idx].evlsi_added = 1;
+	evl_base_stats(evlb)->evlst_updates++;
+}
+
+static void
+evl_sim_io_del(struct evl_io *evlio)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_sim *evls = evl_backend(evlb);
+
+	evls->evls_ios[evlio->evl_io_idx].evlsi_added = 0;
+	evl_base_stats(evlb)->evlst_updates++;
+}
+
+static void
+evl_sim_io_modify(struct evl_io *evlio, int events)
+{
+	/* dispatch looks at the events when it fires the io */
+	evl_base_stats(evl_io_base(evlio))->evlst_updates++;
+}
+
+static void
+evl_sim_io_destroy(struct evl_io *evlio)
+{
+	struct evl_sim *evls = evl_backend(evl_io_base(evlio));
+	struct evl_sim_io *evlsi = &evls->evls_ios[evlio->evl_io_idx];
+
+	if (evlsi->evlsi_ready != 0)
+		evls->evls_nready--;
+
+	evlsi->evlsi_io = NULL;
+	evlsi->evlsi_next = evls->evls_free;
+	evls->evls_free = evlio->evl_io_idx;
+}
+
+static int
+evl_sim_sig_create(struct evl_sig *evlsig)
+{
+	struct evl_sim *evls = evl_backend(evl_sig_base(evlsig));
+	int signo = evlsig->evl_sig_work.evl_ident;
+
+	if (signo <= 0 || signo >= NSIG) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (evls->evls_sigs[signo] != NULL) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	evls->evls_sigs[signo] = evlsig;
+
+	return (0);
+}
+
+static void
+evl_sim_sig_add(struct evl_sig *evlsig)
+{
+	/* deliveries are only made to added signals */
+}
+
+static void
+evl_sim_sig_del(struct evl_sig *evlsig)
+{
+}
+
+static void
+evl_sim_sig_destroy(struct evl_sig *evlsig)
+{
+	struct evl_sim *evls = evl_backend(evl_sig_base(evlsig));
+	int signo = evlsig->evl_sig_work.evl_ident;
+
+	if (evls->evls_sigcount[signo] != 0) {
+		evls->evls_sigcount[signo] = 0;
+		evls->evls_nsigs--;
+	}
+
+	evls->evls_sigs[signo] = NULL;
+}
+
+static int
+evl_sim_wait_create(struct evl_wait *evlw)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static void
+evl_sim_wait_destroy(struct evl_wait *evlw)
+{
+}
+
+/*
+ * injection
+ */
+
+int
+evl_sim_ready(struct evl_base *evlb, int fd, int events)
+{
+	struct evl_sim *evls;
+	struct evl_sim_io *evlsi;
+	unsigned int i;
+	int n = 0;
+
+	evls = evl_sim(evlb);
+	if (evls == NULL)
+		return (-1);
+
+	events &= EVL_RW;
+
+	for (i = 0; i < evls->evls_nslots; i++) {
+		evlsi = &evls->evls_ios[i];
+		if (evlsi->evlsi_io == NULL ||
+		    evlsi->evlsi_io->evl_io_work.evl_ident != fd)
+			continue;
+
+		if (evlsi->evlsi_ready == 0 && events != 0)
+			evls->evls_nready++;
+		SET(evlsi->evlsi_ready, events);
+		n++;
+	}
+
+	return (n);
+}
+
+int
+evl_sim_signal(struct evl_base *evlb, int signo)
+{
+	struct evl_sim *evls;
+
+	evls = evl_sim(evlb);
+	if (evls == NULL)
+		return (-1);
+
+	if (signo <= 0 || signo >= NSIG) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (evls->evls_sigcount[signo]++ == 0)
+		evls->evls_nsigs++;
+
+	return (0);
+}
+
+int
+evl_sim_advance(struct evl_base *evlb, const struct timespec *ts)
+{
+	struct evl_sim *evls;
+
+	evls = evl_sim(evlb);
+	if (evls == NULL)
+		return (-1);
+
+	if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	timespecadd(&evls->evls_now, ts, &evls->evls_now);
+
+	return (0);
+}
@@ -0,0 +1,609 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* recvmmsg and sendmmsg */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+#define EVL_UDP_NMSGS		32
+#define EVL_UDP_MSGSIZE		2048
+#define EVL_UDP_ROUNDS		8	/* batches per read event */
+
+#ifdef UDP_GRO
+#define EVL_UDP_RCMSGLEN	CMSG_SPACE(sizeof(int))
+#else
+#define EVL_UDP_RCMSGLEN	0
+#endif
+
+#ifdef UDP_SEGMENT
+#define EVL_UDP_SCMSGLEN	CMSG_SPACE(sizeof(uint16_t))
+#else
+#define EVL_UDP_SCMSGLEN	0
+#endif
+
+#ifdef EVL_HAS_MMSG
+#define evl_mmsghdr		mmsghdr
+#define evl_recvmmsg(_s, _m, _n)					\
+	recvmmsg((_s), (_m), (_n), MSG_DONTWAIT, NULL)
+#define evl_sendmmsg(_s, _m, _n)					\
+	sendmmsg((_s), (_m), (_n), MSG_DONTWAIT)
+#else
+struct evl_mmsghdr {
+	struct msghdr		 msg_hdr;
+	unsigned int		 msg_len;
+};
+
+static int	evl_recvmmsg(int, struct evl_mmsghdr *, unsigned int);
+static int	evl_sendmmsg(int, struct evl_mmsghdr *, unsigned int);
+#endif
+
+struct evl_udp {
+	struct evl_io		 evlu_rio;	/* EVL_READ on the fd */
+	struct evl_io		 evlu_wio;	/* EVL_WRITE when blocked */
+	struct evl_flush	 evlu_flush;
+	void			(*evlu_fn)(int, int, void *);
+	void			*evlu_arg;
+	unsigned int		 evlu_nmsgs;
+	size_t			 evlu_msgsize;
+	int			 evlu_flags;
+#define EVL_UDP_RUNNING		(1 << 16)	/* in the read handler */
+#define EVL_UDP_DYING		(1 << 17)	/* destroyed in the handler */
+#define EVL_UDP_BLOCKED		(1 << 18)	/* waiting for EVL_WRITE */
+
+	/* receive batch */
+	struct evl_mmsghdr	*evlu_rmsgs;
+	struct iovec		*evlu_riov;
+	struct sockaddr_storage	*evlu_raddrs;
+	char			*evlu_rbufs;
+	char			*evlu_rcmsgs;
+	struct evl_dgram	*evlu_dgrams;
+
+	/* send batch */
+	struct evl_mmsghdr	*evlu_smsgs;
+	struct iovec		*evlu_siov;
+	struct sockaddr_storage	*evlu_saddrs;
+	char			*evlu_sbuf;
+	char			*evlu_scmsgs;
+	size_t			 evlu_soff;
+	unsigned int		 evlu_nsend;
+	unsigned int		 evlu_nsent;
+};
+
+static void	evl_udp_read(int, int, void *);
+static void	evl_udp_write(int, int, void *);
+static void	evl_udp_dirty(struct evl_flush *);
+static void	evl_udp_free(struct evl_udp *);
+
+static int
+evl_udp_offload(int fd, int flag)
+{
+	int opt = 1;
+	socklen_t optlen = sizeof(opt);
+
+	switch (flag) {
+#ifdef UDP_GRO
+	case EVL_UDP_GRO:
+		return (setsockopt(fd, IPPROTO_UDP, UDP_GRO,
+		    &opt, optlen) == 0);
+#endif
+#ifdef UDP_SEGMENT
+	case EVL_UDP_GSO:
+		/* kernels without GSO don't know the option */
+		return (getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT,
+		    &opt, &optlen) == 0);
+#endif
+	default:
+		(void)fd;
+		(void)opt;
+		(void)optlen;
+		break;
+	}
+
+	return (0);
+}
+
+struct evl_udp *
+evl_udp_create(struct evl_base *evlb, int fd, unsigned int nmsgs,
+    size_t msgsize, int flags, void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_udp *evlu;
+
+	assert(!ISSET(flags, ~(EVL_UDP_GRO|EVL_UDP_GSO)));
+
+	if (nmsgs == 0)
+		nmsgs = EVL_UDP_NMSGS;
+	if (msgsize == 0)
+		msgsize = EVL_UDP_MSGSIZE;
+
+	evlu = evl_malloc(sizeof(*evlu));
+	if (evlu == NULL)
+		return (NULL);
+
+	memset(evlu, 0, sizeof(*evlu));
+	evlu->evlu_fn = fn;
+	evlu->evlu_arg = arg;
+	evlu->evlu_nmsgs = nmsgs;
+	evlu->evlu_msgsize = msgsize;
+	evl_flush_init(&evlu->evlu_flush, evl_udp_dirty);
+
+	/* the offloads are only used if the kernel supports them */
+	if (ISSET(flags, EVL_UDP_GRO) && evl_udp_offload(fd, EVL_UDP_GRO))
+		SET(evlu->evlu_flags, EVL_UDP_GRO);
+	if (ISSET(flags, EVL_UDP_GSO) && evl_udp_offload(fd, EVL_UDP_GSO))
+		SET(evlu->evlu_flags, EVL_UDP_GSO);
+
+	evlu->evlu_rmsgs = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_rmsgs));
+	evlu->evlu_riov = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_riov));
+	evlu->evlu_raddrs = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_raddrs));
+	evlu->evlu_rbufs = evl_reallocarray(NULL, nmsgs, msgsize);
+	evlu->evlu_dgrams = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_dgrams));
+	evlu->evlu_smsgs = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_smsgs));
+	evlu->evlu_siov = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_siov));
+	evlu->evlu_saddrs = evl_reallocarray(NULL, nmsgs,
+	    sizeof(*evlu->evlu_saddrs));
+	evlu->evlu_sbuf = evl_reallocarray(NULL, nmsgs, msgsize);
+	if (evlu->evlu_rmsgs == NULL || evlu->evlu_riov == NULL ||
+	    evlu->evlu_raddrs == NULL || evlu->evlu_rbufs == NULL ||
+	    evlu->evlu_dgrams == NULL || evlu->evlu_smsgs == NULL ||
+	    evlu->evlu_siov == NULL || evlu->evlu_saddrs == NULL ||
+	    evlu->evlu_sbuf == NULL)
+		goto free;
+
+	if (EVL_UDP_RCMSGLEN > 0) {
+		evlu->evlu_rcmsgs = evl_reallocarray(NULL, nmsgs,
+		    EVL_UDP_RCMSGLEN);
+		if (evlu->evlu_rcmsgs == NULL)
+			goto free;
+	}
+	if (EVL_UDP_SCMSGLEN > 0) {
+		evlu->evlu_scmsgs = evl_reallocarray(NULL, nmsgs,
+		    EVL_UDP_SCMSGLEN);
+		if (evlu->evlu_scmsgs == NULL)
+			goto free;
+	}
+
+	if (evl_io_init(&evlu->evlu_rio, evlb, fd, EVL_READ | EVL_PERSIST,
+	    evl_udp_read, evlu) == -1)
+		goto free;
+	if (evl_io_init(&evlu->evlu_wio, evlb, fd, EVL_WRITE | EVL_PERSIST,
+	    evl_udp_write, evlu) == -1)
+		goto rfini;
+
+	return (evlu);
+
+rfini:
+	evl_io_fini(&evlu->evlu_rio);
+free:
+	evl_free(evlu->evlu_scmsgs);
+	evl_free(evlu->evlu_rcmsgs);
+	evl_free(evlu->evlu_sbuf);
+	evl_free(evlu->evlu_saddrs);
+	evl_free(evlu->evlu_siov);
+	evl_free(evlu->evlu_smsgs);
+	evl_free(evlu->evlu_dgrams);
+	evl_free(evlu->evlu_rbufs);
+	evl_free(evlu->evlu_raddrs);
+	evl_free(evlu->evlu_riov);
+	evl_free(evlu->evlu_rmsgs);
+	evl_free(evlu);
+	return (NULL);
+}
+
+int
+evl_udp_add(struct evl_udp *evlu)
+{
+	return (evl_io_add(&evlu->evlu_rio));
+}
+
+int
+evl_udp_del(struct evl_udp *evlu)
+{
+	return (evl_io_del(&evlu->evlu_rio));
+}
+
+int
+evl_udp_flags(const struct evl_udp *evlu)
+{
+	return (ISSET(evlu->evlu_flags, EVL_UDP_GRO|EVL_UDP_GSO));
+}
+
+const struct evl_dgram *
+evl_udp_dgrams(const struct evl_udp *evlu)
+{
+	return (evlu->evlu_dgrams);
+}
+
+static void
+evl_udp_free(struct evl_udp *evlu)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evl_io_base(&evlu->evlu_rio));
+
+	evl_flush_del(evlbs, &evlu->evlu_flush);
+
+	evl_io_del(&evlu->evlu_wio);
+	evl_io_fini(&evlu->evlu_wio);
+	evl_io_fini(&evlu->evlu_rio);
+
+	evl_free(evlu->evlu_scmsgs);
+	evl_free(evlu->evlu_rcmsgs);
+	evl_free(evlu->evlu_sbuf);
+	evl_free(evlu->evlu_saddrs);
+	evl_free(evlu->evlu_siov);
+	evl_free(evlu->evlu_smsgs);
+	evl_free(evlu->evlu_dgrams);
+	evl_free(evlu->evlu_rbufs);
+	evl_free(evlu->evlu_raddrs);
+	evl_free(evlu->evlu_riov);
+	evl_free(evlu->evlu_rmsgs);
+	evl_free(evlu);
+}
+
+void
+evl_udp_destroy(struct evl_udp *evlu)
+{
+	if (evlu == NULL)
+		return;
+
+	evl_io_del(&evlu->evlu_rio);
+
+	/* the read handler is still using the batch */
+	if (ISSET(evlu->evlu_flags, EVL_UDP_RUNNING)) {
+		SET(evlu->evlu_flags, EVL_UDP_DYING);
+		return;
+	}
+
+	evl_udp_free(evlu);
+}
+
+/*
+ * receive
+ */
+
+static int
+evl_udp_recv(struct evl_udp *evlu, int fd)
+{
+	struct evl_mmsghdr *mmsg;
+	struct msghdr *msg;
+	struct evl_dgram *dg;
+	struct cmsghdr *cmsg;
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < evlu->evlu_nmsgs; i++) {
+		mmsg = &evlu->evlu_rmsgs[i];
+		msg = &mmsg->msg_hdr;
+
+		evlu->evlu_riov[i].iov_base = evlu->evlu_rbufs +
+		    i * evlu->evlu_msgsize;
+		evlu->evlu_riov[i].iov_len = evlu->evlu_msgsize;
+
+		msg->msg_name = &evlu->evlu_raddrs[i];
+		msg->msg_namelen = sizeof(evlu->evlu_raddrs[i]);
+		msg->msg_iov = &evlu->evlu_riov[i];
+		msg->msg_iovlen = 1;
+		if (ISSET(evlu->evlu_flags, EVL_UDP_GRO)) {
+			msg->msg_control = evlu->evlu_rcmsgs +
+			    i * EVL_UDP_RCMSGLEN;
+			msg->msg_controllen = EVL_UDP_RCMSGLEN;
+		} else {
+			msg->msg_control = NULL;
+			msg->msg_controllen = 0;
+		}
+		msg->msg_flags = 0;
+	}
+
+	n = evl_recvmmsg(fd, evlu->evlu_rmsgs, evlu->evlu_nmsgs);
+	if (n <= 0)
+		return (n);
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		mmsg = &evlu->evlu_rmsgs[i];
+		msg = &mmsg->msg_hdr;
+		dg = &evlu->evlu_dgrams[i];
+
+		dg->evld_buf = evlu->evlu_riov[i].iov_base;
+		dg->evld_len = mmsg->msg_len;
+		dg->evld_addr = msg->msg_name;
+		dg->evld_addrlen = msg->msg_namelen;
+		dg->evld_segsize = 0;
+		dg->evld_flags = msg->msg_flags;
+
+		if (msg->msg_controllen == 0)
+			continue;
+
+		for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef UDP_GRO
+			int segsize;
+
+			if (cmsg->cmsg_level == IPPROTO_UDP &&
+			    cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&segsize, CMSG_DATA(cmsg),
+				    sizeof(segsize));
+				dg->evld_segsize = segsize;
+			}
+#endif
+		}
+	}
+
+	return (n);
+}
+
+static void
+evl_udp_read(int fd, int events, void *arg)
+{
+	struct evl_udp *evlu = arg;
+	struct evl_work *evl = &evlu->evlu_rio.evl_io_work;
+	unsigned int rounds;
+	int n;
+
+	SET(evlu->evlu_flags, EVL_UDP_RUNNING);
+	for (rounds = 0; rounds < EVL_UDP_ROUNDS; rounds++) {
+		/* errors are left for the next read event */
+		n = evl_udp_recv(evlu, fd);
+		if (n <= 0)
+			break;
+
+		(*evlu->evlu_fn)(fd, n, evlu->evlu_arg);
+
+		if (!ISSET(evl->evl_event, EVL_PENDING))
+			break;
+
+		/* a short batch means the socket is drained */
+		if ((unsigned int)n < evlu->evlu_nmsgs)
+			break;
+	}
+	CLR(evlu->evlu_flags, EVL_UDP_RUNNING);
+
+	if (ISSET(evlu->evlu_flags, EVL_UDP_DYING))
+		evl_udp_free(evlu);
+}
+
+/*
+ * send
+ */
+
+static void
+evl_udp_output(struct evl_udp *evlu)
+{
+	int fd = evl_io_fd(&evlu->evlu_rio);
+	int n;
+
+	while (evlu->evlu_nsent < evlu->evlu_nsend) {
+		n = evl_sendmmsg(fd, evlu->evlu_smsgs + evlu->evlu_nsent,
+		    evlu->evlu_nsend - evlu->evlu_nsent);
+		if (n == -1) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				if (!ISSET(evlu->evlu_flags, EVL_UDP_BLOCKED)) {
+					SET(evlu->evlu_flags, EVL_UDP_BLOCKED);
+					evl_io_add(&evlu->evlu_wio);
+				}
+				return;
+			default:
+				/* drop it like the network would */
+				n = 1;
+				break;
+			}
+		}
+
+		evlu->evlu_nsent += n;
+	}
+
+	evlu->evlu_nsend = evlu->evlu_nsent = 0;
+	evlu->evlu_soff = 0;
+
+	if (ISSET(evlu->evlu_flags, EVL_UDP_BLOCKED)) {
+		CLR(evlu->evlu_flags, EVL_UDP_BLOCKED);
+		evl_io_del(&evlu->evlu_wio);
+	}
+}
+
+static void
+evl_udp_write(int fd, int events, void *arg)
+{
+	evl_udp_output(arg);
+}
+
+static void
+evl_udp_dirty(struct evl_flush *evlf)
+{
+	struct evl_udp *evlu = (struct evl_udp *)((char *)evlf -
+	    offsetof(struct evl_udp, evlu_flush));
+
+	evl_udp_output(evlu);
+}
+
+int
+evl_udp_flush(struct evl_udp *evlu)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evl_io_base(&evlu->evlu_rio));
+
+	evl_flush_del(evlbs, &evlu->evlu_flush);
+	evl_udp_output(evlu);
+
+	if (evlu->evlu_nsend > 0) {
+		errno = EAGAIN;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+evl_udp_queue(struct evl_udp *evlu, const void *buf, size_t len,
+    size_t segsize, const struct sockaddr *sa, socklen_t salen)
+{
+	struct evl_bufs *evlbs = evl_base_bufs(evl_io_base(&evlu->evlu_rio));
+	size_t buflen = evlu->evlu_nmsgs * evlu->evlu_msgsize;
+	struct evl_mmsghdr *mmsg;
+	struct msghdr *msg;
+	struct iovec *iov;
+	unsigned int i;
+
+	if (len > buflen || salen > sizeof(evlu->evlu_saddrs[0])) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	if (evlu->evlu_nsend == evlu->evlu_nmsgs ||
+	    buflen - evlu->evlu_soff < len) {
+		/* the batch is full, try to make room */
+		evl_flush_del(evlbs, &evlu->evlu_flush);
+		evl_udp_output(evlu);
+		if (evlu->evlu_nsend > 0) {
+			errno = EAGAIN;
+			return (-1);
+		}
+	}
+
+	i = evlu->evlu_nsend++;
+	mmsg = &evlu->evlu_smsgs[i];
+	msg = &mmsg->msg_hdr;
+	iov = &evlu->evlu_siov[i];
+
+	iov->iov_base = evlu->evlu_sbuf + evlu->evlu_soff;
+	iov->iov_len = len;
+	memcpy(iov->iov_base, buf, len);
+	evlu->evlu_soff += len;
+
+	msg->msg_name = NULL;
+	msg->msg_namelen = 0;
+	if (sa != NULL) {
+		memcpy(&evlu->evlu_saddrs[i], sa, salen);
+		msg->msg_name = &evlu->evlu_saddrs[i];
+		msg->msg_namelen = salen;
+	}
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = NULL;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+
+#ifdef UDP_SEGMENT
+	if (segsize > 0) {
+		struct cmsghdr *cmsg;
+		uint16_t gso = segsize;
+
+		msg->msg_control = evlu->evlu_scmsgs + i * EVL_UDP_SCMSGLEN;
+		msg->msg_controllen = EVL_UDP_SCMSGLEN;
+
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(gso));
+		memcpy(CMSG_DATA(cmsg), &gso, sizeof(gso));
+	}
+#endif
+
+	evl_flush_add(evlbs, &evlu->evlu_flush);
+
+	return (0);
+}
+
+int
+evl_udp_send(struct evl_udp *evlu, const void *buf, size_t len,
+    const struct sockaddr *sa, socklen_t salen)
+{
+	return (evl_udp_queue(evlu, buf, len, 0, sa, salen));
+}
+
+int
+evl_udp_sendseg(struct evl_udp *evlu, const void *buf, size_t len,
+    size_t segsize, const struct sockaddr *sa, socklen_t salen)
+{
+	const char *p = buf;
+	size_t n;
+
+	if (segsize == 0 || len <= segsize)
+		return (evl_udp_queue(evlu, buf, len, 0, sa, salen));
+
+	if (ISSET(evlu->evlu_flags, EVL_UDP_GSO) && segsize <= UINT16_MAX)
+		return (evl_udp_queue(evlu, buf, len, segsize, sa, salen));
+
+	/* split it up ourselves */
+	while (len > 0) {
+		n = len < segsize ? len : segsize;
+		if (evl_udp_queue(evlu, p, n, 0, sa, salen) == -1)
+			return (-1);
+
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+#ifndef EVL_HAS_MMSG
+static int
+evl_recvmmsg(int fd, struct evl_mmsghdr *mmsgs, unsigned int n)
+{
+	unsigned int i;
+	ssize_t rv;
+
+	for (i = 0; i < n; i++) {
+		rv = recvmsg(fd, &mmsgs[i].msg_hdr, MSG_DONTWAIT);
+		if (rv == -1)
+			return (i > 0 ? (int)i : -1);
+
+		mmsgs[i].msg_len = rv;
+	}
+
+	return (i);
+}
+
+static int
+evl_sendmmsg(int fd, struct evl_mmsghdr *mmsgs, unsigned int n)
+{
+	unsigned int i;
+	ssize_t rv;
+
+	for (i = 0; i < n; i++) {
+		rv = sendmsg(fd, &mmsgs[i].msg_hdr, MSG_DONTWAIT);
+		if (rv == -1)
+			return (i > 0 ? (int)i : -1);
+
+		mmsgs[i].msg_len = rv;
+	}
+
+	return (i);
+}
+#endif /* EVL_HAS_MMSG */
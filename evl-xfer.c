@@ -0,0 +1,401 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* splice */
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "evl-internal.h"
+#include "evl-config.h"
+
+#ifdef EVL_HAS_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#define EVL_XFER_PIPESZ		65536	/* default pipe capacity */
+#define EVL_XFER_BUFSZ		16384
+#define EVL_XFER_MAXSEND	(1 << 30)	/* bytes per sendfile call */
+
+enum evl_xfer_mode {
+	EVL_XFER_COPY,		/* read and write through a buffer */
+	EVL_XFER_SPLICE,	/* splice through a pipe */
+	EVL_XFER_SENDFILE,	/* sendfile from a regular file */
+};
+
+struct evl_transfer {
+	struct evl_io		 evlx_rio;	/* EVL_READ on the source */
+	struct evl_io		 evlx_wio;	/* EVL_WRITE on the sink */
+	void			(*evlx_fn)(struct evl_transfer *, int, void *);
+	void			*evlx_arg;
+	enum evl_xfer_mode	 evlx_mode;
+	int			 evlx_pipe[2];
+	char			*evlx_buf;
+	size_t			 evlx_off;	/* start of staged data */
+	size_t			 evlx_staged;	/* bytes in the pipe or buf */
+	off_t			 evlx_left;	/* -1 to transfer until eof */
+	off_t			 evlx_bytes;	/* written to the sink */
+	off_t			 evlx_notified;
+	size_t			 evlx_lowat;
+	int			 evlx_eof;
+	int			 evlx_error;
+};
+
+static void	evl_transfer_read(int, int, void *);
+static void	evl_transfer_write(int, int, void *);
+
+struct evl_transfer *
+evl_transfer_create(struct evl_base *evlb, int from, int to, off_t len,
+    void (*fn)(struct evl_transfer *, int, void *), void *arg)
+{
+	struct evl_transfer *evlx;
+	struct stat st;
+
+	if (fstat(from, &st) == -1)
+		return (NULL);
+
+	evlx = evl_malloc(sizeof(*evlx));
+	if (evlx == NULL)
+		return (NULL);
+
+	evlx->evlx_fn = fn;
+	evlx->evlx_arg = arg;
+	evlx->evlx_pipe[0] = evlx->evlx_pipe[1] = -1;
+	evlx->evlx_buf = NULL;
+	evlx->evlx_off = 0;
+	evlx->evlx_staged = 0;
+	evlx->evlx_left = len > 0 ? len : -1;
+	evlx->evlx_bytes = 0;
+	evlx->evlx_notified = 0;
+	evlx->evlx_lowat = 0;
+	evlx->evlx_eof = 0;
+	evlx->evlx_error = 0;
+
+	evlx->evlx_mode = EVL_XFER_COPY;
+#ifdef EVL_HAS_SENDFILE
+	if (S_ISREG(st.st_mode))
+		evlx->evlx_mode = EVL_XFER_SENDFILE;
+#endif
+#ifdef EVL_HAS_SPLICE
+	if (evlx->evlx_mode == EVL_XFER_COPY &&
+	    pipe2(evlx->evlx_pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+		evlx->evlx_mode = EVL_XFER_SPLICE;
+#endif
+	if (evlx->evlx_mode == EVL_XFER_COPY) {
+		evlx->evlx_buf = evl_malloc(EVL_XFER_BUFSZ);
+		if (evlx->evlx_buf == NULL)
+			goto free;
+	}
+
+	if (evl_io_init(&evlx->evlx_rio, evlb, from, EVL_READ | EVL_PERSIST,
+	    evl_transfer_read, evlx) == -1)
+		goto free;
+	if (evl_io_init(&evlx->evlx_wio, evlb, to, EVL_WRITE | EVL_PERSIST,
+	    evl_transfer_write, evlx) == -1)
+		goto rfini;
+
+	return (evlx);
+
+rfini:
+	evl_io_fini(&evlx->evlx_rio);
+free:
+	if (evlx->evlx_pipe[0] != -1) {
+		close(evlx->evlx_pipe[0]);
+		close(evlx->evlx_pipe[1]);
+	}
+	evl_free(evlx->evlx_buf);
+	evl_free(evlx);
+	return (NULL);
+}
+
+void
+evl_transfer_lowat(struct evl_transfer *evlx, size_t lowat)
+{
+	evlx->evlx_lowat = lowat;
+}
+
+off_t
+evl_transfer_bytes(const struct evl_transfer *evlx)
+{
+	return (evlx->evlx_bytes);
+}
+
+int
+evl_transfer_error(const struct evl_transfer *evlx)
+{
+	return (evlx->evlx_error);
+}
+
+/* wait for the source to be readable or the sink to be writable */
+static void
+evl_transfer_wait(struct evl_transfer *evlx, int events)
+{
+	if (ISSET(events, EVL_READ))
+		evl_io_add(&evlx->evlx_rio);
+	else
+		evl_io_del(&evlx->evlx_rio);
+
+	if (ISSET(events, EVL_WRITE))
+		evl_io_add(&evlx->evlx_wio);
+	else
+		evl_io_del(&evlx->evlx_wio);
+}
+
+int
+evl_transfer_add(struct evl_transfer *evlx)
+{
+	struct evl_work *rw = &evlx->evlx_rio.evl_io_work;
+	struct evl_work *ww = &evlx->evlx_wio.evl_io_work;
+
+	if (ISSET(rw->evl_event | ww->evl_event, EVL_PENDING))
+		return (0);
+	if (evlx->evlx_error != 0 || evlx->evlx_left == 0 ||
+	    (evlx->evlx_eof && evlx->evlx_staged == 0))
+		return (0);
+
+	/* sendfile never blocks on a file, only on the sink */
+	evl_transfer_wait(evlx, evlx->evlx_mode == EVL_XFER_SENDFILE ||
+	    evlx->evlx_staged > 0 ? EVL_WRITE : EVL_READ);
+
+	return (1);
+}
+
+int
+evl_transfer_del(struct evl_transfer *evlx)
+{
+	int rv = 0;
+
+	if (evl_io_del(&evlx->evlx_rio))
+		rv = 1;
+	if (evl_io_del(&evlx->evlx_wio))
+		rv = 1;
+
+	return (rv);
+}
+
+void
+evl_transfer_destroy(struct evl_transfer *evlx)
+{
+	if (evlx == NULL)
+		return;
+
+	evl_transfer_del(evlx);
+	evl_io_fini(&evlx->evlx_wio);
+	evl_io_fini(&evlx->evlx_rio);
+
+	if (evlx->evlx_pipe[0] != -1) {
+		close(evlx->evlx_pipe[0]);
+		close(evlx->evlx_pipe[1]);
+	}
+	evl_free(evlx->evlx_buf);
+	evl_free(evlx);
+}
+
+static size_t
+evl_transfer_want(const struct evl_transfer *evlx, size_t space)
+{
+	if (evlx->evlx_left != -1 && (off_t)space > evlx->evlx_left)
+		space = evlx->evlx_left;
+
+	return (space);
+}
+
+/* the source doesn't support splice or sendfile, so copy instead */
+static int
+evl_transfer_fallback(struct evl_transfer *evlx)
+{
+	if (evlx->evlx_mode == EVL_XFER_COPY || evlx->evlx_staged > 0)
+		return (-1);
+
+	evlx->evlx_buf = evl_malloc(EVL_XFER_BUFSZ);
+	if (evlx->evlx_buf == NULL)
+		return (-1);
+
+	if (evlx->evlx_pipe[0] != -1) {
+		close(evlx->evlx_pipe[0]);
+		close(evlx->evlx_pipe[1]);
+		evlx->evlx_pipe[0] = evlx->evlx_pipe[1] = -1;
+	}
+
+	evlx->evlx_mode = EVL_XFER_COPY;
+	return (0);
+}
+
+/* move data from the source into the pipe or buffer */
+static ssize_t
+evl_transfer_fill(struct evl_transfer *evlx)
+{
+	int fd = evl_io_fd(&evlx->evlx_rio);
+	size_t n;
+	ssize_t rv;
+
+	switch (evlx->evlx_mode) {
+#ifdef EVL_HAS_SPLICE
+	case EVL_XFER_SPLICE:
+		n = evl_transfer_want(evlx, EVL_XFER_PIPESZ - evlx->evlx_staged);
+		rv = splice(fd, NULL, evlx->evlx_pipe[1], NULL, n,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		break;
+#endif
+	case EVL_XFER_COPY:
+		if (evlx->evlx_staged == 0)
+			evlx->evlx_off = 0;
+		n = evl_transfer_want(evlx, EVL_XFER_BUFSZ -
+		    (evlx->evlx_off + evlx->evlx_staged));
+		rv = read(fd, evlx->evlx_buf + evlx->evlx_off +
+		    evlx->evlx_staged, n);
+		break;
+	default:
+		abort();
+	}
+
+	if (rv > 0) {
+		evlx->evlx_staged += rv;
+		if (evlx->evlx_left != -1)
+			evlx->evlx_left -= rv;
+	} else if (rv == 0)
+		evlx->evlx_eof = 1;
+
+	return (rv);
+}
+
+/* move data from the pipe or buffer, or the file, to the sink */
+static ssize_t
+evl_transfer_drain(struct evl_transfer *evlx)
+{
+	int fd = evl_io_fd(&evlx->evlx_wio);
+	ssize_t rv;
+
+	switch (evlx->evlx_mode) {
+#ifdef EVL_HAS_SENDFILE
+	case EVL_XFER_SENDFILE:
+		rv = sendfile(fd, evl_io_fd(&evlx->evlx_rio), NULL,
+		    evl_transfer_want(evlx, EVL_XFER_MAXSEND));
+		if (rv > 0 && evlx->evlx_left != -1)
+			evlx->evlx_left -= rv;
+		else if (rv == 0)
+			evlx->evlx_eof = 1;
+		break;
+#endif
+#ifdef EVL_HAS_SPLICE
+	case EVL_XFER_SPLICE:
+		rv = splice(evlx->evlx_pipe[0], NULL, fd, NULL,
+		    evlx->evlx_staged, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (rv > 0)
+			evlx->evlx_staged -= rv;
+		break;
+#endif
+	case EVL_XFER_COPY:
+		rv = write(fd, evlx->evlx_buf + evlx->evlx_off,
+		    evlx->evlx_staged);
+		if (rv > 0) {
+			evlx->evlx_off += rv;
+			evlx->evlx_staged -= rv;
+		}
+		break;
+	default:
+		abort();
+	}
+
+	if (rv > 0)
+		evlx->evlx_bytes += rv;
+
+	return (rv);
+}
+
+static void
+evl_transfer_run(struct evl_transfer *evlx)
+{
+	int events = 0;
+	ssize_t rv;
+
+	for (;;) {
+		if (evlx->evlx_mode == EVL_XFER_SENDFILE || evlx->evlx_staged) {
+			if (evlx->evlx_mode == EVL_XFER_SENDFILE &&
+			    (evlx->evlx_eof || evlx->evlx_left == 0))
+				break;
+
+			rv = evl_transfer_drain(evlx);
+			if (rv == -1) {
+				if (errno == EAGAIN) {
+					events = EVL_WRITE;
+					break;
+				}
+				if (errno == EINTR)
+					continue;
+				if ((errno == EINVAL || errno == ENOSYS) &&
+				    evl_transfer_fallback(evlx) == 0)
+					continue;
+
+				evlx->evlx_error = errno;
+				break;
+			}
+			continue;
+		}
+
+		if (evlx->evlx_eof || evlx->evlx_left == 0)
+			break;
+
+		rv = evl_transfer_fill(evlx);
+		if (rv == -1) {
+			if (errno == EAGAIN) {
+				events = EVL_READ;
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && evl_transfer_fallback(evlx) == 0)
+				continue;
+
+			evlx->evlx_error = errno;
+			break;
+		}
+	}
+
+	evl_transfer_wait(evlx, events);
+
+	/* the callback may destroy the transfer, so it goes last */
+	if (evlx->evlx_error != 0)
+		(*evlx->evlx_fn)(evlx, EVL_TRANSFER_ERROR, evlx->evlx_arg);
+	else if (events == 0)
+		(*evlx->evlx_fn)(evlx, EVL_TRANSFER_DONE, evlx->evlx_arg);
+	else if (evlx->evlx_lowat > 0 && evlx->evlx_bytes -
+	    evlx->evlx_notified >= (off_t)evlx->evlx_lowat) {
+		evlx->evlx_notified = evlx->evlx_bytes;
+		(*evlx->evlx_fn)(evlx, EVL_TRANSFER_LOWAT, evlx->evlx_arg);
+	}
+}
+
+static void
+evl_transfer_read(int fd, int events, void *arg)
+{
+	evl_transfer_run(arg);
+}
+
+static void
+evl_transfer_write(int fd, int events, void *arg)
+{
+	evl_transfer_run(arg);
+}
@@ -19,20 +19,59 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "evl-internal.h"
 #include "evl-config.h"
+#include "evl-probe.h"
 
 TAILQ_HEAD(evl_work_list, evl_work);
+TAILQ_HEAD(evl_io_list, evl_io);
+TAILQ_HEAD(evl_sig_list, evl_sig);
 HEAP_HEAD(evl_tmo_heap);
 
+struct evl_fd {
+	struct evl_io		 evlfd_io;	/* registered with the backend */
+	struct evl_io_list	 evlfd_ios;
+};
+
 struct evl_base {
 	const struct evl_ops	*evlb_ops;
 	void			*evlb_backend;
 
 	struct evl_work_list	 evlb_work;
 	struct evl_tmo_heap	 evlb_tmos;
+	struct evl_io_list	 evlb_ios;	/* every io and sig the */
+	struct evl_sig_list	 evlb_sigs;	/* backend knows about */
+	struct evl_fd		**evlb_fds;
+	unsigned int		 evlb_fdslen;
+
+	struct evl_pools	 evlb_pools;
+	struct evl_pool		 evlb_work_pool;
+	struct evl_pool		 evlb_io_pool;
+	struct evl_pool		 evlb_fd_pool;
+	struct evl_pool		 evlb_tmo_pool;
+	struct evl_pool		 evlb_sig_pool;
+	struct evl_pool		 evlb_wait_pool;
+	struct evl_bufs		 evlb_bufs;
+	struct evl_cos		*evlb_cos;	/* allocated on first use */
+	struct evl_stats	 evlb_stats;
+	int			(*evlb_clock)(void *, struct timespec *);
+	void			*evlb_clock_arg;
+
+	struct evl_hist		*evlb_hists[EVL_NHISTS];
+	void			(*evlb_slow_fn)(void (*)(int, int, void *),
+				     int, int, uint64_t, void *);
+	void			*evlb_slow_arg;
+	uint64_t		 evlb_slow_nsecs;
+	struct evl_tmo		*evlb_probe;
+	struct timespec		 evlb_probe_ival;
+
+	struct evl_handles	*evlb_handles;	/* allocated on first use */
+	struct evl_dense	*evlb_dense;
+	struct evl_uring	*evlb_uring;	/* allocated on first use */
 
 	unsigned int		 evlb_nevl;
 	unsigned int		 evlb_running;
@@ -98,7 +137,8 @@ evlb_work_first(struct evl_base *evlb)
 	return (TAILQ_FIRST(&evlb->evlb_work));
 }
 
-#define evl_monotime(_ts)	clock_gettime(CLOCK_MONOTONIC, (_ts))
+#define evl_monotime(_evlb, _ts)					\
+	(*(_evlb)->evlb_clock)((_evlb)->evlb_clock_arg, (_ts))
 
 #define evl_op_dispatch(_evlb, _deadline)				\
 	(*(_evlb)->evlb_ops->evlo_dispatch)((_evlb), (_deadline))
@@ -109,301 +149,1206 @@ evlb_work_first(struct evl_base *evlb)
 	(*(_evlb)->evlb_ops->evlo_io_add)((_evlio))
 #define evl_op_io_del(_evlb, _evlio)					\
 	(*(_evlb)->evlb_ops->evlo_io_del)((_evlio))
+#define evl_op_io_modify(_evlb, _evlio, _events)			\
+	(*(_evlb)->evlb_ops->evlo_io_modify)((_evlio), (_events))
 #define evl_op_io_destroy(_evlb, _evlio)				\
 	(*(_evlb)->evlb_ops->evlo_io_destroy)((_evlio))
 
-static void	evl_work_init(struct evl_work *, struct evl_base *,
+#define evl_op_sig_create(_evlb, _evls)					\
+	(*(_evlb)->evlb_ops->evlo_sig_create)((_evls))
+#define evl_op_sig_add(_evlb, _evls)					\
+	(*(_evlb)->evlb_ops->evlo_sig_add)((_evls))
+#define evl_op_sig_del(_evlb, _evls)					\
+	(*(_evlb)->evlb_ops->evlo_sig_del)((_evls))
+#define evl_op_sig_destroy(_evlb, _evls)				\
+	(*(_evlb)->evlb_ops->evlo_sig_destroy)((_evls))
+
+#define evl_op_wait_create(_evlb, _evlw)				\
+	(*(_evlb)->evlb_ops->evlo_wait_create)((_evlw))
+#define evl_op_wait_destroy(_evlb, _evlw)				\
+	(*(_evlb)->evlb_ops->evlo_wait_destroy)((_evlw))
+
+static void	evl_work_setup(struct evl_work *, struct evl_base *,
 		    int, int, void (*)(int, int, void *), void *);
+static void	evl_base_pools_fini(struct evl_base *);
+static void	evl_lag_probe_stop(struct evl_base *);
+
+EVL_CTASSERT(sizeof(struct evl_base) <= EVL_BASE_SIZE);
+EVL_CTASSERT(sizeof(struct evl_work) <= EVL_WORK_SIZE);
+EVL_CTASSERT(sizeof(struct evl_io) <= EVL_IO_SIZE);
+EVL_CTASSERT(sizeof(struct evl_tmo) <= EVL_TMO_SIZE);
+EVL_CTASSERT(__alignof__(struct evl_base) <= EVL_ALIGN);
+EVL_CTASSERT(__alignof__(struct evl_io) <= EVL_ALIGN);
+EVL_CTASSERT(__alignof__(struct evl_tmo) <= EVL_ALIGN);
+
+static const struct evl_ops *const evl_backends[] = {
+#if 1 || defined(EVL_HAS_KQUEUE)
+	&evl_ops_kq,
+#endif
+	&evl_ops_poll,
+	&evl_ops_sim,
+};
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+const char *
+evl_backend_name(unsigned int idx)
+{
+	if (idx >= nitems(evl_backends))
+		return (NULL);
+
+	return (evl_backends[idx]->evlo_name);
+}
+
+static const struct evl_ops *
+evl_backend_lookup(const char *name)
+{
+	unsigned int i;
+
+	if (name == NULL)
+		return (EVL_DEFAULT_OPS);
+
+	for (i = 0; i < nitems(evl_backends); i++) {
+		if (strcmp(evl_backends[i]->evlo_name, name) == 0)
+			return (evl_backends[i]);
+	}
+
+	errno = ENOENT;
+	return (NULL);
+}
+
+static int
+evl_clock_monotonic(void *arg, struct timespec *ts)
+{
+	return (clock_gettime(CLOCK_MONOTONIC, ts));
+}
+
+void
+evl_set_clock(struct evl_base *evlb, int (*clock)(void *, struct timespec *),
+    void *arg)
+{
+	if (clock == NULL) {
+		clock = evl_clock_monotonic;
+		arg = NULL;
+	}
+
+	evlb->evlb_clock = clock;
+	evlb->evlb_clock_arg = arg;
+}
 
 struct evl_base *
 evl_init(void)
 {
-	const struct evl_ops *ops = EVL_DEFAULT_OPS;
+	return (evl_init_backend(NULL));
+}
+
+struct evl_base *
+evl_init_backend(const char *name)
+{
 	struct evl_base *evlb;
-	void *backend;
 
-	evlb = malloc(sizeof(*evlb));
+	evlb = evl_malloc(sizeof(*evlb));
 	if (evlb == NULL)
 		return (NULL);
 
-	backend = (*ops->evlo_create)();
-	if (backend == NULL) {
-		free(evlb);
+	if (evl_base_init_backend(evlb, name) == -1) {
+		evl_free(evlb);
 		return (NULL);
 	}
 
+	return (evlb);
+}
+
+int
+evl_base_init(struct evl_base *evlb)
+{
+	return (evl_base_init_backend(evlb, NULL));
+}
+
+int
+evl_base_init_backend(struct evl_base *evlb, const char *name)
+{
+	const struct evl_ops *ops;
+	void *backend;
+
+	ops = evl_backend_lookup(name);
+	if (ops == NULL)
+		return (-1);
+
+	evl_pools_init(&evlb->evlb_pools);
+	evl_pool_init(&evlb->evlb_work_pool, &evlb->evlb_pools,
+	    "evl_work", sizeof(struct evl_work));
+	evl_pool_init(&evlb->evlb_io_pool, &evlb->evlb_pools,
+	    "evl_io", sizeof(struct evl_io));
+	evl_pool_init(&evlb->evlb_fd_pool, &evlb->evlb_pools,
+	    "evl_fd", sizeof(struct evl_fd));
+	evl_pool_init(&evlb->evlb_tmo_pool, &evlb->evlb_pools,
+	    "evl_tmo", sizeof(struct evl_tmo));
+	evl_pool_init(&evlb->evlb_sig_pool, &evlb->evlb_pools,
+	    "evl_sig", sizeof(struct evl_sig));
+	evl_pool_init(&evlb->evlb_wait_pool, &evlb->evlb_pools,
+	    "evl_wait", sizeof(struct evl_wait));
+	evl_bufs_init(&evlb->evlb_bufs, &evlb->evlb_pools);
+	evlb->evlb_cos = NULL;
+	memset(&evlb->evlb_stats, 0, sizeof(evlb->evlb_stats));
+	evlb->evlb_clock = evl_clock_monotonic;
+	evlb->evlb_clock_arg = NULL;
+	memset(evlb->evlb_hists, 0, sizeof(evlb->evlb_hists));
+	evlb->evlb_slow_fn = NULL;
+	evlb->evlb_slow_arg = NULL;
+	evlb->evlb_slow_nsecs = 0;
+	evlb->evlb_probe = NULL;
+	TAILQ_INIT(&evlb->evlb_ios);
+	TAILQ_INIT(&evlb->evlb_sigs);
+	evlb->evlb_fds = NULL;
+	evlb->evlb_fdslen = 0;
+
+	backend = (*ops->evlo_create)(evlb);
+	if (backend == NULL) {
+		evl_base_pools_fini(evlb);
+		return (-1);
+	}
+
 	evlb->evlb_ops = ops;
 	evlb->evlb_backend = backend;
 
 	evlb->evlb_running = 0;
 	evlb->evlb_nevl = 0;
+	evlb->evlb_handles = NULL;
+	evlb->evlb_dense = NULL;
+	evlb->evlb_uring = NULL;
 	evlb_work_init(evlb);
 	evlb_tmo_init(evlb);
 
-	return (evlb);
+	return (0);
+}
+
+void
+evl_base_fini(struct evl_base *evlb)
+{
+	unsigned int i;
+
+	evl_lag_probe_stop(evlb);
+
+	assert(evlb_work_first(evlb) == NULL);
+	assert(evlb_tmo_first(evlb) == NULL);
+
+	for (i = 0; i < EVL_NHISTS; i++)
+		evl_free(evlb->evlb_hists[i]);
+
+	evl_dense_free(evlb->evlb_dense);
+#ifdef EVL_HAS_IO_URING
+	evl_uring_destroy(evlb->evlb_uring);
+#endif
+	(*evlb->evlb_ops->evlo_destroy)(evlb->evlb_backend);
+	evl_base_pools_fini(evlb);
+	evl_free(evlb->evlb_fds);
+	evl_handles_destroy(evlb->evlb_handles);
 }
 
+/*
+ * give the base a new backend, eg, in the child after a fork. the
+ * new backend is created first so failing to get one leaves the base
+ * as it was. after that the old backend is torn down and everything
+ * it knew about is registered with the new one. timeouts and queued
+ * work live in the base and are not affected.
+ */
 int
-evl_dispatch(struct evl_base *evlb)
+evl_reinit(struct evl_base *evlb)
 {
-	struct evl_tmo now, *evlt;
-	struct evl_work *evl;
-	struct timespec *ts;
-	int fires;
+	const struct evl_ops *ops = evlb->evlb_ops;
+	struct evl_io *evlio, *nevlio, *w;
+	struct evl_sig *evls, *nevls;
+	void *backend;
+	int rv = 0;
 
-	evlb->evlb_running = 1;
-	for (;;) {
-		if (evl_monotime(&now.evl_tmo_deadline) == -1)
-			return (-1);
+	/* a child cannot wait for its parents children */
+	if (evlb->evlb_wait_pool.evlpr_nout > 0) {
+		errno = EBUSY;
+		return (-1);
+	}
+#ifdef EVL_HAS_IO_URING
+	/* nor reap its parents completions */
+	if (evl_uring_inflight(evlb->evlb_uring) > 0) {
+		errno = EBUSY;
+		return (-1);
+	}
+#endif
 
-		while ((evlt = evlb_tmo_cextract(evlb, &now)) != NULL) {
-			CLR(evlt->evl_tmo_work.evl_event, EVL_PENDING);
-			evl_work_add(&evlt->evl_tmo_work, EVL_TIMEOUT);
-		}
+	backend = (*ops->evlo_create)(evlb);
+	if (backend == NULL)
+		return (-1);
 
-		while ((evl = evlb_work_first(evlb)) != NULL) {
-			evlb_work_remove(evlb, evl);
-			fires = evl->evl_fires;
-			evl->evl_fires = 0;
+#ifdef EVL_HAS_IO_URING
+	/* the ring is shared with the parent, get a new one when needed */
+	evl_uring_destroy(evlb->evlb_uring);
+	evlb->evlb_uring = NULL;
+#endif
+
+	/* signal handling is process state, so put it back */
+	TAILQ_FOREACH(evls, &evlb->evlb_sigs, evl_sig_entry) {
+		if (ISSET(evls->evl_sig_work.evl_event, EVL_PENDING))
+			evl_op_sig_del(evlb, evls);
+		evl_op_sig_destroy(evlb, evls);
+	}
 
-			(*evl->evl_fn)(evl->evl_ident, fires, evl->evl_arg);
+	(*ops->evlo_destroy)(evlb->evlb_backend);
+	evlb->evlb_backend = backend;
 
-			if (!evlb->evlb_running)
-				return (0);
+	for (evlio = TAILQ_FIRST(&evlb->evlb_ios); evlio != NULL;
+	    evlio = nevlio) {
+		nevlio = TAILQ_NEXT(evlio, evl_io_entry);
+
+		if (evl_op_io_create(evlb, evlio) == -1) {
+			/* the ios on the fd can only be destroyed now */
+			TAILQ_REMOVE(&evlb->evlb_ios, evlio, evl_io_entry);
+			evlio->evl_io_entry.tqe_prev = NULL;
+			CLR(evlio->evl_io_work.evl_event, EVL_PENDING);
+			TAILQ_FOREACH(w, &evlio->evl_io_mux->evlfd_ios,
+			    evl_io_entry)
+				CLR(w->evl_io_work.evl_event, EVL_PENDING);
+			rv = -1;
+			continue;
 		}
 
-		evlt = evlb_tmo_first(evlb);
-		if (evlt != NULL) {
-			ts = &now.evl_tmo_deadline;
-			timespecsub(&evlt->evl_tmo_deadline, ts, ts);
-		} else
-			ts = NULL;
+		if (ISSET(evlio->evl_io_work.evl_event, EVL_PENDING))
+			evl_op_io_add(evlb, evlio);
+	}
 
-		if (evl_op_dispatch(evlb, ts) == -1)
-			return (-1);
+	for (evls = TAILQ_FIRST(&evlb->evlb_sigs); evls != NULL;
+	    evls = nevls) {
+		nevls = TAILQ_NEXT(evls, evl_sig_entry);
+
+		if (evl_op_sig_create(evlb, evls) == -1) {
+			TAILQ_REMOVE(&evlb->evlb_sigs, evls, evl_sig_entry);
+			evls->evl_sig_entry.tqe_prev = NULL;
+			CLR(evls->evl_sig_work.evl_event, EVL_PENDING);
+			rv = -1;
+			continue;
+		}
+
+		if (ISSET(evls->evl_sig_work.evl_event, EVL_PENDING))
+			evl_op_sig_add(evlb, evls);
 	}
 
-	return (0);
+	return (rv);
 }
 
 static void
-evl_work_init(struct evl_work *evlw, struct evl_base *evl,
-    int ident, int event, void (*fn)(int, int, void *), void *arg)
+evl_base_pools_fini(struct evl_base *evlb)
 {
-	evlw->evl_base = evl;
-	evlw->evl_fn = fn;
-	evlw->evl_arg = arg;
-	evlw->evl_ident = ident;
-	evlw->evl_event = event;
-	evlw->evl_fires = 0;
+	evl_cos_destroy(evlb->evlb_cos);
+	evl_bufs_fini(&evlb->evlb_bufs);
+	evl_pool_fini(&evlb->evlb_wait_pool);
+	evl_pool_fini(&evlb->evlb_sig_pool);
+	evl_pool_fini(&evlb->evlb_tmo_pool);
+	evl_pool_fini(&evlb->evlb_fd_pool);
+	evl_pool_fini(&evlb->evlb_io_pool);
+	evl_pool_fini(&evlb->evlb_work_pool);
+	evl_pools_fini(&evlb->evlb_pools);
 }
 
-struct evl_work *
-evl_work_create(struct evl_base *evlb, int ident,
-    void (*fn)(int, int, void *), void *arg)
+int
+evl_arena(struct evl_base *evlb, size_t len)
 {
-	struct evl_work *evl;
-
-	evl = malloc(sizeof(*evl));
-	if (evl == NULL)
-		return (NULL);
-
-	evl_work_init(evl, evlb, ident, 0, fn, arg);
+	return (evl_pools_arena(&evlb->evlb_pools, len));
+}
 
-	return (evl);
+int
+evl_pool_stats(struct evl_base *evlb, unsigned int idx,
+    struct evl_pool_stats *st)
+{
+	return (evl_pools_stats(&evlb->evlb_pools, idx, st));
 }
 
 void
-evl_work_set(struct evl_work *evlw, void (*fn)(int, int, void *))
+evl_stats(struct evl_base *evlb, struct evl_stats *st)
 {
-	evlw->evl_fn = fn;
+	*st = evlb->evlb_stats;
 }
 
 int
-evl_work_add(struct evl_work *evl, int fires)
+evl_hist_enable(struct evl_base *evlb, unsigned int which)
 {
-	SET(evl->evl_fires, fires);
+	struct evl_hist *evlh;
 
-	if (ISSET(evl->evl_event, EVL_FIRED))
+	if (which >= EVL_NHISTS) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (evlb->evlb_hists[which] != NULL)
 		return (0);
 
-	evlb_work_insert(evl->evl_base, evl);
+	evlh = evl_hist_alloc();
+	if (evlh == NULL)
+		return (-1);
 
-	return (1);
+	evlb->evlb_hists[which] = evlh;
+	return (0);
 }
 
-int
-evl_work_pending(const struct evl_work *evlw)
+void
+evl_hist_disable(struct evl_base *evlb, unsigned int which)
 {
-	return (ISSET(evlw->evl_event, EVL_FIRED) ? 1 : 0);
+	if (which >= EVL_NHISTS)
+		return;
+
+	evl_free(evlb->evlb_hists[which]);
+	evlb->evlb_hists[which] = NULL;
 }
 
-int
-evl_work_del(struct evl_work *evl)
+struct evl_hist *
+evl_hist(struct evl_base *evlb, unsigned int which)
 {
-	if (!ISSET(evl->evl_event, EVL_FIRED))
-		return (0);
-
-	evlb_work_remove(evl->evl_base, evl);
-	evl->evl_fires = 0;
+	if (which >= EVL_NHISTS)
+		return (NULL);
 
-	return (1);
+	return (evlb->evlb_hists[which]);
 }
 
 void
-evl_work_destroy(struct evl_work *evlw)
+evl_slow_hook(struct evl_base *evlb, uint64_t nsecs,
+    void (*fn)(void (*)(int, int, void *), int, int, uint64_t, void *),
+    void *arg)
 {
-	if (evlw == NULL)
-		return;
-
-	assert(!evl_work_pending(evlw));
+	evlb->evlb_slow_fn = fn;
+	evlb->evlb_slow_arg = arg;
+	evlb->evlb_slow_nsecs = nsecs;
+}
 
-	free(evlw);
+static inline uint64_t
+evl_nsecs(const struct timespec *ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec);
 }
 
-struct evl_io *
-evl_io_create(struct evl_base *evlb, int fd, int events,
-    void (*fn)(int, int, void *), void *arg)
+/*
+ * the end of one callback is the start of the next, so timing costs
+ * one clock read per callback. the first callback in a batch is timed
+ * from the clock read at the top of the loop.
+ */
+static uint64_t
+evl_callback_timed(struct evl_base *evlb, void (*fn)(int, int, void *),
+    int ident, int fires, uint64_t start)
 {
-	struct evl_io *evlio;
+	struct evl_hist *evlh = evlb->evlb_hists[EVL_HIST_CALLBACK];
+	struct timespec ts;
+	uint64_t end, nsecs;
 
-	assert(!ISSET(events, ~(EVL_READ|EVL_WRITE|EVL_PERSIST)) && events);
+	if (evl_monotime(evlb, &ts) == -1)
+		return (start);
 
-	evlio = malloc(sizeof(*evlio));
-	if (evlio == NULL)
-		return (NULL);
+	end = evl_nsecs(&ts);
+	nsecs = end - start;
 
-	evl_work_init(&evlio->evl_io_work, evlb, fd, events, fn, arg);
+	if (evlh != NULL)
+		evl_hist_record(evlh, nsecs);
+	if (evlb->evlb_slow_fn != NULL && nsecs > evlb->evlb_slow_nsecs) {
+		(*evlb->evlb_slow_fn)(fn, ident, fires, nsecs,
+		    evlb->evlb_slow_arg);
 
-	if (evl_op_io_create(evlb, evlio) == -1) {
-		free(evlio);
-		return (NULL);
-	};
+		/* don't charge the hook to the next callback */
+		if (evl_monotime(evlb, &ts) == 0)
+			end = evl_nsecs(&ts);
+	}
 
-	return (evlio);
+	return (end);
 }
 
-void
-evl_io_set(struct evl_io *evlio, void (*fn)(int, int, void *))
+static void
+evl_tmo_late(struct evl_base *evlb, const struct evl_tmo *evlt,
+    const struct evl_tmo *now)
 {
-	struct evl_work *evl = &evlio->evl_io_work;
+	struct timespec late;
 
-	evl_work_set(evl, fn);
+	timespecsub(&now->evl_tmo_deadline, &evlt->evl_tmo_deadline, &late);
+	evl_hist_record(evlb->evlb_hists[EVL_HIST_TMO_LATE], evl_nsecs(&late));
 }
 
-int
-evl_io_fd(const struct evl_io *evlio)
+/*
+ * loop lag is the time from the backend waking up to the last callback
+ * finishing. if the callbacks were timed the end is already known.
+ */
+static void
+evl_loop_lag(struct evl_base *evlb, const struct timespec *woke, uint64_t end)
 {
-	const struct evl_work *evl = &evlio->evl_io_work;
+	struct timespec ts;
 
-	return (evl->evl_ident);
+	if (end == 0) {
+		if (evl_monotime(evlb, &ts) == -1)
+			return;
+		end = evl_nsecs(&ts);
+	}
+
+	evl_hist_record(evlb->evlb_hists[EVL_HIST_LOOP_LAG],
+	    end - evl_nsecs(woke));
 }
 
-int
-evl_io_add(struct evl_io *evlio)
+static void
+evl_lag_probe_fire(int nil, int events, void *arg)
 {
-	struct evl_work *evl = &evlio->evl_io_work;
-	struct evl_base *evlb = evl->evl_base;
-
-	if (ISSET(evl->evl_event, EVL_PERSIST|EVL_FIRED) == EVL_FIRED)
-		return (0);
-
-	if (ISSET(evl->evl_event, EVL_PENDING))
-		return (0);
-
-	SET(evl->evl_event, EVL_PENDING);
-	evl_op_io_add(evlb, evlio);
+	struct evl_base *evlb = arg;
 
-	return (1);
+	evl_tmo_add(evlb->evlb_probe, &evlb->evlb_probe_ival);
 }
 
-void
-evl_io_fire(struct evl_io *evlio, int events)
+static void
+evl_lag_probe_stop(struct evl_base *evlb)
 {
-	struct evl_work *evl = &evlio->evl_io_work;
-	struct evl_base *evlb = evl->evl_base;
-
-	if (!ISSET(evl->evl_event, EVL_PERSIST) &&
-	    ISSET(events, EVL_PERSIST)) {
-		evl_op_io_del(evlb, evlio);
-		CLR(evl->evl_event, EVL_PENDING);
-	}
+	if (evlb->evlb_probe == NULL)
+		return;
 
-	evl_work_add(evl, ISSET(events, EVL_READ|EVL_WRITE));
+	evl_tmo_del(evlb->evlb_probe);
+	evl_tmo_destroy(evlb->evlb_probe);
+	evlb->evlb_probe = NULL;
 }
 
+/*
+ * a timeout that reschedules itself so there's always something
+ * measuring timeout lateness, even if the application has no timeouts
+ * of its own.
+ */
 int
-evl_io_del(struct evl_io *evlio)
+evl_lag_probe(struct evl_base *evlb, const struct timespec *ival)
 {
-	struct evl_work *evl = &evlio->evl_io_work;
-	struct evl_base *evlb = evl->evl_base;
-	int rv = 0;
+	if (ival == NULL) {
+		evl_lag_probe_stop(evlb);
+		return (0);
+	}
 
-	if (evl_work_del(evl))
-		rv = 1;
+	if (evl_hist_enable(evlb, EVL_HIST_TMO_LATE) == -1)
+		return (-1);
 
-	if (ISSET(evl->evl_event, EVL_PENDING)) {
-		evl_op_io_del(evlb, evlio);
-		CLR(evl->evl_event, EVL_PENDING);
-		rv = 1;
+	if (evlb->evlb_probe == NULL) {
+		evlb->evlb_probe = evl_tmo_create(evlb,
+		    evl_lag_probe_fire, evlb);
+		if (evlb->evlb_probe == NULL)
+			return (-1);
 	}
 
-	return (rv);
+	evlb->evlb_probe_ival = *ival;
+	evl_tmo_add(evlb->evlb_probe, ival);
+
+	return (0);
 }
 
-void
-evl_io_destroy(struct evl_io *evlio)
+const struct evl_ops *
+evl_base_ops(const struct evl_base *evlb)
 {
-	struct evl_base *evlb;
-
-	if (evlio == NULL)
-		return;
-
-	evlb = evl_io_base(evlio);
-
-	assert(!ISSET(evlio->evl_io_work.evl_event, EVL_PENDING|EVL_FIRED));
+	return (evlb->evlb_ops);
+}
 
-	evl_op_io_destroy(evlb, evlio);
+const char *
+evl_base_backend(const struct evl_base *evlb)
+{
+	return (evlb->evlb_ops->evlo_name);
+}
 
-	free(evlio);
+int
+evl_base_fd(struct evl_base *evlb)
+{
+	return ((*evlb->evlb_ops->evlo_fd)(evlb));
 }
 
-struct evl_tmo *
-evl_tmo_create(struct evl_base *evlb,
-    void (*fn)(int, int, void *), void *arg)
+/*
+ * how long an application running the loop from its own event loop can
+ * sleep on evl_base_fd before it has to call evl_loop with
+ * EVL_LOOP_NONBLOCK again.
+ */
+int
+evl_base_next_deadline(struct evl_base *evlb, struct timespec *ts)
 {
 	struct evl_tmo *evlt;
+	struct timespec now;
+
+	if (evlb_work_first(evlb) != NULL ||
+	    !TAILQ_EMPTY(&evlb->evlb_bufs.evlbs_dirty) ||
+#ifdef EVL_HAS_IO_URING
+	    evl_uring_pending(evlb->evlb_uring) ||
+#endif
+	    (*evlb->evlb_ops->evlo_pending)(evlb)) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = 0;
+		return (1);
+	}
 
-	evlt = malloc(sizeof(*evlt));
+	evlt = evlb_tmo_first(evlb);
 	if (evlt == NULL)
-		return (NULL);
+		return (0);
+
+	if (evl_monotime(evlb, &now) == -1)
+		return (-1);
 
-	evl_work_init(&evlt->evl_tmo_work, evlb, 0, 0, fn, arg);
+	if (timespeccmp(&evlt->evl_tmo_deadline, &now, <=)) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = 0;
+	} else
+		timespecsub(&evlt->evl_tmo_deadline, &now, ts);
 
-	return (evlt);
+	return (1);
 }
 
-int
-evl_tmo_add(struct evl_tmo *evlt, const struct timespec *offset)
+void
+evl_break(struct evl_base *evlb)
 {
-	struct evl_work *evl = &evlt->evl_tmo_work;
-	struct evl_base *evlb = evl->evl_base;
-	struct timespec now;
-	int rv = 0;
+	evlb->evlb_running = 0;
+}
 
-	if (evl_monotime(&now) == -1)
+void
+evl_destroy(struct evl_base *evlb)
+{
+	if (evlb == NULL)
+		return;
+
+	evl_base_fini(evlb);
+	evl_free(evlb);
+}
+
+static void
+evl_loop_flush(struct evl_base *evlb)
+{
+	evl_bufs_flush(&evlb->evlb_bufs);
+#ifdef EVL_HAS_IO_URING
+	evl_uring_flush(evlb->evlb_uring);
+#endif
+}
+
+int
+evl_dispatch(struct evl_base *evlb)
+{
+	return (evl_loop(evlb, 0));
+}
+
+int
+evl_loop(struct evl_base *evlb, int flags)
+{
+	static const struct timespec zero = { 0, 0 };
+	struct evl_stats *st = &evlb->evlb_stats;
+	struct evl_tmo now, *evlt;
+	struct evl_work *evl;
+	const struct timespec *ts;
+	void (*fn)(int, int, void *);
+	uint64_t start = 0;
+	uint64_t callbacks;
+	int ident, fires, timed;
+	int waited = 0;
+	int rv;
+
+	evlb->evlb_running = 1;
+	callbacks = st->evlst_callbacks;
+	for (;;) {
+		st->evlst_loops++;
+
+		if (evl_monotime(evlb, &now.evl_tmo_deadline) == -1)
+			return (-1);
+
+		while ((evlt = evlb_tmo_cextract(evlb, &now)) != NULL) {
+			EVL_PROBE2(tmo__fire, evlb, evlt);
+			if (evlb->evlb_hists[EVL_HIST_TMO_LATE] != NULL)
+				evl_tmo_late(evlb, evlt, &now);
+			CLR(evlt->evl_tmo_work.evl_event, EVL_PENDING);
+			evl_work_add(&evlt->evl_tmo_work, EVL_TIMEOUT);
+			st->evlst_tmo_fires++;
+			st->evlst_tmos--;
+		}
+
+		timed = evlb->evlb_hists[EVL_HIST_CALLBACK] != NULL ||
+		    evlb->evlb_slow_fn != NULL;
+		if (timed)
+			start = evl_nsecs(&now.evl_tmo_deadline);
+
+		while ((evl = evlb_work_first(evlb)) != NULL) {
+			evlb_work_remove(evlb, evl);
+			fires = evl->evl_fires;
+			evl->evl_fires = 0;
+
+			/* the callback may free evl */
+			fn = evl->evl_fn;
+			ident = evl->evl_ident;
+
+			st->evlst_callbacks++;
+			EVL_PROBE4(callback__start, evlb, fn, ident, fires);
+			(*fn)(ident, fires, evl->evl_arg);
+			EVL_PROBE3(callback__done, evlb, fn, ident);
+			if (timed) {
+				start = evl_callback_timed(evlb, fn, ident,
+				    fires, start);
+			}
+
+			if (!evlb->evlb_running) {
+				/* don't strand what the callbacks queued */
+				evl_loop_flush(evlb);
+				return (0);
+			}
+		}
+
+		if (evlb->evlb_hists[EVL_HIST_LOOP_LAG] != NULL) {
+			evl_loop_lag(evlb, &now.evl_tmo_deadline,
+			    timed ? start : 0);
+		}
+
+		/* write out everything queued by the callbacks at once */
+		evl_loop_flush(evlb);
+
+		if (ISSET(flags, EVL_LOOP_ONCE) &&
+		    st->evlst_callbacks != callbacks)
+			return (0);
+		if (ISSET(flags, EVL_LOOP_NONBLOCK) && waited)
+			return (0);
+
+		evlt = evlb_tmo_first(evlb);
+		if (ISSET(flags, EVL_LOOP_NONBLOCK))
+			ts = &zero;
+		else if (evlt != NULL) {
+			timespecsub(&evlt->evl_tmo_deadline,
+			    &now.evl_tmo_deadline, &now.evl_tmo_deadline);
+			ts = &now.evl_tmo_deadline;
+		} else
+			ts = NULL;
+
+		st->evlst_waits++;
+		EVL_PROBE2(dispatch__enter, evlb, ts);
+		rv = evl_op_dispatch(evlb, ts);
+		EVL_PROBE2(dispatch__return, evlb, rv);
+		if (rv == -1)
+			return (-1);
+		if (!evlb->evlb_running)
+			return (0);
+		waited = 1;
+	}
+
+	return (0);
+}
+
+static void
+evl_work_setup(struct evl_work *evlw, struct evl_base *evl,
+    int ident, int event, void (*fn)(int, int, void *), void *arg)
+{
+	evlw->evl_base = evl;
+	evlw->evl_fn = fn;
+	evlw->evl_arg = arg;
+	evlw->evl_ident = ident;
+	evlw->evl_event = event;
+	evlw->evl_fires = 0;
+	evlw->evl_handle = 0;
+}
+
+static uint64_t
+evl_handle_get(struct evl_work *evl, unsigned int type)
+{
+	struct evl_base *evlb = evl->evl_base;
+
+	/* most bases never hand out a handle */
+	if (evlb->evlb_handles == NULL) {
+		evlb->evlb_handles = evl_handles_create();
+		if (evlb->evlb_handles == NULL)
+			return (0);
+	}
+
+	return (evl_handles_get(evlb->evlb_handles, evl, type));
+}
+
+static struct evl_work *
+evl_handle_lookup(struct evl_base *evlb, uint64_t h, unsigned int type)
+{
+	if (evlb->evlb_handles == NULL)
+		return (NULL);
+
+	return (evl_handles_lookup(evlb->evlb_handles, h, type));
+}
+
+static void
+evl_handle_put(struct evl_work *evl)
+{
+	if (evl->evl_handle == 0)
+		return;
+
+	evl_handles_put(evl->evl_base->evlb_handles, evl);
+}
+
+struct evl_work *
+evl_work_create(struct evl_base *evlb, int ident,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_work *evl;
+
+	evl = evl_pool_get(&evlb->evlb_work_pool);
+	if (evl == NULL)
+		return (NULL);
+
+	evl_work_init(evl, evlb, ident, fn, arg);
+
+	return (evl);
+}
+
+void
+evl_work_init(struct evl_work *evl, struct evl_base *evlb, int ident,
+    void (*fn)(int, int, void *), void *arg)
+{
+	evl_work_setup(evl, evlb, ident, 0, fn, arg);
+}
+
+void
+evl_work_set(struct evl_work *evlw, void (*fn)(int, int, void *))
+{
+	evlw->evl_fn = fn;
+}
+
+void
+evl_work_set_arg(struct evl_work *evlw, void *arg)
+{
+	evlw->evl_arg = arg;
+}
+
+int
+evl_work_add(struct evl_work *evl, int fires)
+{
+	SET(evl->evl_fires, fires);
+
+	if (ISSET(evl->evl_event, EVL_FIRED))
+		return (0);
+
+	evlb_work_insert(evl->evl_base, evl);
+
+	return (1);
+}
+
+int
+evl_work_pending(const struct evl_work *evlw)
+{
+	return (ISSET(evlw->evl_event, EVL_FIRED) ? 1 : 0);
+}
+
+int
+evl_work_del(struct evl_work *evl)
+{
+	if (!ISSET(evl->evl_event, EVL_FIRED))
+		return (0);
+
+	evlb_work_remove(evl->evl_base, evl);
+	evl->evl_fires = 0;
+
+	return (1);
+}
+
+void
+evl_work_fini(struct evl_work *evlw)
+{
+	assert(!evl_work_pending(evlw));
+
+	evl_handle_put(evlw);
+}
+
+uint64_t
+evl_work_handle(struct evl_work *evlw)
+{
+	return (evl_handle_get(evlw, EVL_HANDLE_WORK));
+}
+
+struct evl_work *
+evl_work_lookup(struct evl_base *evlb, uint64_t h)
+{
+	return (evl_handle_lookup(evlb, h, EVL_HANDLE_WORK));
+}
+
+void
+evl_work_destroy(struct evl_work *evlw)
+{
+	if (evlw == NULL)
+		return;
+
+	evl_work_fini(evlw);
+	evl_pool_put(&evlw->evl_base->evlb_work_pool, evlw);
+}
+
+struct evl_io *
+evl_io_create(struct evl_base *evlb, int fd, int events,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_io *evlio;
+
+	evlio = evl_pool_get(&evlb->evlb_io_pool);
+	if (evlio == NULL)
+		return (NULL);
+
+	if (evl_io_init(evlio, evlb, fd, events, fn, arg) == -1) {
+		evl_pool_put(&evlb->evlb_io_pool, evlio);
+		return (NULL);
+	}
+
+	return (evlio);
+}
+
+#define EVL_FDS_MINLEN	64
+
+static struct evl_fd *
+evl_fd_get(struct evl_base *evlb, int fd, int events)
+{
+	struct evl_fd *evlfd, **evlfds;
+	unsigned int len;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return (NULL);
+	}
+
+	if ((unsigned int)fd >= evlb->evlb_fdslen) {
+		len = evlb->evlb_fdslen * 2;
+		if (len < EVL_FDS_MINLEN)
+			len = EVL_FDS_MINLEN;
+		if (len <= (unsigned int)fd)
+			len = fd + 1;
+
+		evlfds = evl_reallocarray(evlb->evlb_fds, len,
+		    sizeof(*evlfds));
+		if (evlfds == NULL)
+			return (NULL);
+
+		memset(evlfds + evlb->evlb_fdslen, 0,
+		    (len - evlb->evlb_fdslen) * sizeof(*evlfds));
+		evlb->evlb_fds = evlfds;
+		evlb->evlb_fdslen = len;
+	}
+
+	evlfd = evlb->evlb_fds[fd];
+	if (evlfd != NULL)
+		return (evlfd);
+
+	evlfd = evl_pool_get(&evlb->evlb_fd_pool);
+	if (evlfd == NULL)
+		return (NULL);
+
+	/* the backend can reserve what it needs for these events */
+	evl_work_setup(&evlfd->evlfd_io.evl_io_work, evlb, fd, events,
+	    NULL, NULL);
+	evlfd->evlfd_io.evl_io_mux = evlfd;
+	if (evl_op_io_create(evlb, &evlfd->evlfd_io) == -1) {
+		evl_pool_put(&evlb->evlb_fd_pool, evlfd);
+		return (NULL);
+	}
+
+	TAILQ_INIT(&evlfd->evlfd_ios);
+	TAILQ_INSERT_TAIL(&evlb->evlb_ios, &evlfd->evlfd_io, evl_io_entry);
+	evlb->evlb_fds[fd] = evlfd;
+
+	return (evlfd);
+}
+
+static void
+evl_fd_put(struct evl_base *evlb, struct evl_fd *evlfd)
+{
+	struct evl_io *evlio = &evlfd->evlfd_io;
+
+	assert(!ISSET(evlio->evl_io_work.evl_event, EVL_PENDING));
+
+	/* unless evl_reinit could not give it to the new backend */
+	if (evlio->evl_io_entry.tqe_prev != NULL) {
+		TAILQ_REMOVE(&evlb->evlb_ios, evlio, evl_io_entry);
+		evl_op_io_destroy(evlb, evlio);
+	}
+
+	evlb->evlb_fds[evlio->evl_io_work.evl_ident] = NULL;
+	evl_pool_put(&evlb->evlb_fd_pool, evlfd);
+}
+
+/* give the backend the events that the added evl_ios want */
+static void
+evl_fd_sync(struct evl_base *evlb, struct evl_fd *evlfd)
+{
+	struct evl_io *evlio = &evlfd->evlfd_io;
+	struct evl_work *evl = &evlio->evl_io_work;
+	struct evl_io *w;
+	int events = 0;
+	int persist = 0;
+
+	TAILQ_FOREACH(w, &evlfd->evlfd_ios, evl_io_entry) {
+		if (!ISSET(w->evl_io_work.evl_event, EVL_PENDING))
+			continue;
+
+		SET(events, ISSET(w->evl_io_work.evl_event, EVL_RW));
+		SET(persist, ISSET(w->evl_io_work.evl_event, EVL_PERSIST));
+	}
+
+	if (events == 0) {
+		if (ISSET(evl->evl_event, EVL_PENDING)) {
+			evl_op_io_del(evlb, evlio);
+			CLR(evl->evl_event, EVL_PENDING);
+		}
+		return;
+	}
+
+	SET(events, persist);
+	if (ISSET(evl->evl_event, EVL_RW|EVL_PERSIST) != events) {
+		evl_op_io_modify(evlb, evlio, events);
+		CLR(evl->evl_event, EVL_RW|EVL_PERSIST);
+		SET(evl->evl_event, events);
+	}
+
+	if (!ISSET(evl->evl_event, EVL_PENDING)) {
+		/* evl_reinit could not give this fd to the new backend */
+		assert(evlio->evl_io_entry.tqe_prev != NULL);
+
+		SET(evl->evl_event, EVL_PENDING);
+		evl_op_io_add(evlb, evlio);
+	}
+}
+
+int
+evl_io_init(struct evl_io *evlio, struct evl_base *evlb, int fd, int events,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_fd *evlfd;
+
+	assert(!ISSET(events, ~(EVL_READ|EVL_WRITE|EVL_PERSIST)) && events);
+
+	evl_work_setup(&evlio->evl_io_work, evlb, fd, events, fn, arg);
+
+	evlfd = evl_fd_get(evlb, fd, events);
+	if (evlfd == NULL)
+		return (-1);
+
+	evlio->evl_io_mux = evlfd;
+	TAILQ_INSERT_TAIL(&evlfd->evlfd_ios, evlio, evl_io_entry);
+	evlb->evlb_stats.evlst_ios++;
+
+	return (0);
+}
+
+void
+evl_io_set(struct evl_io *evlio, void (*fn)(int, int, void *))
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+
+	evl_work_set(evl, fn);
+}
+
+void
+evl_io_set_arg(struct evl_io *evlio, void *arg)
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+
+	evl_work_set_arg(evl, arg);
+}
+
+void
+evl_io_modify(struct evl_io *evlio, int events)
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+
+	assert(!ISSET(events, ~(EVL_READ|EVL_WRITE|EVL_PERSIST)) && events);
+
+	if (ISSET(evl->evl_event, EVL_READ|EVL_WRITE|EVL_PERSIST) == events)
+		return;
+
+	CLR(evl->evl_event, EVL_READ|EVL_WRITE|EVL_PERSIST);
+	SET(evl->evl_event, events);
+
+	if (ISSET(evl->evl_event, EVL_PENDING))
+		evl_fd_sync(evl->evl_base, evlio->evl_io_mux);
+}
+
+int
+evl_io_fd(const struct evl_io *evlio)
+{
+	const struct evl_work *evl = &evlio->evl_io_work;
+
+	return (evl->evl_ident);
+}
+
+int
+evl_io_add(struct evl_io *evlio)
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+	struct evl_base *evlb = evl->evl_base;
+
+	if (ISSET(evl->evl_event, EVL_PERSIST|EVL_FIRED) == EVL_FIRED)
+		return (0);
+
+	if (ISSET(evl->evl_event, EVL_PENDING))
+		return (0);
+
+	SET(evl->evl_event, EVL_PENDING);
+	evl_fd_sync(evlb, evlio->evl_io_mux);
+	evlb->evlb_stats.evlst_io_adds++;
+	EVL_PROBE3(io__add, evlb, evl->evl_ident, evl->evl_event);
+
+	return (1);
+}
+
+/*
+ * backends call this with the evl_io in the evl_fd. EVL_PERSIST in
+ * events means the backend has left the registration in place.
+ */
+void
+evl_io_fire(struct evl_io *evlio, int events)
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+	struct evl_base *evlb = evl->evl_base;
+	struct evl_fd *evlfd = evlio->evl_io_mux;
+	struct evl_io *w;
+	int sync = 0;
+
+	EVL_PROBE3(io__fire, evlb, evl->evl_ident, events);
+
+	/*
+	 * a backend without EVL_PERSIST has taken the registration away.
+	 * otherwise evl_fd_sync works out if it is still needed.
+	 */
+	if (!ISSET(evl->evl_event, EVL_PERSIST)) {
+		if (!ISSET(events, EVL_PERSIST))
+			CLR(evl->evl_event, EVL_PENDING);
+		sync = 1;
+	}
+
+	events = ISSET(events, EVL_READ|EVL_WRITE);
+	TAILQ_FOREACH(w, &evlfd->evlfd_ios, evl_io_entry) {
+		evl = &w->evl_io_work;
+		if (!ISSET(evl->evl_event, EVL_PENDING) ||
+		    !ISSET(evl->evl_event, events))
+			continue;
+
+		if (!ISSET(evl->evl_event, EVL_PERSIST)) {
+			CLR(evl->evl_event, EVL_PENDING);
+			sync = 1;
+		}
+
+		/* only report what this evl_io asked for */
+		evl_work_add(evl, ISSET(evl->evl_event, events));
+	}
+
+	/* other evl_ios on the fd may still want events */
+	if (sync)
+		evl_fd_sync(evlb, evlfd);
+}
+
+int
+evl_io_del(struct evl_io *evlio)
+{
+	struct evl_work *evl = &evlio->evl_io_work;
+	struct evl_base *evlb = evl->evl_base;
+	int rv = 0;
+
+	if (evl_work_del(evl))
+		rv = 1;
+
+	if (ISSET(evl->evl_event, EVL_PENDING)) {
+		CLR(evl->evl_event, EVL_PENDING);
+		evl_fd_sync(evlb, evlio->evl_io_mux);
+		evlb->evlb_stats.evlst_io_dels++;
+		EVL_PROBE2(io__del, evlb, evl->evl_ident);
+		rv = 1;
+	}
+
+	return (rv);
+}
+
+void
+evl_io_fini(struct evl_io *evlio)
+{
+	struct evl_base *evlb = evl_io_base(evlio);
+	struct evl_fd *evlfd = evlio->evl_io_mux;
+
+	assert(!ISSET(evlio->evl_io_work.evl_event, EVL_PENDING|EVL_FIRED));
+
+	evl_handle_put(&evlio->evl_io_work);
+	TAILQ_REMOVE(&evlfd->evlfd_ios, evlio, evl_io_entry);
+	if (TAILQ_EMPTY(&evlfd->evlfd_ios))
+		evl_fd_put(evlb, evlfd);
+	evlb->evlb_stats.evlst_ios--;
+}
+
+uint64_t
+evl_io_handle(struct evl_io *evlio)
+{
+	return (evl_handle_get(&evlio->evl_io_work, EVL_HANDLE_IO));
+}
+
+struct evl_io *
+evl_io_lookup(struct evl_base *evlb, uint64_t h)
+{
+	struct evl_work *evl;
+
+	evl = evl_handle_lookup(evlb, h, EVL_HANDLE_IO);
+	if (evl == NULL)
+		return (NULL);
+
+	return ((struct evl_io *)evl);
+}
+
+void
+evl_io_destroy(struct evl_io *evlio)
+{
+	struct evl_base *evlb;
+
+	if (evlio == NULL)
+		return;
+
+	evlb = evl_io_base(evlio);
+
+	evl_io_fini(evlio);
+	evl_pool_put(&evlb->evlb_io_pool, evlio);
+}
+
+struct evl_tmo *
+evl_tmo_create(struct evl_base *evlb,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_tmo *evlt;
+
+	evlt = evl_pool_get(&evlb->evlb_tmo_pool);
+	if (evlt == NULL)
+		return (NULL);
+
+	evl_tmo_init(evlt, evlb, fn, arg);
+
+	return (evlt);
+}
+
+void
+evl_tmo_init(struct evl_tmo *evlt, struct evl_base *evlb,
+    void (*fn)(int, int, void *), void *arg)
+{
+	evl_work_setup(&evlt->evl_tmo_work, evlb, 0, 0, fn, arg);
+}
+
+void
+evl_tmo_set(struct evl_tmo *evlt, void (*fn)(int, int, void *))
+{
+	evl_work_set(&evlt->evl_tmo_work, fn);
+}
+
+void
+evl_tmo_set_arg(struct evl_tmo *evlt, void *arg)
+{
+	evl_work_set_arg(&evlt->evl_tmo_work, arg);
+}
+
+int
+evl_tmo_add(struct evl_tmo *evlt, const struct timespec *offset)
+{
+	struct evl_work *evl = &evlt->evl_tmo_work;
+	struct evl_base *evlb = evl->evl_base;
+	struct timespec now;
+	int rv = 0;
+
+	if (evl_monotime(evlb, &now) == -1)
 		return (-1);
 
 	if (evl_work_del(evl))
-		;
+		evlb->evlb_stats.evlst_tmos++;
 	else if (ISSET(evl->evl_event, EVL_PENDING))
 		evlb_tmo_remove(evlb, evlt);
 	else {
 		SET(evl->evl_event, EVL_PENDING);
+		evlb->evlb_stats.evlst_tmos++;
 		rv = 1;
 	}
 
 	evlb_tmo_insert(evlb, evlt, &now, offset);
+	evlb->evlb_stats.evlst_tmo_adds++;
 
 	return (rv);
 }
@@ -412,6 +1357,7 @@ int
 evl_tmo_pending(const struct evl_tmo *evlt, struct timespec *ts)
 {
 	const struct evl_work *evl = &evlt->evl_tmo_work;
+	struct evl_base *evlb = evl->evl_base;
 	struct timespec now;
 	int rv = 0;
 
@@ -424,10 +1370,10 @@ evl_tmo_pending(const struct evl_tmo *evlt, struct timespec *ts)
 		rv = 1;
 	} else if (ISSET(evl->evl_event, EVL_PENDING)) {
 		if (ts != NULL) {
-			if (evl_monotime(&now) == -1)
+			if (evl_monotime(evlb, &now) == -1)
 				return (-1);
 
-			timespecsub(&now, &evlt->evl_tmo_deadline, ts);
+			timespecsub(&evlt->evl_tmo_deadline, &now, ts);
 		}
 
 		rv = 1;
@@ -448,16 +1394,276 @@ evl_tmo_del(struct evl_tmo *evlt)
 	else if (ISSET(evl->evl_event, EVL_PENDING)) {
 		CLR(evl->evl_event, EVL_PENDING);
 		evlb_tmo_remove(evlb, evlt);
+		evlb->evlb_stats.evlst_tmos--;
 		rv = 1;
 	}
 
+	if (rv)
+		evlb->evlb_stats.evlst_tmo_dels++;
+
 	return (rv);
 }
 
+void
+evl_tmo_fini(struct evl_tmo *evlt)
+{
+	assert(!ISSET(evlt->evl_tmo_work.evl_event, EVL_PENDING|EVL_FIRED));
+
+	evl_handle_put(&evlt->evl_tmo_work);
+}
+
+uint64_t
+evl_tmo_handle(struct evl_tmo *evlt)
+{
+	return (evl_handle_get(&evlt->evl_tmo_work, EVL_HANDLE_TMO));
+}
+
+struct evl_tmo *
+evl_tmo_lookup(struct evl_base *evlb, uint64_t h)
+{
+	struct evl_work *evl;
+
+	evl = evl_handle_lookup(evlb, h, EVL_HANDLE_TMO);
+	if (evl == NULL)
+		return (NULL);
+
+	return ((struct evl_tmo *)evl);
+}
+
 void
 evl_tmo_destroy(struct evl_tmo *evlt)
 {
-	free(evlt);
+	if (evlt == NULL)
+		return;
+
+	evl_tmo_fini(evlt);
+	evl_pool_put(&evl_tmo_base(evlt)->evlb_tmo_pool, evlt);
+}
+
+struct evl_sig *
+evl_sig_create(struct evl_base *evlb, int signo,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_sig *evls;
+
+	evls = evl_pool_get(&evlb->evlb_sig_pool);
+	if (evls == NULL)
+		return (NULL);
+
+	evl_work_setup(&evls->evl_sig_work, evlb, signo, 0, fn, arg);
+
+	if (evl_op_sig_create(evlb, evls) == -1) {
+		evl_pool_put(&evlb->evlb_sig_pool, evls);
+		return (NULL);
+	}
+
+	TAILQ_INSERT_TAIL(&evlb->evlb_sigs, evls, evl_sig_entry);
+
+	return (evls);
+}
+
+void
+evl_sig_set(struct evl_sig *evls, void (*fn)(int, int, void *))
+{
+	evl_work_set(&evls->evl_sig_work, fn);
+}
+
+void
+evl_sig_set_arg(struct evl_sig *evls, void *arg)
+{
+	evl_work_set_arg(&evls->evl_sig_work, arg);
+}
+
+int
+evl_sig_add(struct evl_sig *evls)
+{
+	struct evl_work *evl = &evls->evl_sig_work;
+	struct evl_base *evlb = evl->evl_base;
+
+	if (ISSET(evl->evl_event, EVL_PENDING))
+		return (0);
+
+	assert(evls->evl_sig_entry.tqe_prev != NULL);
+
+	SET(evl->evl_event, EVL_PENDING);
+	evl_op_sig_add(evlb, evls);
+
+	return (1);
+}
+
+int
+evl_sig_pending(const struct evl_sig *evls)
+{
+	return (ISSET(evls->evl_sig_work.evl_event, EVL_PENDING) ? 1 : 0);
+}
+
+void
+evl_sig_fire(struct evl_sig *evls, unsigned int n)
+{
+	struct evl_work *evl = &evls->evl_sig_work;
+	unsigned int count;
+
+	/* coalesce deliveries until the callback runs */
+	count = ISSET(evl->evl_fires, EVL_COUNT_MASK) + n;
+	if (count > EVL_COUNT_MASK)
+		count = EVL_COUNT_MASK;
+
+	CLR(evl->evl_fires, EVL_COUNT_MASK);
+	evl_work_add(evl, EVL_SIGNAL | count);
+}
+
+int
+evl_sig_del(struct evl_sig *evls)
+{
+	struct evl_work *evl = &evls->evl_sig_work;
+	struct evl_base *evlb = evl->evl_base;
+	int rv = 0;
+
+	if (evl_work_del(evl))
+		rv = 1;
+
+	if (ISSET(evl->evl_event, EVL_PENDING)) {
+		evl_op_sig_del(evlb, evls);
+		CLR(evl->evl_event, EVL_PENDING);
+		rv = 1;
+	}
+
+	return (rv);
+}
+
+void
+evl_sig_destroy(struct evl_sig *evls)
+{
+	struct evl_base *evlb;
+
+	if (evls == NULL)
+		return;
+
+	evlb = evl_sig_base(evls);
+
+	assert(!ISSET(evls->evl_sig_work.evl_event, EVL_PENDING|EVL_FIRED));
+
+	if (evls->evl_sig_entry.tqe_prev != NULL) {
+		TAILQ_REMOVE(&evlb->evlb_sigs, evls, evl_sig_entry);
+		evl_op_sig_destroy(evlb, evls);
+	}
+	evl_pool_put(&evlb->evlb_sig_pool, evls);
+}
+
+struct evl_wait *
+evl_wait_create(struct evl_base *evlb, int pid,
+    void (*fn)(int, int, void *), void *arg)
+{
+	struct evl_wait *evlw;
+
+	evlw = evl_pool_get(&evlb->evlb_wait_pool);
+	if (evlw == NULL)
+		return (NULL);
+
+	evl_work_setup(&evlw->evl_wait_work, evlb, pid, 0, fn, arg);
+	evlw->evl_wait_backend = NULL;
+	evlw->evl_wait_status = 0;
+	evlw->evl_wait_exited = 0;
+
+	if (evl_op_wait_create(evlb, evlw) == -1) {
+		evl_pool_put(&evlb->evlb_wait_pool, evlw);
+		return (NULL);
+	}
+
+	return (evlw);
+}
+
+void
+evl_wait_set(struct evl_wait *evlw, void (*fn)(int, int, void *))
+{
+	evl_work_set(&evlw->evl_wait_work, fn);
+}
+
+void
+evl_wait_set_arg(struct evl_wait *evlw, void *arg)
+{
+	evl_work_set_arg(&evlw->evl_wait_work, arg);
+}
+
+/*
+ * the backend watches for the process exit for the whole life of the
+ * evl_wait, so adding and deleting only has to track whether the
+ * exit should be reported.
+ */
+int
+evl_wait_add(struct evl_wait *evlw)
+{
+	struct evl_work *evl = &evlw->evl_wait_work;
+
+	if (ISSET(evl->evl_event, EVL_PENDING|EVL_FIRED))
+		return (0);
+
+	if (evlw->evl_wait_exited)
+		evl_work_add(evl, EVL_WAIT);
+	else
+		SET(evl->evl_event, EVL_PENDING);
+
+	return (1);
+}
+
+int
+evl_wait_pending(const struct evl_wait *evlw)
+{
+	return (ISSET(evlw->evl_wait_work.evl_event,
+	    EVL_PENDING|EVL_FIRED) ? 1 : 0);
+}
+
+int
+evl_wait_status(const struct evl_wait *evlw)
+{
+	return (evlw->evl_wait_status);
+}
+
+void
+evl_wait_fire(struct evl_wait *evlw, int status)
+{
+	struct evl_work *evl = &evlw->evl_wait_work;
+
+	evlw->evl_wait_status = status;
+	evlw->evl_wait_exited = 1;
+
+	if (ISSET(evl->evl_event, EVL_PENDING)) {
+		CLR(evl->evl_event, EVL_PENDING);
+		evl_work_add(evl, EVL_WAIT);
+	}
+}
+
+int
+evl_wait_del(struct evl_wait *evlw)
+{
+	struct evl_work *evl = &evlw->evl_wait_work;
+	int rv = 0;
+
+	if (evl_work_del(evl))
+		rv = 1;
+
+	if (ISSET(evl->evl_event, EVL_PENDING)) {
+		CLR(evl->evl_event, EVL_PENDING);
+		rv = 1;
+	}
+
+	return (rv);
+}
+
+void
+evl_wait_destroy(struct evl_wait *evlw)
+{
+	struct evl_base *evlb;
+
+	if (evlw == NULL)
+		return;
+
+	evlb = evl_wait_base(evlw);
+
+	assert(!ISSET(evlw->evl_wait_work.evl_event, EVL_PENDING|EVL_FIRED));
+
+	evl_op_wait_destroy(evlb, evlw);
+	evl_pool_put(&evlb->evlb_wait_pool, evlw);
 }
 
 void *
@@ -466,6 +1672,67 @@ evl_backend(const struct evl_base *evlb)
 	return (evlb->evlb_backend);
 }
 
+struct evl_pools *
+evl_base_pools(struct evl_base *evlb)
+{
+	return (&evlb->evlb_pools);
+}
+
+struct evl_bufs *
+evl_base_bufs(struct evl_base *evlb)
+{
+	return (&evlb->evlb_bufs);
+}
+
+struct evl_dense *
+evl_base_dense(struct evl_base *evlb)
+{
+	if (evlb->evlb_dense == NULL)
+		evlb->evlb_dense = evl_dense_alloc(evlb);
+
+	return (evlb->evlb_dense);
+}
+
+int
+evl_base_now(struct evl_base *evlb, struct timespec *ts)
+{
+	return (evl_monotime(evlb, ts));
+}
+
+int
+evl_base_running(const struct evl_base *evlb)
+{
+	return (evlb->evlb_running);
+}
+
+struct evl_cos *
+evl_base_cos(struct evl_base *evlb)
+{
+	/* most bases never run a coroutine */
+	if (evlb->evlb_cos == NULL)
+		evlb->evlb_cos = evl_cos_create();
+
+	return (evlb->evlb_cos);
+}
+
+#ifdef EVL_HAS_IO_URING
+struct evl_uring *
+evl_base_uring(struct evl_base *evlb)
+{
+	/* most bases never submit an operation */
+	if (evlb->evlb_uring == NULL)
+		evlb->evlb_uring = evl_uring_create(evlb);
+
+	return (evlb->evlb_uring);
+}
+#endif
+
+struct evl_stats *
+evl_base_stats(struct evl_base *evlb)
+{
+	return (&evlb->evlb_stats);
+}
+
 static inline int
 evl_tmo_compare(const struct evl_tmo *a, const struct evl_tmo *b)
 {
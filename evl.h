@@ -17,75 +17,324 @@
 #ifndef _LIB_EVL_H_
 #define _LIB_EVL_H_
 
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+
 struct timespec;
 
 struct evl_base;
 struct evl_io;
 struct evl_tmo;
-#ifdef notyet
 struct evl_sig;
 struct evl_wait;
-#endif
 struct evl_work;
+struct evl_rbuf;
+struct evl_wbuf;
+struct evl_udp;
+struct evl_listener;
+struct evl_transfer;
+struct evl_aio;
+struct evl_aio_bufs;
+struct evl_co;
+struct evl_hist;
+struct iovec;
+
+/*
+ * the following sizes and alignment allow the event structures to be
+ * embedded in caller provided storage while keeping their contents
+ * private to the library. the structures hold 64 bit counters and
+ * timespecs as well as pointers, so the sizes are in bytes rather
+ * than pointers, with room to grow on LP64.
+ */
+#define EVL_ALIGN		8
+#define EVL_BASE_SIZE		2048
+#define EVL_WORK_SIZE		80
+#define EVL_IO_SIZE		128
+#define EVL_TMO_SIZE		128
+
+struct evl_pool_stats {
+	const char	*evlps_name;
+	size_t		 evlps_size;	/* bytes per item */
+	unsigned int	 evlps_pages;	/* pages allocated to the pool */
+	unsigned int	 evlps_items;	/* items available in those pages */
+	unsigned int	 evlps_inuse;	/* items currently allocated */
+	unsigned int	 evlps_hiwat;	/* most items allocated at once */
+};
+
+struct evl_stats {
+	uint64_t	 evlst_loops;	/* iterations of the loop */
+	uint64_t	 evlst_waits;	/* calls into the backend to wait */
+	uint64_t	 evlst_events;	/* events reported by the backend */
+	uint64_t	 evlst_updates;	/* interest changes for the kernel */
+	uint64_t	 evlst_callbacks; /* callbacks run */
+	uint64_t	 evlst_io_adds;
+	uint64_t	 evlst_io_dels;
+	uint64_t	 evlst_tmo_adds;
+	uint64_t	 evlst_tmo_dels;
+	uint64_t	 evlst_tmo_fires;
+	unsigned int	 evlst_ios;	/* evl_io structures in the base */
+	unsigned int	 evlst_tmos;	/* timeouts currently scheduled */
+};
+
+struct evl_hist_bucket {
+	uint64_t	 evlhb_lo;	/* smallest value in the bucket */
+	uint64_t	 evlhb_hi;	/* largest value in the bucket */
+	uint64_t	 evlhb_count;
+};
+
+#define EVL_HIST_CALLBACK	0	/* nsecs spent in each callback */
+#define EVL_HIST_TMO_LATE	1	/* nsecs timeouts fired late by */
+#define EVL_HIST_LOOP_LAG	2	/* nsecs from wakeup to idle */
+
+__BEGIN_DECLS
+int			 evl_set_allocator(void *(*)(size_t),
+			     void *(*)(void *, size_t), void (*)(void *));
 
 struct evl_base		*evl_init(void);
+struct evl_base		*evl_init_backend(const char *);
+int			 evl_base_init(struct evl_base *);
+int			 evl_base_init_backend(struct evl_base *, const char *);
+const char		*evl_base_backend(const struct evl_base *);
+int			 evl_base_fd(struct evl_base *);
+int			 evl_base_next_deadline(struct evl_base *,
+			     struct timespec *);
+const char		*evl_backend_name(unsigned int);
+void			 evl_set_clock(struct evl_base *,
+			     int (*)(void *, struct timespec *), void *);
+void			 evl_base_fini(struct evl_base *);
+void			 evl_destroy(struct evl_base *);
+int			 evl_reinit(struct evl_base *);
 int			 evl_dispatch(struct evl_base *);
+int			 evl_loop(struct evl_base *, int);
 void			 evl_break(struct evl_base *);
+int			 evl_arena(struct evl_base *, size_t);
+int			 evl_pool_stats(struct evl_base *, unsigned int,
+			     struct evl_pool_stats *);
+void			 evl_stats(struct evl_base *, struct evl_stats *);
+
+int			 evl_hist_enable(struct evl_base *, unsigned int);
+void			 evl_hist_disable(struct evl_base *, unsigned int);
+struct evl_hist		*evl_hist(struct evl_base *, unsigned int);
+void			 evl_hist_reset(struct evl_hist *);
+uint64_t		 evl_hist_count(const struct evl_hist *);
+uint64_t		 evl_hist_min(const struct evl_hist *);
+uint64_t		 evl_hist_max(const struct evl_hist *);
+uint64_t		 evl_hist_mean(const struct evl_hist *);
+uint64_t		 evl_hist_quantile(const struct evl_hist *, double);
+int			 evl_hist_bucket(const struct evl_hist *, unsigned int,
+			     struct evl_hist_bucket *);
+int			 evl_lag_probe(struct evl_base *,
+			     const struct timespec *);
+void			 evl_slow_hook(struct evl_base *, uint64_t,
+			     void (*)(void (*)(int, int, void *), int, int,
+			     uint64_t, void *), void *);
+
+int			 evl_sim_ready(struct evl_base *, int, int);
+int			 evl_sim_signal(struct evl_base *, int);
+int			 evl_sim_advance(struct evl_base *,
+			     const struct timespec *);
 
 struct evl_io		*evl_io_create(struct evl_base *, int, int,
 			     void (*)(int, int, void *), void *);
+int			 evl_io_init(struct evl_io *, struct evl_base *,
+			     int, int, void (*)(int, int, void *), void *);
 void			 evl_io_set(struct evl_io *,
 			     void (*)(int, int, void *));
+void			 evl_io_set_arg(struct evl_io *, void *);
+void			 evl_io_modify(struct evl_io *, int);
 int			 evl_io_fd(const struct evl_io *);
 int			 evl_io_add(struct evl_io *);
 int			 evl_io_pending(const struct evl_io *);
 int			 evl_io_del(struct evl_io *);
+void			 evl_io_fini(struct evl_io *);
 void			 evl_io_destroy(struct evl_io *);
+uint64_t		 evl_io_handle(struct evl_io *);
+struct evl_io		*evl_io_lookup(struct evl_base *, uint64_t);
 
 struct evl_tmo		*evl_tmo_create(struct evl_base *,
 			     void (*)(int, int, void *), void *);
+void			 evl_tmo_init(struct evl_tmo *, struct evl_base *,
+			     void (*)(int, int, void *), void *);
 void			 evl_tmo_set(struct evl_tmo *,
 			     void (*)(int, int, void *));
+void			 evl_tmo_set_arg(struct evl_tmo *, void *);
 int			 evl_tmo_add(struct evl_tmo *, const struct timespec *);
 int			 evl_tmo_pending(const struct evl_tmo *,
 			     struct timespec *);
 int			 evl_tmo_del(struct evl_tmo *);
+void			 evl_tmo_fini(struct evl_tmo *);
 void			 evl_tmo_destroy(struct evl_tmo *);
+uint64_t		 evl_tmo_handle(struct evl_tmo *);
+struct evl_tmo		*evl_tmo_lookup(struct evl_base *, uint64_t);
 
-#ifdef notyet
 struct evl_sig		*evl_sig_create(struct evl_base *, int,
 			     void (*)(int, int, void *), void *);
 void			 evl_sig_set(struct evl_sig *,
 			     void (*)(int, int, void *));
+void			 evl_sig_set_arg(struct evl_sig *, void *);
 int			 evl_sig_add(struct evl_sig *);
+int			 evl_sig_pending(const struct evl_sig *);
 int			 evl_sig_del(struct evl_sig *);
 void			 evl_sig_destroy(struct evl_sig *);
 
-struct evl_wait		*evl_wait_create(struct evl_base *, int);
-int			 evl_wait_set(struct evl_wait *,
+struct evl_wait		*evl_wait_create(struct evl_base *, int,
 			     void (*)(int, int, void *), void *);
+void			 evl_wait_set(struct evl_wait *,
+			     void (*)(int, int, void *));
+void			 evl_wait_set_arg(struct evl_wait *, void *);
 int			 evl_wait_add(struct evl_wait *);
+int			 evl_wait_pending(const struct evl_wait *);
+int			 evl_wait_status(const struct evl_wait *);
 int			 evl_wait_del(struct evl_wait *);
 void			 evl_wait_destroy(struct evl_wait *);
-#endif
 
 struct evl_work		*evl_work_create(struct evl_base *, int,
 			     void (*)(int, int, void *), void *);
+void			 evl_work_init(struct evl_work *, struct evl_base *,
+			     int, void (*)(int, int, void *), void *);
 void			 evl_work_set(struct evl_work *,
 			     void (*)(int, int, void *));
+void			 evl_work_set_arg(struct evl_work *, void *);
 int			 evl_work_add(struct evl_work *, int);
 int			 evl_work_pending(const struct evl_work *);
 int			 evl_work_del(struct evl_work *);
+void			 evl_work_fini(struct evl_work *);
 void			 evl_work_destroy(struct evl_work *);
+uint64_t		 evl_work_handle(struct evl_work *);
+struct evl_work		*evl_work_lookup(struct evl_base *, uint64_t);
+
+uint64_t		 evl_dense_create(struct evl_base *, int,
+			     void (*)(int, int, void *), void *);
+int			 evl_dense_set(struct evl_base *, uint64_t,
+			     void (*)(int, int, void *));
+int			 evl_dense_set_arg(struct evl_base *, uint64_t,
+			     void *);
+int			 evl_dense_add(struct evl_base *, uint64_t,
+			     const struct timespec *);
+int			 evl_dense_fire(struct evl_base *, uint64_t, int);
+int			 evl_dense_pending(struct evl_base *, uint64_t);
+int			 evl_dense_del(struct evl_base *, uint64_t);
+int			 evl_dense_destroy(struct evl_base *, uint64_t);
+
+struct evl_rbuf		*evl_rbuf_create(struct evl_io *);
+ssize_t			 evl_rbuf_read(struct evl_rbuf *);
+size_t			 evl_rbuf_len(const struct evl_rbuf *);
+int			 evl_rbuf_peek(const struct evl_rbuf *,
+			     struct iovec *, int);
+void			*evl_rbuf_pullup(struct evl_rbuf *, size_t);
+size_t			 evl_rbuf_copyout(const struct evl_rbuf *,
+			     void *, size_t);
+void			 evl_rbuf_drain(struct evl_rbuf *, size_t);
+void			 evl_rbuf_destroy(struct evl_rbuf *);
+
+struct evl_wbuf		*evl_wbuf_create(struct evl_io *);
+int			 evl_wbuf_append(struct evl_wbuf *,
+			     const void *, size_t);
+int			 evl_wbuf_appendv(struct evl_wbuf *,
+			     const struct iovec *, int);
+size_t			 evl_wbuf_len(const struct evl_wbuf *);
+int			 evl_wbuf_flush(struct evl_wbuf *);
+void			 evl_wbuf_destroy(struct evl_wbuf *);
+
+struct evl_dgram {
+	void			*evld_buf;
+	size_t			 evld_len;
+	const struct sockaddr	*evld_addr;
+	socklen_t		 evld_addrlen;
+	unsigned int		 evld_segsize;	/* UDP_GRO segment size */
+	int			 evld_flags;	/* recvmsg flags */
+};
+
+struct evl_udp		*evl_udp_create(struct evl_base *, int,
+			     unsigned int, size_t, int,
+			     void (*)(int, int, void *), void *);
+int			 evl_udp_flags(const struct evl_udp *);
+int			 evl_udp_add(struct evl_udp *);
+int			 evl_udp_del(struct evl_udp *);
+const struct evl_dgram	*evl_udp_dgrams(const struct evl_udp *);
+int			 evl_udp_send(struct evl_udp *, const void *, size_t,
+			     const struct sockaddr *, socklen_t);
+int			 evl_udp_sendseg(struct evl_udp *, const void *,
+			     size_t, size_t, const struct sockaddr *,
+			     socklen_t);
+int			 evl_udp_flush(struct evl_udp *);
+void			 evl_udp_destroy(struct evl_udp *);
+
+struct evl_listener	*evl_listener_create(struct evl_base *, int,
+			     unsigned int, void (*)(int,
+			     const struct sockaddr *, socklen_t, void *),
+			     void *);
+struct evl_listener	*evl_listener_bind(struct evl_base *,
+			     const struct sockaddr *, socklen_t, unsigned int,
+			     void (*)(int, const struct sockaddr *, socklen_t,
+			     void *), void *);
+int			 evl_listener_fd(const struct evl_listener *);
+int			 evl_listener_add(struct evl_listener *);
+int			 evl_listener_del(struct evl_listener *);
+void			 evl_listener_destroy(struct evl_listener *);
+
+struct evl_transfer	*evl_transfer_create(struct evl_base *, int, int,
+			     off_t, void (*)(struct evl_transfer *, int,
+			     void *), void *);
+void			 evl_transfer_lowat(struct evl_transfer *, size_t);
+int			 evl_transfer_add(struct evl_transfer *);
+int			 evl_transfer_del(struct evl_transfer *);
+off_t			 evl_transfer_bytes(const struct evl_transfer *);
+int			 evl_transfer_error(const struct evl_transfer *);
+void			 evl_transfer_destroy(struct evl_transfer *);
+
+struct evl_aio		*evl_aio_create(struct evl_base *, int,
+			     void (*)(int, int, void *), void *);
+int			 evl_aio_read(struct evl_aio *, void *, size_t);
+int			 evl_aio_read_bufs(struct evl_aio *,
+			     struct evl_aio_bufs *);
+int			 evl_aio_write(struct evl_aio *, const void *, size_t);
+int			 evl_aio_accept(struct evl_aio *);
+void			*evl_aio_buf(struct evl_aio *);
+int			 evl_aio_pending(const struct evl_aio *);
+int			 evl_aio_cancel(struct evl_aio *);
+void			 evl_aio_destroy(struct evl_aio *);
+
+struct evl_aio_bufs	*evl_aio_bufs_create(unsigned int, size_t);
+size_t			 evl_aio_bufs_size(const struct evl_aio_bufs *);
+void			*evl_aio_bufs_get(struct evl_aio_bufs *);
+void			 evl_aio_bufs_put(struct evl_aio_bufs *, void *);
+void			 evl_aio_bufs_destroy(struct evl_aio_bufs *);
+
+struct evl_co		*evl_co_create(struct evl_base *,
+			     void (*)(struct evl_co *, void *), void *);
+struct evl_base		*evl_co_base(const struct evl_co *);
+ssize_t			 evl_co_read(struct evl_co *, int, void *, size_t);
+ssize_t			 evl_co_write(struct evl_co *, int, const void *,
+			     size_t);
+int			 evl_co_accept(struct evl_co *, int,
+			     struct sockaddr *, socklen_t *);
+int			 evl_co_sleep(struct evl_co *, const struct timespec *);
+
+__END_DECLS
 
 #define EVL_READ		(1 << 16)
 #define EVL_WRITE		(1 << 17)
 #define EVL_TIMEOUT		(1 << 18)
-#ifdef notyet
 #define EVL_SIGNAL		(1 << 19)
 #define EVL_WAIT		(1 << 20)
-#endif
 #define EVL_WORK		(1 << 21)
 #define EVL_PERSIST		(1 << 22)
 
+#define EVL_LOOP_ONCE		(1 << 0)	/* return after running work */
+#define EVL_LOOP_NONBLOCK	(1 << 1)	/* don't wait for events */
+
+#define EVL_UDP_GRO		(1 << 0)
+#define EVL_UDP_GSO		(1 << 1)
+
+#define EVL_TRANSFER_DONE	(1 << 0)
+#define EVL_TRANSFER_ERROR	(1 << 1)
+#define EVL_TRANSFER_LOWAT	(1 << 2)
+
+/* number of deliveries coalesced into one EVL_SIGNAL fire */
+#define EVL_COUNT_MASK		0xffff
+#define EVL_SIG_COUNT(_ev)	((_ev) & EVL_COUNT_MASK)
+
 #endif /* _LIB_EVL_H */
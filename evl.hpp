@@ -0,0 +1,341 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVL_HPP_
+#define _LIB_EVL_HPP_
+
+/*
+ * C++ wrappers for the event loop library.
+ *
+ * the callback objects are stored inline in the wrappers and are
+ * called from a trampoline that is instantiated for their type, so
+ * there is no std::function or other allocation per event, and the
+ * compiler can inline the callback into the trampoline. the C event
+ * is given the address of the wrapper as its argument, which is
+ * updated when the wrapper is moved.
+ */
+
+#if __cplusplus < 201703L
+#error "evl.hpp needs C++17"
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <evl.h>
+
+namespace evl {
+
+namespace detail {
+
+[[noreturn]] inline void
+throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+template <typename Rep, typename Period>
+inline struct timespec
+to_timespec(std::chrono::duration<Rep, Period> d)
+{
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d);
+	struct timespec ts;
+
+	ts.tv_sec = ns.count() / 1000000000;
+	ts.tv_nsec = ns.count() % 1000000000;
+
+	return (ts);
+}
+
+} /* namespace detail */
+
+/*
+ * calls a member function picked at compile time on an object, eg,
+ * evl::method<&conn::readable>(this).
+ */
+template <auto M, typename T>
+struct method_fn {
+	T	*obj;
+
+	template <typename... A>
+	void
+	operator()(A... a) const
+	{
+		(obj->*M)(a...);
+	}
+};
+
+template <auto M, typename T>
+inline method_fn<M, T>
+method(T *obj)
+{
+	return (method_fn<M, T>{ obj });
+}
+
+class base {
+public:
+	base() : evlb_(evl_init())
+	{
+		if (evlb_ == nullptr)
+			detail::throw_errno("evl_init");
+	}
+
+	explicit base(const char *backend) : evlb_(evl_init_backend(backend))
+	{
+		if (evlb_ == nullptr)
+			detail::throw_errno("evl_init_backend");
+	}
+
+	base(base &&o) noexcept : evlb_(std::exchange(o.evlb_, nullptr)) { }
+
+	base &
+	operator=(base &&o) noexcept
+	{
+		std::swap(evlb_, o.evlb_);
+		return (*this);
+	}
+
+	base(const base &) = delete;
+	base &operator=(const base &) = delete;
+
+	~base()
+	{
+		if (evlb_ != nullptr)
+			evl_destroy(evlb_);
+	}
+
+	struct evl_base *get() const noexcept { return (evlb_); }
+
+	int dispatch() noexcept { return (evl_dispatch(evlb_)); }
+	int loop(int flags) noexcept { return (evl_loop(evlb_, flags)); }
+	void loopbreak() noexcept { evl_break(evlb_); }
+
+private:
+	struct evl_base	*evlb_;
+};
+
+/* F is called with the fd and the events that fired */
+template <typename F>
+class io {
+public:
+	io(base &evlb, int fd, int events, F fn) : fn_(std::move(fn))
+	{
+		evlio_ = evl_io_create(evlb.get(), fd, events, &io::fire,
+		    this);
+		if (evlio_ == nullptr)
+			detail::throw_errno("evl_io_create");
+	}
+
+	io(io &&o) noexcept(std::is_nothrow_move_constructible_v<F>) :
+	    evlio_(std::exchange(o.evlio_, nullptr)), fn_(std::move(o.fn_))
+	{
+		if (evlio_ != nullptr)
+			evl_io_set_arg(evlio_, this);
+	}
+
+	/* closures that capture aren't assignable, so rebuild in place */
+	io &
+	operator=(io &&o) noexcept
+	{
+		static_assert(std::is_nothrow_move_constructible_v<F>,
+		    "io move assignment needs a nothrow move of F");
+
+		if (this != &o) {
+			this->~io();
+			new (this) io(std::move(o));
+		}
+		return (*this);
+	}
+
+	io(const io &) = delete;
+	io &operator=(const io &) = delete;
+
+	~io()
+	{
+		if (evlio_ != nullptr) {
+			evl_io_del(evlio_);
+			evl_io_destroy(evlio_);
+		}
+	}
+
+	struct evl_io *get() const noexcept { return (evlio_); }
+
+	int add() noexcept { return (evl_io_add(evlio_)); }
+	int del() noexcept { return (evl_io_del(evlio_)); }
+	int pending() const noexcept { return (evl_io_pending(evlio_)); }
+	void modify(int events) noexcept { evl_io_modify(evlio_, events); }
+	int fd() const noexcept { return (evl_io_fd(evlio_)); }
+
+private:
+	static void
+	fire(int fd, int events, void *arg)
+	{
+		static_cast<io *>(arg)->fn_(fd, events);
+	}
+
+	struct evl_io	*evlio_;
+	F		 fn_;
+};
+
+/* F is called with no arguments */
+template <typename F>
+class tmo {
+public:
+	tmo(base &evlb, F fn) : fn_(std::move(fn))
+	{
+		evlt_ = evl_tmo_create(evlb.get(), &tmo::fire, this);
+		if (evlt_ == nullptr)
+			detail::throw_errno("evl_tmo_create");
+	}
+
+	tmo(tmo &&o) noexcept(std::is_nothrow_move_constructible_v<F>) :
+	    evlt_(std::exchange(o.evlt_, nullptr)), fn_(std::move(o.fn_))
+	{
+		if (evlt_ != nullptr)
+			evl_tmo_set_arg(evlt_, this);
+	}
+
+	/* closures that capture aren't assignable, so rebuild in place */
+	tmo &
+	operator=(tmo &&o) noexcept
+	{
+		static_assert(std::is_nothrow_move_constructible_v<F>,
+		    "tmo move assignment needs a nothrow move of F");
+
+		if (this != &o) {
+			this->~tmo();
+			new (this) tmo(std::move(o));
+		}
+		return (*this);
+	}
+
+	tmo(const tmo &) = delete;
+	tmo &operator=(const tmo &) = delete;
+
+	~tmo()
+	{
+		if (evlt_ != nullptr) {
+			evl_tmo_del(evlt_);
+			evl_tmo_destroy(evlt_);
+		}
+	}
+
+	struct evl_tmo *get() const noexcept { return (evlt_); }
+
+	int
+	add(const struct timespec &ts) noexcept
+	{
+		return (evl_tmo_add(evlt_, &ts));
+	}
+
+	template <typename Rep, typename Period>
+	int
+	add(std::chrono::duration<Rep, Period> d) noexcept
+	{
+		struct timespec ts = detail::to_timespec(d);
+
+		return (evl_tmo_add(evlt_, &ts));
+	}
+
+	int del() noexcept { return (evl_tmo_del(evlt_)); }
+
+	int
+	pending() const noexcept
+	{
+		return (evl_tmo_pending(evlt_, nullptr));
+	}
+
+private:
+	static void
+	fire(int nil, int events, void *arg)
+	{
+		static_cast<tmo *>(arg)->fn_();
+	}
+
+	struct evl_tmo	*evlt_;
+	F		 fn_;
+};
+
+/* F is called with the ident and the fires that were added */
+template <typename F>
+class work {
+public:
+	work(base &evlb, int ident, F fn) : fn_(std::move(fn))
+	{
+		evlw_ = evl_work_create(evlb.get(), ident, &work::fire, this);
+		if (evlw_ == nullptr)
+			detail::throw_errno("evl_work_create");
+	}
+
+	work(work &&o) noexcept(std::is_nothrow_move_constructible_v<F>) :
+	    evlw_(std::exchange(o.evlw_, nullptr)), fn_(std::move(o.fn_))
+	{
+		if (evlw_ != nullptr)
+			evl_work_set_arg(evlw_, this);
+	}
+
+	/* closures that capture aren't assignable, so rebuild in place */
+	work &
+	operator=(work &&o) noexcept
+	{
+		static_assert(std::is_nothrow_move_constructible_v<F>,
+		    "work move assignment needs a nothrow move of F");
+
+		if (this != &o) {
+			this->~work();
+			new (this) work(std::move(o));
+		}
+		return (*this);
+	}
+
+	work(const work &) = delete;
+	work &operator=(const work &) = delete;
+
+	~work()
+	{
+		if (evlw_ != nullptr) {
+			evl_work_del(evlw_);
+			evl_work_destroy(evlw_);
+		}
+	}
+
+	struct evl_work *get() const noexcept { return (evlw_); }
+
+	int add(int fires) noexcept { return (evl_work_add(evlw_, fires)); }
+	int del() noexcept { return (evl_work_del(evlw_)); }
+	int pending() const noexcept { return (evl_work_pending(evlw_)); }
+
+private:
+	static void
+	fire(int ident, int fires, void *arg)
+	{
+		static_cast<work *>(arg)->fn_(ident, fires);
+	}
+
+	struct evl_work	*evlw_;
+	F		 fn_;
+};
+
+} /* namespace evl */
+
+#endif /* _LIB_EVL_HPP_ */